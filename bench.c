@@ -0,0 +1,2177 @@
+// bench.c
+// Loopback microbenchmarks for triad.
+//
+// Usage: triadbench <benchmark> [options]
+//
+// Each benchmark starts the nodes it needs in this process (`local' forks a
+// second one) on 127.0.0.x addresses, silences what nodes print on stdout as they join and leave
+// while it runs, and prints its results on stdout once it is done (or, for the
+// slow ones, as they come; see report).
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "inet.h"
+#include "triad.h"
+
+#define RING_MOST 65535  /* nodes ring_address has addresses for */
+
+static int saved_stdout = -1;
+
+static void quiet(void)
+{
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	int fd = open("/dev/null", O_WRONLY);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+static void loud(void)
+{
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+}
+
+/* prints on the stdout quiet silenced, for results that should show up as
+ * they come rather than once the nodes are stopped */
+static void report(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	vdprintf(saved_stdout, format, ap);
+	va_end(ap);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static int compare_id(const void *a, const void *b)
+{
+	chord_id_t x = *(const chord_id_t *)a, y = *(const chord_id_t *)b;
+	return ((x > y) - (x < y));
+}
+
+/* the successor of `id' among the `count' sorted ids in `ids' */
+static chord_id_t ring_successor(chord_id_t *ids, int count, chord_id_t id)
+{
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ids[(lo == count) ? 0 : lo];
+}
+
+/* whether `n' agrees with the ring of sorted `ids' on its neighbours (and
+ * on its fingers if `fingers') */
+static int ring_settled(node_t *n, chord_id_t *ids, int count, int fingers)
+{
+	int f;
+	chord_id_t predecessor = ((n->id == ids[0]) ? ids[count - 1] : 0);
+	for (f = 1; (f < count) && !predecessor; f++)
+		if (ids[f] == n->id)
+			predecessor = ids[f - 1];
+	if ((n->successor != ring_successor(ids, count, n->id + 1)) || (n->predecessor != predecessor))
+		return 0;
+	for (f = 0; fingers && (f < KEYSPACE); f++)
+		if (n->finger_table[f].successor != ring_successor(ids, count, n->finger_table[f].start))
+			return 0;
+	return 1;
+}
+
+/* waits for stabilization to settle the whole ring */
+static void ring_wait(node_t **nodes, int count)
+{
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	int i;
+	for (i = 0; i < count; i++)
+		ids[i] = nodes[i]->id;
+	qsort(ids, count, sizeof(chord_id_t), compare_id);
+	for (i = 0; i < count; i++)
+		while (!ring_settled(nodes[i], ids, count, 1))
+			usleep(1000);
+	free(ids);
+}
+
+/* the address of node `i' of a ring, for 1 <= `i' <= RING_MOST */
+static void ring_address(char *ip, int i)
+{
+	snprintf(ip, 16, "127.0.%d.%d", (i / 256) & 255, i % 256);
+}
+
+/* whether ring_address has addresses for nodes 1 through `last' */
+static int ring_fits(int last)
+{
+	if (last <= RING_MOST)
+		return 1;
+	fprintf(stderr, "at most %d nodes have addresses on 127.0.x.y\n", RING_MOST);
+	return 0;
+}
+
+/* starts `count' nodes on 127.0.0.1 and up and joins them into one ring,
+ * stabilizing every `interval' ms until it has settled */
+static node_t **ring_start_paced(int count, int interval)
+{
+	node_t **nodes = malloc(count * sizeof(node_t *));
+	char ip[16];
+	int i;
+	for (i = 0; i < count; i++) {
+		ring_address(ip, i + 1);
+		nodes[i] = triad_init(ip);
+		nodes[i]->stabilize_interval = interval;
+		triad_join(nodes[i], (i ? "127.0.0.1" : ip));
+	}
+	ring_wait(nodes, count);
+	for (i = 0; i < count; i++)
+		nodes[i]->stabilize_interval = STABILIZE_INTERVAL;
+	return nodes;
+}
+
+static node_t **ring_start(int count)
+{
+	return ring_start_paced(count, 20);
+}
+
+static void ring_stop(node_t **nodes, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		triad_deinit(nodes[i]);
+		free(nodes[i]);
+	}
+	free(nodes);
+}
+
+static chord_id_t random_id(void)
+{
+	return (chord_id_t)(((unsigned long long)rand() << 48) ^ ((unsigned long long)rand() << 32) ^ ((unsigned long long)rand() << 16) ^ (unsigned long long)rand());
+}
+
+
+/**
+ * rpc: per-call cost of a round trip to a local node
+ */
+
+/* the original transport: a socket is opened, bound and closed per call */
+static chord_id_t legacy_get_successor(endpoint_t *e)
+{
+	chord_id_t ret = 0;
+	inet_host_t local, remote;
+	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
+	struct in_addr in = { e->addr };
+	inet_setup(&remote, IN_PROT_UDP, in, ntohs(e->port));
+	msg_t m;
+	m.type = MSG_GET_SUCCESSOR;
+	m.to = e->id;
+	msg_send(&local, &remote, &m);
+	msg_t ack;
+	if ((msg_receive(&remote, &local, &ack, -1) > 0) && (ack.type == MSG_GET_SUCCESSOR_ACK))
+		ret = ack.data[0];
+	inet_close(&local);
+	return ret;
+}
+
+static int bench_rpc(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int i;
+	double t0, legacy, pooled;
+
+	quiet();
+	node_t *n = triad_init("127.0.0.1");
+	triad_join(n, "127.0.0.1");
+
+	t0 = now();
+	for (i = 0; i < count; i++)
+		legacy_get_successor(&(n->endpoint));
+	legacy = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < count; i++)
+		rpc_get_successor(n, n->id);
+	pooled = now() - t0;
+
+	triad_deinit(n);
+	free(n);
+	loud();
+
+	printf("rpc: %d calls\n", count);
+	printf("  open/bind/close per call: %8.2f us/call\n", (legacy * 1e6) / count);
+	printf("  persistent client socket: %8.2f us/call\n", (pooled * 1e6) / count);
+	return 0;
+}
+
+
+/**
+ * local: round trips to a node in the same process and in another one, over
+ * UDP and through shared memory
+ */
+
+static double local_run(node_t *n, chord_id_t id, int count)
+{
+	double t0;
+	int i;
+	for (i = 0; i < 100; i++)
+		rpc_get_successor(n, id);
+	t0 = now();
+	for (i = 0; i < count; i++)
+		rpc_get_successor(n, id);
+	return ((now() - t0) * 1e6) / count;
+}
+
+/* serves at 127.0.0.3 until told to quit on `in', switching transport_shared
+ * as told and confirming on `out' */
+static void local_child(int in, int out)
+{
+	node_t *n = triad_init("127.0.0.3");
+	char c = 'r';
+	write(out, &c, 1);
+	while ((read(in, &c, 1) == 1) && (c != 'q')) {
+		transport_shared = (c == '1');
+		write(out, &c, 1);
+	}
+	triad_deinit(n);
+	free(n);
+	exit(0);
+}
+
+static int bench_local(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int down[2], up[2], mode;
+	double times[2][2];
+	endpoint_t e;
+	char c;
+
+	quiet();
+	pipe(down);
+	pipe(up);
+	pid_t child = fork();
+	if (!child) {
+		close(down[1]);
+		close(up[0]);
+		local_child(down[0], up[1]);
+	}
+	close(down[0]);
+	close(up[1]);
+	node_t *a = triad_init("127.0.0.1"), *b = triad_init("127.0.0.2");
+	triad_introduce(a, &(b->endpoint));
+	read(up[0], &c, 1);
+	triad_endpoint_at(&e, "127.0.0.3", RPC_PORT, 0);
+	triad_introduce(a, &e);
+	for (mode = 0; mode < 2; mode++) {
+		c = '0' + mode;
+		write(down[1], &c, 1);
+		read(up[0], &c, 1);
+		transport_shared = mode;
+		times[mode][0] = local_run(a, b->id, count);
+		times[mode][1] = local_run(a, e.id, count);
+	}
+	c = 'q';
+	write(down[1], &c, 1);
+	waitpid(child, NULL, 0);
+	triad_deinit(a);
+	triad_deinit(b);
+	free(a);
+	free(b);
+	loud();
+
+	printf("local: %d round trips\n", count);
+	printf("                      same process   other process\n");
+	printf("  UDP:                %9.2f us    %9.2f us\n", times[0][0], times[0][1]);
+	printf("  shared memory:      %9.2f us    %9.2f us\n", times[1][0], times[1][1]);
+	return 0;
+}
+
+
+/**
+ * trace: cost of tracing, per record and per round trip
+ */
+
+static double trace_run(node_t *n, int count, int level)
+{
+	int i;
+	trace_level = level;
+	double t0 = now();
+	for (i = 0; i < count; i++)
+		rpc_get_successor(n, n->id);
+	t0 = now() - t0;
+	trace_level = TRACE_OFF;
+	return (t0 * 1e6) / count;
+}
+
+static int bench_trace(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int records = 10000000, i;
+	msg_t m;
+	double t0, off, on;
+
+	m.type = MSG_GET_SUCCESSOR;
+	m.rid = 1;
+	t0 = now();
+	for (i = 0; i < records; i++)
+		TRACE(TRACE_MESSAGES, TRACE_CALL, i, 0, NULL, &m);
+	off = now() - t0;
+	trace_level = TRACE_MESSAGES;
+	t0 = now();
+	for (i = 0; i < records; i++)
+		TRACE(TRACE_MESSAGES, TRACE_CALL, i, 0, NULL, &m);
+	on = now() - t0;
+	trace_level = TRACE_OFF;
+
+	quiet();
+	node_t *n = triad_init("127.0.0.1");
+	triad_join(n, "127.0.0.1");
+	double calls[3];
+	for (i = TRACE_OFF; i <= TRACE_MESSAGES; i++)
+		calls[i] = trace_run(n, count, i);
+	trace_clear();
+	trace_run(n, 10, TRACE_MESSAGES);
+	FILE *null = fopen("/dev/null", "w");
+	int dumped = trace_dump(null);
+	fclose(null);
+	triad_deinit(n);
+	free(n);
+	loud();
+
+	printf("trace: %d records, %d calls (TRACE_LEVEL %d compiled in)\n", records, count, TRACE_LEVEL);
+	printf("  record, tracing off:      %8.2f ns\n", (off * 1e9) / records);
+	printf("  record, tracing on:       %8.2f ns\n", (on * 1e9) / records);
+	printf("  call, tracing off:        %8.2f us\n", calls[TRACE_OFF]);
+	printf("  call, tracing events:     %8.2f us\n", calls[TRACE_EVENTS]);
+	printf("  call, tracing messages:   %8.2f us\n", calls[TRACE_MESSAGES]);
+	printf("  records of 10 calls:      %8d\n", dumped);
+	return 0;
+}
+
+/**
+ * stats: metrics of a run of lookups, scraped from another node
+ */
+
+static int bench_stats(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 10000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 16);
+	int scrapes = 100, ok = 1, i;
+	size_t w, words = sizeof(stats_t) / sizeof(unsigned long long);
+	stats_t *before = malloc(sizeof(stats_t)), *after = malloc(sizeof(stats_t));
+	unsigned long long *b = (unsigned long long *)before, *a = (unsigned long long *)after;
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	stats_collect(before);
+	double t0 = now();
+	for (i = 0; i < count; i++) {
+		node_t *n = nodes[i % size];
+		n->routing = ((i & 1) ? ROUTE_RECURSIVE : ROUTE_ITERATIVE);
+		location_clear(n);
+		route_successor(n, random_id(), NULL);
+	}
+	double lookups = now() - t0;
+	t0 = now();
+	for (i = 0; i < scrapes; i++)
+		stats_collect(after);
+	double collect = now() - t0;
+	t0 = now();
+	chord_id_t scraped = nodes[size - 1]->id;
+	for (i = 0; i < scrapes; i++)
+		ok &= rpc_get_stats(nodes[0], scraped, after);
+	double scrape = now() - t0;
+	ring_stop(nodes, size);
+	loud();
+
+	if (!ok) {
+		printf("stats: scraping node %" PRIid " failed!\n", scraped);
+		return 1;
+	}
+	for (w = 0; w < words; w++)
+		a[w] -= b[w];
+	printf("stats: %d lookups on a %d node ring, half iterative (%.2f us/lookup)\n", count, size, (lookups * 1e6) / count);
+	printf("  stats_collect:            %8.2f us\n", (collect * 1e6) / scrapes);
+	printf("  MSG_GET_STATS scrape:     %8.2f us\n", (scrape * 1e6) / scrapes);
+	printf("  what the lookups did, stabilization and scrapes included:\n");
+	stats_print(after, stdout);
+	free(before);
+	free(after);
+	return 0;
+}
+
+/**
+ * pipeline: many outstanding calls on one client socket
+ */
+
+typedef struct pipeline {
+	chord_id_t target;
+	int issued;
+	int completed;
+	int total;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} pipeline_t;
+
+static void pipeline_issue(node_t *, pipeline_t *);
+
+static void pipeline_done(node_t *n, void *arg, msg_t *ack)
+{
+	pipeline_t *p = (pipeline_t *)arg;
+	pthread_mutex_lock(&(p->lock));
+	p->completed++;
+	pthread_cond_signal(&(p->cond));
+	pthread_mutex_unlock(&(p->lock));
+	pipeline_issue(n, p);
+}
+
+static void pipeline_issue(node_t *n, pipeline_t *p)
+{
+	msg_t m;
+	m.type = MSG_GET_SUCCESSOR;
+	for (;;) {
+		pthread_mutex_lock(&(p->lock));
+		int go = (p->issued < p->total);
+		if (go)
+			p->issued++;
+		pthread_mutex_unlock(&(p->lock));
+		if (!go || (rpc_call_async(n, p->target, &m, 1000, pipeline_done, p) >= 0))
+			return;
+		/* a call that could not be sent never calls back */
+		pthread_mutex_lock(&(p->lock));
+		p->completed++;
+		pthread_cond_signal(&(p->cond));
+		pthread_mutex_unlock(&(p->lock));
+	}
+}
+
+static int bench_pipeline(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 50000);
+	int window = ((argc > 1) ? atoi(argv[1]) : 64);
+	int i;
+	double t0, serial, pipelined;
+
+	quiet();
+	node_t *server = triad_init("127.0.0.1");
+	node_t *client = triad_init("127.0.0.2");
+	triad_join(server, "127.0.0.1");
+	triad_introduce(client, &(server->endpoint));
+
+	t0 = now();
+	for (i = 0; i < count; i++)
+		rpc_get_successor(client, server->id);
+	serial = now() - t0;
+
+	pipeline_t p;
+	memset(&p, 0, sizeof(p));
+	p.target = server->id;
+	p.total = count;
+	pthread_mutex_init(&(p.lock), NULL);
+	pthread_cond_init(&(p.cond), NULL);
+	t0 = now();
+	for (i = 0; i < window; i++)
+		pipeline_issue(client, &p);
+	pthread_mutex_lock(&(p.lock));
+	while (p.completed < p.total)
+		pthread_cond_wait(&(p.cond), &(p.lock));
+	pthread_mutex_unlock(&(p.lock));
+	pipelined = now() - t0;
+
+	triad_deinit(client);
+	triad_deinit(server);
+	free(client);
+	free(server);
+	loud();
+
+	printf("pipeline: %d calls\n", count);
+	printf("  one call at a time:       %10.0f calls/s\n", count / serial);
+	printf("  %4d calls outstanding:   %10.0f calls/s\n", window, count / pipelined);
+	return 0;
+}
+
+
+/**
+ * mmsg: pipelined calls over UDP, one system call per datagram vs. batches
+ */
+
+/* seconds of CPU time this process has used */
+static double cpu_time(void)
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return (r.ru_utime.tv_sec + r.ru_stime.tv_sec) + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+}
+
+/* runs `count' calls from each of `clients' nodes to one server, `window' of
+ * them outstanding per client, on `ops' with transport_batch at `batch' and
+ * the sockets busy-polling for `busy' us; returns calls/s and CPU seconds,
+ * and whether the server ran on a driver of its own in `driven' if given */
+static double mmsg_run(const transport_ops_t *ops, int count, int clients, int window, int batch, int busy, double *cpu, int *driven)
+{
+	node_t *server, *nodes[16];
+	pipeline_t p[16];
+	char ip[INET_ADDRSTRLEN];
+	int c, i;
+	double t0, c0, elapsed;
+
+	triad_transport(ops);
+	transport_batch = batch;
+	transport_busy_poll = busy;
+	server = triad_init("127.0.0.1");
+	triad_join(server, "127.0.0.1");
+	for (c = 0; c < clients; c++) {
+		ring_address(ip, c + 2);
+		nodes[c] = triad_init(ip);
+		triad_introduce(nodes[c], &(server->endpoint));
+		memset(&(p[c]), 0, sizeof(p[c]));
+		p[c].target = server->id;
+		p[c].total = count;
+		pthread_mutex_init(&(p[c].lock), NULL);
+		pthread_cond_init(&(p[c].cond), NULL);
+	}
+
+	t0 = now();
+	c0 = cpu_time();
+	for (c = 0; c < clients; c++)
+		for (i = 0; i < window; i++)
+			pipeline_issue(nodes[c], &(p[c]));
+	for (c = 0; c < clients; c++) {
+		pthread_mutex_lock(&(p[c].lock));
+		while (p[c].completed < p[c].total)
+			pthread_cond_wait(&(p[c].cond), &(p[c].lock));
+		pthread_mutex_unlock(&(p[c].lock));
+	}
+	elapsed = now() - t0;
+	*cpu = cpu_time() - c0;
+	if (driven)
+		*driven = (server->transport->driver != NULL);
+
+	for (c = 0; c < clients; c++) {
+		triad_deinit(nodes[c]);
+		free(nodes[c]);
+	}
+	triad_deinit(server);
+	free(server);
+	triad_transport(&transport_udp);
+	return (double)count * clients / elapsed;
+}
+
+static int bench_mmsg(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 50000);
+	int clients = ((argc > 1) ? atoi(argv[1]) : 4);
+	int window = ((argc > 2) ? atoi(argv[2]) : 64);
+	int shared = transport_shared, batch = transport_batch, r;
+	struct {
+		const char *label;
+		int batch;
+		int busy;
+	} runs[] = {
+		{ "recvfrom/sendto", 1, 0 },
+		{ "recvmmsg/sendmmsg", RPC_BATCH, 0 },
+		{ "mmsg + 50us busy poll", RPC_BATCH, 50 },
+	};
+	double rate[3], cpu[3];
+
+	if (clients > 16)
+		clients = 16;
+	quiet();
+	/* keep the datagrams on the sockets */
+	transport_shared = 0;
+	for (r = 0; r < 3; r++)
+		rate[r] = mmsg_run(&transport_udp, count, clients, window, runs[r].batch, runs[r].busy, &(cpu[r]), NULL);
+	transport_shared = shared;
+	transport_batch = batch;
+	transport_busy_poll = 0;
+	loud();
+
+	printf("mmsg: %d calls from each of %d clients, %d outstanding each\n", count, clients, window);
+	for (r = 0; r < 3; r++)
+		printf("  %-24s %10.0f calls/s  %10.0f calls/CPU-s\n", runs[r].label, rate[r], count * clients / cpu[r]);
+	return 0;
+}
+
+
+/**
+ * uring: pipelined calls over UDP, epoll vs. io_uring
+ */
+
+static int bench_uring(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 50000);
+	int clients = ((argc > 1) ? atoi(argv[1]) : 4);
+	int shared = transport_shared, batch = transport_batch, driven = 0, w, r;
+	int windows[] = { 1, 64 };
+	const transport_ops_t *backends[] = { &transport_udp, &transport_uring };
+	const char *labels[] = { "epoll + mmsg", "io_uring" };
+	double rate[2][2], cpu[2][2];
+
+	if (clients > 16)
+		clients = 16;
+	quiet();
+	transport_shared = 0;
+	for (w = 0; w < 2; w++)
+		for (r = 0; r < 2; r++)
+			rate[w][r] = mmsg_run(backends[r], count, clients, windows[w], RPC_BATCH, 0, &(cpu[w][r]), (r ? &driven : NULL));
+	transport_shared = shared;
+	transport_batch = batch;
+	loud();
+
+	printf("uring: %d calls from each of %d clients%s\n", count, clients, (driven ? "" : " (io_uring unavailable, both on epoll)"));
+	for (w = 0; w < 2; w++)
+		for (r = 0; r < 2; r++)
+			printf("  %-14s %2d outstanding: %10.0f calls/s  %10.0f calls/CPU-s\n", labels[r], windows[w], rate[w][r], count * clients / cpu[w][r]);
+	return 0;
+}
+
+static int bench_batch(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 10000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 16);
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	chord_id_t *owners = malloc(count * sizeof(chord_id_t));
+	unsigned int *hops = malloc(count * sizeof(unsigned int));
+	chord_id_t *ring = malloc(size * sizeof(chord_id_t));
+	unsigned long total = 0;
+	char owner[INET_ADDRSTRLEN];
+	int i, wrong = 0, lost = 0;
+	double t0, single, batched;
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < count; i++)
+		ids[i] = random_id();
+
+	/* batches do not go through the location cache, so keep single
+	 * lookups from using it either */
+	t0 = now();
+	for (i = 0; i < count; i++) {
+		location_clear(nodes[0]);
+		triad_lookup(nodes[0], ids[i], owner);
+	}
+	single = now() - t0;
+
+	t0 = now();
+	triad_lookup_batch(nodes[0], ids, count, owners, hops);
+	batched = now() - t0;
+	for (i = 0; i < size; i++)
+		ring[i] = nodes[i]->id;
+	qsort(ring, size, sizeof(chord_id_t), compare_id);
+	/* no lookup takes as many hops as there are nodes */
+	for (i = 0; i < count; i++) {
+		total += hops[i];
+		wrong += (owners[i] != ring_successor(ring, size, ids[i]));
+		lost += (hops[i] >= (unsigned int)size);
+	}
+
+	ring_stop(nodes, size);
+	loud();
+
+	printf("batch: %d keys on a %d node ring (%.2f hops/key)\n", count, size, (double)total / count);
+	printf("  triad_lookup:       %10.0f keys/s\n", count / single);
+	printf("  triad_lookup_batch: %10.0f keys/s\n", count / batched);
+	if (wrong || lost)
+		printf("  %d owners wrong, %d hop counts impossible!\n", wrong, lost);
+	free(ids);
+	free(owners);
+	free(hops);
+	free(ring);
+	return (wrong || lost);
+}
+
+
+/**
+ * allocs: heap allocations per lookup, which should be none
+ */
+
+#if !defined(__SANITIZE_ADDRESS__)
+/* every allocation in the process, counted while alloc_counting is set;
+ * glibc exports the allocator under these names as well */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static volatile int alloc_counting;
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+	if (alloc_counting)
+		__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	if (alloc_counting)
+		__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	if (alloc_counting)
+		__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, size);
+}
+
+/* allocations per lookup of `count' lookups from every node in turn, each
+ * after clearing the location cache if `cold'; all of them warmed up once
+ * first, so that pools and per-thread state are in place */
+static double allocs_run(node_t **nodes, int size, chord_id_t *ids, int count, routing_t routing, int cold)
+{
+	char owner[INET_ADDRSTRLEN];
+	int i, pass;
+	for (i = 0; i < size; i++)
+		nodes[i]->routing = routing;
+	for (pass = 0; pass < 2; pass++) {
+		allocs = 0;
+		alloc_counting = pass;
+		for (i = 0; i < count; i++) {
+			if (cold)
+				location_clear(nodes[i % size]);
+			triad_lookup(nodes[i % size], ids[i], owner);
+		}
+		alloc_counting = 0;
+	}
+	return (double)allocs / count;
+}
+
+static int bench_allocs(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 10000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 16);
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	double runs[2][2];
+	int i, r, cold, bad = 0;
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < count; i++)
+		ids[i] = random_id();
+	/* stabilization goes on meanwhile, and counts too */
+	for (r = 0; r < 2; r++)
+		for (cold = 0; cold < 2; cold++)
+			runs[r][cold] = allocs_run(nodes, size, ids, count, (r ? ROUTE_RECURSIVE : ROUTE_ITERATIVE), cold);
+	ring_stop(nodes, size);
+	loud();
+
+	printf("allocs: %d lookups on a %d node ring\n", count, size);
+	for (r = 0; r < 2; r++)
+		for (cold = 0; cold < 2; cold++) {
+			printf("  %-9s %s cache: %8.4f allocations per lookup\n", (r ? "recursive" : "iterative"), (cold ? "cold" : "warm"), runs[r][cold]);
+			bad |= (runs[r][cold] > 0);
+		}
+	free(ids);
+	return bad;
+}
+#endif
+
+
+/**
+ * route: lookup latency, iterative vs. recursive routing
+ */
+
+static double route_run(node_t **nodes, int size, chord_id_t *ids, int count, routing_t routing, unsigned long *hops)
+{
+	int i;
+	unsigned int h;
+	*hops = 0;
+	double t0 = now();
+	for (i = 0; i < count; i++) {
+		node_t *n = nodes[i % size];
+		n->routing = routing;
+		location_clear(n);
+		route_successor(n, ids[i], &h);
+		*hops += h;
+	}
+	return now() - t0;
+}
+
+static int bench_route(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 10000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 32);
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	unsigned long ihops, rhops;
+	int i;
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < count; i++)
+		ids[i] = random_id();
+	double iterative = route_run(nodes, size, ids, count, ROUTE_ITERATIVE, &ihops);
+	double recursive = route_run(nodes, size, ids, count, ROUTE_RECURSIVE, &rhops);
+	ring_stop(nodes, size);
+	loud();
+
+	printf("route: %d lookups on a %d node ring\n", count, size);
+	printf("  iterative: %8.2f us/lookup  %5.2f hops/lookup  %8.2f us/hop\n", (iterative * 1e6) / count, (double)ihops / count, (iterative * 1e6) / (ihops ? ihops : 1));
+	printf("  recursive: %8.2f us/lookup  %5.2f hops/lookup  %8.2f us/hop\n", (recursive * 1e6) / count, (double)rhops / count, (recursive * 1e6) / (rhops ? rhops : 1));
+	free(ids);
+	return 0;
+}
+
+
+/**
+ * cache: repeated lookups of hot keys through the location cache
+ */
+
+static double cache_run(node_t *n, chord_id_t *ids, int count, int hot, int mode)
+{
+	int i;
+	location_clear(n);
+	n->location_verify = (mode == 2);
+	double t0 = now();
+	for (i = 0; i < count; i++) {
+		if (!mode)
+			location_clear(n);
+		find_successor(n, ids[i % hot]);
+	}
+	return now() - t0;
+}
+
+static int bench_cache(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int hot = ((argc > 1) ? atoi(argv[1]) : 64);
+	int size = ((argc > 2) ? atoi(argv[2]) : 32);
+	chord_id_t *ids = malloc(hot * sizeof(chord_id_t));
+	int i;
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < hot; i++)
+		ids[i] = random_id();
+	double uncached = cache_run(nodes[0], ids, count, hot, 0);
+	unsigned long hits = nodes[0]->location_hits, misses = nodes[0]->location_misses;
+	double cached = cache_run(nodes[0], ids, count, hot, 1);
+	hits = nodes[0]->location_hits - hits;
+	misses = nodes[0]->location_misses - misses;
+	double verified = cache_run(nodes[0], ids, count, hot, 2);
+	ring_stop(nodes, size);
+	loud();
+
+	printf("cache: %d lookups of %d hot keys on a %d node ring\n", count, hot, size);
+	printf("  no cache:        %8.2f us/lookup\n", (uncached * 1e6) / count);
+	printf("  cache:           %8.2f us/lookup\n", (cached * 1e6) / count);
+	printf("  verified cache:  %8.2f us/lookup\n", (verified * 1e6) / count);
+	printf("  (%lu hits, %lu misses without verification)\n", hits, misses);
+	free(ids);
+	return 0;
+}
+
+
+/**
+ * cpf: closest_preceding_finger, the original scan vs. the finger index
+ */
+
+/* the original: every finger from the top, with a branchy circular test */
+static chord_id_t legacy_closest_preceding_finger(node_t *n, chord_id_t id)
+{
+	int i;
+	for (i = (KEYSPACE - 1); i >= 0; i--) {
+		chord_id_t check = n->finger_table[i].successor;
+		if (in_range_ex_ex_circular(n->id, id, check))
+			return check;
+	}
+	return n->id;
+}
+
+/* a node whose fingers point into a ring of `size' random ids */
+static node_t *cpf_node(int size)
+{
+	node_t *n = calloc(1, sizeof(node_t));
+	chord_id_t *ids = malloc(size * sizeof(chord_id_t));
+	int i, f;
+	for (i = 0; i < size; i++)
+		ids[i] = random_id();
+	qsort(ids, size, sizeof(chord_id_t), compare_id);
+	n->id = ids[rand() % size];
+	for (f = 0; f < KEYSPACE; f++) {
+		n->finger_table[f].start = n->id + ((chord_id_t)1 << f);
+		n->finger_table[f].successor = ring_successor(ids, size, n->finger_table[f].start);
+	}
+	finger_index(n);
+	free(ids);
+	return n;
+}
+
+static int bench_cpf(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 10000000);
+	int sizes[] = { 8, 64, 1024, 65536 }, s, k, i;
+	const char *kernels[] = { "scalar", "sse2", "sse4.2", "avx2" };
+	chord_id_t *keys = malloc(4096 * sizeof(chord_id_t)), sum = 0;
+	for (i = 0; i < 4096; i++)
+		keys[i] = random_id();
+
+	printf("cpf: %d calls of closest_preceding_finger per ring size\n", count);
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		node_t *n = cpf_node(sizes[s]);
+		int wrong = 0;
+		double t0 = now();
+		for (i = 0; i < count; i++)
+			sum += legacy_closest_preceding_finger(n, keys[i & 4095]);
+		printf("  %6d nodes  original scan: %6.2f ns/call\n", sizes[s], ((now() - t0) * 1e9) / count);
+		for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+			const char *kernel = finger_kernel(kernels[k]);
+			if (!kernel)
+				continue;
+			for (i = 0; i < 4096; i++)
+				wrong += (closest_preceding_finger(n, keys[i]) != legacy_closest_preceding_finger(n, keys[i]));
+			t0 = now();
+			for (i = 0; i < count; i++)
+				sum += closest_preceding_finger(n, keys[i & 4095]);
+			printf("  %6d nodes  index, %-6s: %6.2f ns/call\n", sizes[s], kernel, ((now() - t0) * 1e9) / count);
+		}
+		if (wrong)
+			printf("  %d results differ from the original scan\n", wrong);
+		free(n);
+	}
+	finger_kernel(NULL);
+	free(keys);
+	return (sum == 42);
+}
+
+
+/**
+ * wire: encoding and decoding messages, and the bytes they take
+ */
+
+static int bench_wire(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		msg_type_t type;
+		int count;
+		int unit;
+	} kinds[] = {
+		{ "MSG_GET_SUCCESSOR", MSG_GET_SUCCESSOR, 0, 0 },
+		{ "MSG_FIND_NEXT_HOP_ACK", MSG_FIND_NEXT_HOP_ACK, 0, 0 },
+		{ "MSG_GET_PREDECESSOR_ACK", MSG_GET_PREDECESSOR_ACK, SUCCESSORS, sizeof(endpoint_t) },
+		{ "MSG_FIND_SUCCESSOR_BATCH", MSG_FIND_SUCCESSOR_BATCH, BATCH_KEYS, sizeof(chord_id_t) },
+		{ "MSG_PUT (100 byte value)", MSG_PUT, 116, 1 },
+	};
+	int count = ((argc > 0) ? atoi(argv[0]) : 1000000);
+	unsigned char buf[WIRE_DATAGRAM], again[WIRE_DATAGRAM];
+	unsigned int sum = 0;
+	int k, i, wrong = 0;
+	msg_t m, out;
+
+	printf("wire: %d encodes and decodes per message, version %d\n", count, WIRE_VERSION);
+	printf("  %-26s %9s %9s %10s %10s %9s\n", "", "raw", "wire", "encode", "decode", "per dgram");
+	for (k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++) {
+		endpoint_t *e = (endpoint_t *)m.payload;
+		memset(&m, 0, sizeof(m));
+		m.type = kinds[k].type;
+		m.rid = rand();
+		m.to = random_id();
+		m.data[0] = random_id();
+		m.data[1] = ((m.type == MSG_PUT) ? 16 : random_id());
+		m.addr[0] = m.addr[1] = htonl(0x7f000001);
+		m.port[0] = m.port[1] = htons(RPC_PORT);
+		m.count = kinds[k].count;
+		for (i = 0; i < (int)m.count; i++) {
+			if (kinds[k].unit == sizeof(endpoint_t)) {
+				e[i].id = random_id();
+				e[i].addr = htonl(0x7f000001 + i);
+				e[i].port = htons(RPC_PORT);
+			}
+			else if (kinds[k].unit == sizeof(chord_id_t))
+				m.batch[i] = random_id();
+			else
+				m.payload[i] = rand();
+		}
+
+		/* what decodes has to encode the same again */
+		int size = msg_encode(&m, buf, sizeof(buf));
+		if (!msg_decode(buf, size, &out) || (msg_encode(&out, again, sizeof(again)) != size) || memcmp(buf, again, size))
+			wrong++;
+
+		double t0 = now();
+		for (i = 0; i < count; i++) {
+			m.rid = i;
+			sum += msg_encode(&m, buf, sizeof(buf));
+		}
+		double encode = now() - t0;
+		t0 = now();
+		for (i = 0; i < count; i++) {
+			sum += msg_decode(buf, size, &out);
+			sum += out.rid;
+		}
+		double decode = now() - t0;
+		int raw = offsetof(msg_t, count) + (kinds[k].unit ? sizeof(m.count) + (kinds[k].count * kinds[k].unit) : 0);
+		printf("  %-26s %7d B %7d B %7.1f ns %7.1f ns %9d\n", kinds[k].name, raw, size, (encode * 1e9) / count, (decode * 1e9) / count, ((size < WIRE_COALESCE) ? (WIRE_COALESCE / size) : 1));
+	}
+	if (wrong)
+		printf("  %d messages did not survive encoding and decoding\n", wrong);
+	return (wrong || (sum == 42));
+}
+
+
+/**
+ * stress: readers of routing state racing joins and leaves
+ */
+
+typedef struct stress {
+	node_t **nodes;
+	int count;       // nodes[0 .. count - 1] stay; the rest come and go
+	int total;
+	chord_id_t *ring;  // ids of the nodes that stay, sorted
+	volatile int running;
+	pthread_mutex_t lock;
+	unsigned long snapshots, torn, raw, raw_torn, lookups, unresolved, wrong, changes;
+} stress_t;
+
+/* whether the finger index of `r' is the one its fingers call for */
+static int stress_consistent(node_t *n, route_t *r)
+{
+	chord_id_t offsets[KEYSPACE];
+	int f, i, count = 0;
+	if (r->fingers[0] != r->successor)
+		return 0;
+	for (f = 0; f < KEYSPACE; f++) {
+		chord_id_t offset = r->fingers[f] - n->id - 1;
+		if (r->fingers[f] == n->id)
+			continue;
+		for (i = 0; (i < count) && (offsets[i] != offset); i++);
+		if (i == count)
+			offsets[count++] = offset;
+	}
+	qsort(offsets, count, sizeof(chord_id_t), compare_id);
+	for (i = 0; i < KEYSPACE; i++) {
+		if (r->finger_offsets[i] != ((i < count) ? offsets[i] : ~(chord_id_t)0))
+			return 0;
+		if ((i < count) && (r->finger_nodes[i + 1] != offsets[i] + n->id + 1))
+			return 0;
+	}
+	return 1;
+}
+
+static void *stress_reader(void *arg)
+{
+	stress_t *st = (stress_t *)arg;
+	unsigned int seed = (unsigned int)(size_t)&seed;
+	unsigned long snapshots = 0, torn = 0, raw = 0, raw_torn = 0, lookups = 0, unresolved = 0, wrong = 0;
+	route_t r;
+	int f;
+	while (st->running) {
+		node_t *n = st->nodes[rand_r(&seed) % st->total];
+		route_snapshot(n, &r);
+		snapshots++;
+		torn += !stress_consistent(n, &r);
+
+		/* the same, read without the seqlock */
+		r.predecessor = n->predecessor;
+		r.successor = n->successor;
+		for (f = 0; f < KEYSPACE; f++)
+			r.fingers[f] = n->finger_table[f].successor;
+		memcpy(r.finger_offsets, n->finger_offsets, sizeof(r.finger_offsets));
+		memcpy(r.finger_nodes, n->finger_nodes, sizeof(r.finger_nodes));
+		raw++;
+		raw_torn += !stress_consistent(n, &r);
+
+		if (!(snapshots % 64)) {
+			chord_id_t id = (chord_id_t)(((unsigned long long)rand_r(&seed) << 33) ^ ((unsigned long long)rand_r(&seed) << 16) ^ rand_r(&seed)), owner;
+			n = st->nodes[rand_r(&seed) % st->count];
+			location_clear(n);
+			lookups++;
+			/* the nodes that come and go can only own the key if they
+			 * sit between it and the node that stays after it */
+			if (!(owner = find_successor(n, id)))
+				unresolved++;
+			else if (!in_range_in_in_circular(id, ring_successor(st->ring, st->count, id), owner))
+				wrong++;
+		}
+	}
+	pthread_mutex_lock(&(st->lock));
+	st->snapshots += snapshots;
+	st->torn += torn;
+	st->raw += raw;
+	st->raw_torn += raw_torn;
+	st->lookups += lookups;
+	st->unresolved += unresolved;
+	st->wrong += wrong;
+	pthread_mutex_unlock(&(st->lock));
+	return NULL;
+}
+
+static int bench_stress(int argc, char **argv)
+{
+	int readers = ((argc > 0) ? atoi(argv[0]) : 8);
+	int seconds = ((argc > 1) ? atoi(argv[1]) : 5);
+	int size = ((argc > 2) ? atoi(argv[2]) : 16);
+	pthread_t *threads = malloc(readers * sizeof(pthread_t));
+	stress_t st;
+	char ip[16];
+	int i;
+
+	if (!ring_fits(size + (size / 2)))
+		return 1;
+	quiet();
+	memset(&st, 0, sizeof(st));
+	st.count = size;
+	st.total = size + (size / 2);
+	st.nodes = realloc(ring_start(size), st.total * sizeof(node_t *));
+	for (i = size; i < st.total; i++) {
+		ring_address(ip, i + 1);
+		st.nodes[i] = triad_init(ip);
+		st.nodes[i]->stabilize_interval = 20;
+	}
+	st.ring = malloc(size * sizeof(chord_id_t));
+	for (i = 0; i < size; i++) {
+		st.nodes[i]->stabilize_interval = 20;
+		st.ring[i] = st.nodes[i]->id;
+	}
+	qsort(st.ring, size, sizeof(chord_id_t), compare_id);
+	pthread_mutex_init(&(st.lock), NULL);
+	st.running = 1;
+	for (i = 0; i < readers; i++)
+		pthread_create(&(threads[i]), NULL, stress_reader, &st);
+
+	/* churn the extra nodes in and out until time is up */
+	double t0 = now();
+	while ((now() - t0) < seconds) {
+		node_t *n = st.nodes[size + (rand() % (st.total - size))];
+		if (n->status == ST_CONNECTED)
+			triad_leave(n);
+		else {
+			ring_address(ip, (rand() % size) + 1);
+			triad_join(n, ip);
+		}
+		st.changes++;
+		usleep(5000);
+	}
+	st.running = 0;
+	for (i = 0; i < readers; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now() - t0;
+	ring_stop(st.nodes, st.total);
+	loud();
+
+	printf("stress: %d readers for %ds on a %d node ring with %d nodes joining and leaving\n", readers, seconds, size, st.total - size);
+	printf("  joins and leaves:       %8lu\n", st.changes);
+	printf("  snapshots:              %8.0f /s, %lu inconsistent\n", st.snapshots / elapsed, st.torn);
+	printf("  unsynchronized reads:   %8.0f /s, %lu inconsistent\n", st.raw / elapsed, st.raw_torn);
+	printf("  lookups:                %8.0f /s, %lu unresolved, %lu wrong\n", st.lookups / elapsed, st.unresolved, st.wrong);
+	free(threads);
+	free(st.ring);
+	return (st.torn || st.unresolved || st.wrong);
+}
+
+
+/**
+ * join: cost of joining rings of different sizes
+ */
+
+static unsigned long ring_messages(node_t **nodes, int count)
+{
+	unsigned long total = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		total += nodes[i]->messages;
+	return total;
+}
+
+static void join_run(int size, int joins)
+{
+	/* members take every other address, joiners the ones in between */
+	int total = size + joins, i, j;
+	node_t **nodes = malloc(total * sizeof(node_t *));
+	chord_id_t *ids = malloc(total * sizeof(chord_id_t));
+	int interval = ((size > 100) ? size : 100);
+	char ip[16];
+	for (i = 0; i < size; i++) {
+		ring_address(ip, (2 * i) + 1);
+		nodes[i] = triad_init(ip);
+		nodes[i]->stabilize_interval = interval;
+		triad_join(nodes[i], (i ? "127.0.0.1" : ip));
+		ids[i] = nodes[i]->id;
+	}
+	ring_wait(nodes, size);
+
+	/* traffic of a settled ring, which the joins below run on top of */
+	unsigned long m0 = ring_messages(nodes, size);
+	double t0 = now();
+	sleep(2);
+	double background = (ring_messages(nodes, size) - m0) / (now() - t0);
+
+	double latency = 0, worst = 0, settle = 0;
+	unsigned long during = 0, until = 0;
+	for (j = 0; j < joins; j++) {
+		int count = size + j, gap = rand() % size;
+		node_t *n;
+		ring_address(ip, (2 * gap) + 2);
+		for (i = size; (i < count) && (nodes[i]->id != triad_node_id(ip, RPC_PORT, 0)); i++);
+		if (i < count) {
+			j--;
+			continue;
+		}
+		n = nodes[count] = triad_init(ip);
+		n->stabilize_interval = interval;
+		ids[count++] = n->id;
+		qsort(ids, count, sizeof(chord_id_t), compare_id);
+		ring_address(ip, (2 * (rand() % size)) + 1);
+
+		m0 = ring_messages(nodes, count);
+		t0 = now();
+		triad_join(n, ip);
+		double t = now() - t0;
+		during += ring_messages(nodes, count) - m0;
+		latency += t;
+		if (t > worst)
+			worst = t;
+
+		/* settled once the joiner and both its neighbours agree */
+		chord_id_t after = ring_successor(ids, count, n->id + 1);
+		node_t *p = NULL, *s = NULL;
+		for (i = 0; i < count; i++) {
+			if (ring_successor(ids, count, nodes[i]->id + 1) == n->id)
+				p = nodes[i];
+			if (nodes[i]->id == after)
+				s = nodes[i];
+		}
+		while (!ring_settled(n, ids, count, 0) || !ring_settled(p, ids, count, 0) || !ring_settled(s, ids, count, 0))
+			usleep(1000);
+		double elapsed = now() - t0;
+		settle += elapsed;
+		until += ring_messages(nodes, count) - m0 - (unsigned long)(background * elapsed);
+	}
+
+	for (i = 0; i < total; i++) {
+		triad_deinit(nodes[i]);
+		free(nodes[i]);
+	}
+	free(nodes);
+	free(ids);
+	report("  %5d nodes: join %8.2f ms (max %8.2f ms)  %6.1f msgs during join  settled in %8.2f ms, %6.1f msgs above %.0f msgs/s of background\n", size, (latency * 1e3) / joins, worst * 1e3, (double)during / joins, (settle * 1e3) / joins, (double)until / joins, background);
+}
+
+static int bench_join(int argc, char **argv)
+{
+	int sizes[] = { 64, 256, 1024 }, i;
+	int joins = ((argc > 0) ? atoi(argv[0]) : 16);
+	quiet();
+	report("join: %d joins per ring, stabilizing every max(nodes, 100) ms\n", joins);
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+		if ((argc < 2) || (sizes[i] <= atoi(argv[1])))
+			join_run(sizes[i], joins);
+	loud();
+	return 0;
+}
+
+
+/**
+ * loss: lookup latency when the network drops datagrams
+ */
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+/* seconds a call takes to give up: its first try and RPC_RETRIES
+ * retransmissions, backing off from RPC_RTO_INIT up to RPC_RTO_MAX */
+static double loss_bound(void)
+{
+	double rto = RPC_RTO_INIT, total = 0;
+	int i;
+	for (i = 0; i <= RPC_RETRIES; i++) {
+		total += ((rto < RPC_RTO_MAX) ? rto : RPC_RTO_MAX);
+		rto *= 2;
+	}
+	return total / 1e3;
+}
+
+/* returns nonzero if a lookup went wrong or the slowest 1% of them took
+ * as long as a call that gave up (see loss_bound) */
+static int loss_run(node_t **nodes, int size, chord_id_t *ids, chord_id_t *owners, int count, routing_t routing, double rate)
+{
+	double *latency = malloc(count * sizeof(double));
+	unsigned int h;
+	int i, wrong = 0, slow;
+	inet_set_loss(rate);
+	for (i = 0; i < count; i++) {
+		node_t *n = nodes[i % size];
+		n->routing = routing;
+		location_clear(n);
+		double t0 = now();
+		if (route_successor(n, ids[i], &h) != owners[i])
+			wrong++;
+		latency[i] = now() - t0;
+	}
+	inet_set_loss(0);
+	qsort(latency, count, sizeof(double), compare_double);
+	slow = (latency[(count * 99) / 100] >= loss_bound());
+	report("  %-9s %4.1f%% loss: p50 %8.2f us  p99 %8.2f us%s  max %8.2f us  %d failed\n", ((routing == ROUTE_ITERATIVE) ? "iterative" : "recursive"), rate * 100, latency[count / 2] * 1e6, latency[(count * 99) / 100] * 1e6, (slow ? " (too slow!)" : ""), latency[count - 1] * 1e6, wrong);
+	free(latency);
+	return (wrong || slow);
+}
+
+static int bench_loss(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 2000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 16);
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	chord_id_t *owners = malloc(count * sizeof(chord_id_t));
+	double rates[] = { 0, 0.01, 0.02, 0.05 };
+	unsigned int h;
+	int i, r, bad = 0;
+
+	/* losses are injected on UDP, which co-located nodes would bypass */
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	transport_shared = 0;
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < count; i++) {
+		ids[i] = random_id();
+		owners[i] = route_successor(nodes[0], ids[i], &h);
+	}
+	report("loss: %d lookups on a %d node ring\n", count, size);
+	for (r = 0; r < (int)(sizeof(rates) / sizeof(rates[0])); r++) {
+		bad |= loss_run(nodes, size, ids, owners, count, ROUTE_ITERATIVE, rates[r]);
+		bad |= loss_run(nodes, size, ids, owners, count, ROUTE_RECURSIVE, rates[r]);
+	}
+	ring_stop(nodes, size);
+	transport_shared = 1;
+	loud();
+	free(ids);
+	free(owners);
+	return bad;
+}
+
+
+/**
+ * proximity: lookup latency with fingers picked by round-trip time
+ */
+
+/* one-way delay between two 127.0.x.y hosts: each sits at a point of the
+ * unit square drawn from its address, 20 ms apart per unit of distance */
+static double proximity_delay(const struct sockaddr_in *from, const struct sockaddr_in *to)
+{
+	unsigned int a = ntohl(from->sin_addr.s_addr) & 0xffff, b = ntohl(to->sin_addr.s_addr) & 0xffff;
+	if (a == b)
+		return 0;
+	a *= 2654435761u;
+	b *= 2654435761u;
+	double dx = ((int)(a >> 16) - (int)(b >> 16)) / 65536.0, dy = ((int)(a & 0xffff) - (int)(b & 0xffff)) / 65536.0;
+	return 0.5 + (20 * sqrt((dx * dx) + (dy * dy)));
+}
+
+typedef struct {
+	node_t **nodes;
+	int size;
+	chord_id_t *ids, *owners;
+	int first, count, step;
+	double *latency;
+	unsigned long hops;
+	int wrong;
+} proximity_client_t;
+
+static void *proximity_client(void *arg)
+{
+	proximity_client_t *c = arg;
+	unsigned int h;
+	int i;
+	for (i = 0; i < c->count; i++) {
+		node_t *n = c->nodes[i % c->size];
+		if (((i % c->size) % c->step) != c->first)
+			continue;
+		location_clear(n);
+		double t0 = now();
+		if (route_successor(n, c->ids[i], &h) != c->owners[i])
+			c->wrong++;
+		c->latency[i] = now() - t0;
+		c->hops += h;
+	}
+	return NULL;
+}
+
+static void proximity_run(node_t **nodes, int size, chord_id_t *ids, chord_id_t *owners, int count, routing_t routing, const char *label)
+{
+	proximity_client_t clients[16];
+	pthread_t threads[16];
+	double *latency = malloc(count * sizeof(double)), sum = 0;
+	unsigned long hops = 0;
+	int i, wrong = 0, threads_count = (int)(sizeof(threads) / sizeof(threads[0]));
+	for (i = 0; i < size; i++)
+		nodes[i]->routing = routing;
+	/* each thread looks up from nodes of its own, whose location caches
+	 * it clears before each lookup */
+	for (i = 0; i < threads_count; i++) {
+		clients[i] = (proximity_client_t){ nodes, size, ids, owners, i, count, threads_count, latency, 0, 0 };
+		pthread_create(&threads[i], NULL, proximity_client, &clients[i]);
+	}
+	for (i = 0; i < threads_count; i++) {
+		pthread_join(threads[i], NULL);
+		hops += clients[i].hops;
+		wrong += clients[i].wrong;
+	}
+	for (i = 0; i < count; i++)
+		sum += latency[i];
+	qsort(latency, count, sizeof(double), compare_double);
+	report("  %-9s %-9s mean %7.2f ms  p50 %7.2f ms  p99 %7.2f ms  %5.2f hops/lookup  %d wrong\n", ((routing == ROUTE_ITERATIVE) ? "iterative" : "recursive"), label, (sum * 1e3) / count, latency[count / 2] * 1e3, latency[(count * 99) / 100] * 1e3, (double)hops / count, wrong);
+	free(latency);
+}
+
+static int bench_proximity(int argc, char **argv)
+{
+	int count = ((argc > 0) ? atoi(argv[0]) : 2000);
+	int size = ((argc > 1) ? atoi(argv[1]) : 64);
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	chord_id_t *owners = malloc(count * sizeof(chord_id_t));
+	chord_id_t *ring = malloc(size * sizeof(chord_id_t));
+	int i;
+
+	/* so are delays */
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	transport_shared = 0;
+	inet_set_delay(proximity_delay);
+	node_t **nodes = ring_start(size);
+	for (i = 0; i < size; i++) {
+		ring[i] = nodes[i]->id;
+		nodes[i]->stabilize_interval = 100;
+	}
+	qsort(ring, size, sizeof(chord_id_t), compare_id);
+	for (i = 0; i < count; i++) {
+		ids[i] = random_id();
+		owners[i] = ring_successor(ring, size, ids[i]);
+	}
+	report("proximity: %d lookups on a %d node ring, 0.5-29 ms one-way delays\n", count, size);
+	proximity_run(nodes, size, ids, owners, count, ROUTE_ITERATIVE, "first");
+	proximity_run(nodes, size, ids, owners, count, ROUTE_RECURSIVE, "first");
+	/* let every finger be refreshed a few times over, the first time around
+	 * measuring the candidates and the next ones picking among them; all
+	 * delayed datagrams go out from one thread, so stabilization is kept
+	 * slow enough for it to keep up */
+	for (i = 0; i < size; i++)
+		nodes[i]->proximity = 1;
+	usleep(KEYSPACE * 2 * 100 * 1000);
+	proximity_run(nodes, size, ids, owners, count, ROUTE_ITERATIVE, "nearest");
+	proximity_run(nodes, size, ids, owners, count, ROUTE_RECURSIVE, "nearest");
+	/* the sockets stay open until the last delayed datagram went out */
+	inet_set_delay(NULL);
+	usleep(100000);
+	ring_stop(nodes, size);
+	transport_shared = 1;
+	loud();
+	free(ids);
+	free(owners);
+	free(ring);
+	return 0;
+}
+
+
+/**
+ * vnodes: keyspace balance across processes running virtual nodes
+ */
+
+static void vnodes_run(int hosts, int per_host, int lookups)
+{
+	int count = hosts * per_host, i, h, wrong = 0;
+	node_t **nodes = malloc(count * sizeof(node_t *));
+	chord_id_t *ids = malloc(count * sizeof(chord_id_t));
+	double *share = calloc(hosts, sizeof(double));
+
+	/* every host is a process on 127.0.0.1, told apart by its port */
+	for (h = 0; h < hosts; h++)
+		triad_init_virtual("127.0.0.1", 0, per_host, &(nodes[h * per_host]));
+	for (i = 0; i < count; i++) {
+		nodes[i]->stabilize_interval = 20;
+		triad_join_endpoint(nodes[i], &(nodes[0]->endpoint));
+	}
+	ring_wait(nodes, count);
+
+	/* a node owns the arc from its predecessor up to itself */
+	for (i = 0; i < count; i++)
+		ids[i] = nodes[i]->id;
+	qsort(ids, count, sizeof(chord_id_t), compare_id);
+	for (i = 0; i < count; i++)
+		share[i / per_host] += ldexp((double)(chord_id_t)(nodes[i]->id - nodes[i]->predecessor), -KEYSPACE);
+	double lo = share[0], hi = share[0], sum = 0, var = 0;
+	for (h = 0; h < hosts; h++) {
+		lo = ((share[h] < lo) ? share[h] : lo);
+		hi = ((share[h] > hi) ? share[h] : hi);
+		sum += share[h];
+	}
+	for (h = 0; h < hosts; h++)
+		var += (share[h] - (sum / hosts)) * (share[h] - (sum / hosts));
+
+	for (i = 0; i < lookups; i++) {
+		chord_id_t id = random_id();
+		if (find_successor(nodes[i % count], id) != ring_successor(ids, count, id))
+			wrong++;
+	}
+	report("  %3d vnodes per host: keyspace per host min %5.2fx max %5.2fx of fair, stddev %5.1f%%  %d of %d lookups wrong\n", per_host, lo * hosts, hi * hosts, 100 * sqrt(var / hosts) * hosts, wrong, lookups);
+
+	for (i = 0; i < count; i++) {
+		triad_deinit(nodes[i]);
+		free(nodes[i]);
+	}
+	free(nodes);
+	free(ids);
+	free(share);
+}
+
+static int bench_vnodes(int argc, char **argv)
+{
+	int hosts = ((argc > 0) ? atoi(argv[0]) : 8);
+	int most = ((argc > 1) ? atoi(argv[1]) : 32);
+	int lookups = ((argc > 2) ? atoi(argv[2]) : 1000);
+	int per_host;
+	quiet();
+	report("vnodes: %d hosts sharing 127.0.0.1\n", hosts);
+	for (per_host = 1; per_host <= most; per_host *= 2)
+		vnodes_run(hosts, per_host, lookups);
+	loud();
+	return 0;
+}
+
+
+/**
+ * arcs: how evenly raw and hashed ids split the ring, for clustered addresses
+ */
+
+typedef struct {
+	chord_id_t id;
+	int host;
+} arc_point_t;
+
+static int compare_point(const void *a, const void *b)
+{
+	return compare_id(&(((const arc_point_t *)a)->id), &(((const arc_point_t *)b)->id));
+}
+
+static void arcs_run(const char *scheme, int hosts, int per_host, int raw)
+{
+	int count = hosts * per_host, i;
+	arc_point_t *points = malloc(count * sizeof(arc_point_t));
+	double *share = calloc(hosts, sizeof(double));
+	const char *subnets[] = { "10.0.1.%d", "10.0.2.%d", "192.168.7.%d" };
+	char ip[32];
+
+	/* hosts fill a few /24s from .1 up, as they would on a real deployment */
+	for (i = 0; i < count; i++) {
+		int h = i / per_host;
+		sprintf(ip, subnets[h % 3], (h / 3) + 1);
+		points[i].id = (raw ? (chord_id_t)strtoid(ip) : triad_node_id(ip, RPC_PORT, i % per_host));
+		points[i].host = h;
+	}
+	qsort(points, count, sizeof(arc_point_t), compare_point);
+	for (i = 0; i < count; i++)
+		share[points[i].host] += ldexp((double)(chord_id_t)(points[i].id - points[(i + count - 1) % count].id), -KEYSPACE);
+	qsort(share, hosts, sizeof(double), compare_double);
+
+	double top = 0;
+	for (i = hosts - ((hosts + 9) / 10); i < hosts; i++)
+		top += share[i];
+	fprintf(stdout, "  %-18s max %7.2fx  p99 %7.2fx  top 10%% of hosts own %5.1f%%\n", scheme, share[hosts - 1] * hosts, share[((hosts - 1) * 99) / 100] * hosts, top * 100);
+	free(points);
+	free(share);
+}
+
+static int bench_arcs(int argc, char **argv)
+{
+	int per_subnet = ((argc > 0) ? atoi(argv[0]) : 40);
+	int most = ((argc > 1) ? atoi(argv[1]) : 64);
+	int hosts = 3 * per_subnet, k;
+	char scheme[32];
+	fprintf(stdout, "arcs: %d hosts in 10.0.1.0/24, 10.0.2.0/24 and 192.168.7.0/24, %d-bit ids (share of the ring per host, as a multiple of fair)\n", hosts, KEYSPACE);
+	arcs_run("raw IPv4", hosts, 1, 1);
+	for (k = 1; k <= most; k *= 4) {
+		sprintf(scheme, "hashed, %d vnode%s", k, ((k > 1) ? "s" : ""));
+		arcs_run(scheme, hosts, k, 0);
+	}
+	return 0;
+}
+
+
+/**
+ * kv: end-to-end put/get/del throughput of the key/value store
+ */
+
+typedef struct kv_client {
+	node_t *n;
+	int first;
+	int count;
+	int size;        // bytes per value
+	int op;          // MSG_PUT, MSG_GET or MSG_DEL
+	int hot;         // if not 0, `count' keys drawn from the first `hot'
+	int failed;
+	pthread_t thread;
+} kv_client_t;
+
+/* the value of key `k', which the get phase checks */
+static void kv_value(char *buf, int k, int size)
+{
+	int i;
+	for (i = 0; i < size; i++)
+		buf[i] = (char)(k + i);
+}
+
+static void *kv_client(void *arg)
+{
+	kv_client_t *c = (kv_client_t *)arg;
+	char key[32], value[MSG_PAYLOAD], got[MSG_PAYLOAD];
+	unsigned int seed = (unsigned int)c->first;
+	int i, k;
+	for (i = 0; i < c->count; i++) {
+		k = (c->hot ? (rand_r(&seed) % c->hot) : (c->first + i));
+		int klen = sprintf(key, "key-%d", k);
+		kv_value(value, k, c->size);
+		switch (c->op) {
+			case MSG_PUT:
+				c->failed += !triad_put(c->n, key, klen, value, c->size);
+				break;
+			case MSG_GET:
+				c->failed += ((triad_get(c->n, key, klen, got, sizeof(got)) != c->size) || memcmp(got, value, c->size));
+				break;
+			case MSG_DEL:
+				c->failed += !triad_del(c->n, key, klen);
+				break;
+		}
+	}
+	return NULL;
+}
+
+/* runs `op' on `keys' keys from `clients' threads, spread over the nodes
+ * (or on `keys' drawn from the first `hot' keys, if not 0); returns the
+ * seconds it took and adds up failures in `failed' */
+static double kv_run_hot(node_t **nodes, int size, kv_client_t *clients, int count, int keys, int hot, int bytes, int op, int *failed)
+{
+	int c;
+	double t0 = now();
+	for (c = 0; c < count; c++) {
+		clients[c].n = nodes[c % size];
+		clients[c].first = (keys / count) * c;
+		clients[c].count = ((c == count - 1) ? (keys - clients[c].first) : (keys / count));
+		clients[c].size = bytes;
+		clients[c].op = op;
+		clients[c].hot = hot;
+		clients[c].failed = 0;
+		pthread_create(&(clients[c].thread), NULL, kv_client, &(clients[c]));
+	}
+	*failed = 0;
+	for (c = 0; c < count; c++) {
+		pthread_join(clients[c].thread, NULL);
+		*failed += clients[c].failed;
+	}
+	return now() - t0;
+}
+
+static double kv_run(node_t **nodes, int size, kv_client_t *clients, int count, int keys, int bytes, int op, int *failed)
+{
+	return kv_run_hot(nodes, size, clients, count, keys, 0, bytes, op, failed);
+}
+
+static unsigned int kv_slabs(node_t **nodes, int size)
+{
+	unsigned int slabs = 0;
+	int i;
+	for (i = 0; i < size; i++)
+		slabs += nodes[i]->store.slabs;
+	return slabs;
+}
+
+static int bench_kv(int argc, char **argv)
+{
+	int keys = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int count = ((argc > 1) ? atoi(argv[1]) : 4);
+	int size = ((argc > 2) ? atoi(argv[2]) : 8);
+	int bytes = ((argc > 3) ? atoi(argv[3]) : 100);
+	kv_client_t *clients = malloc(count * sizeof(kv_client_t));
+	double t, elapsed[4];
+	int failed[4], i;
+	unsigned int slabs[2], lo = ~0u, hi = 0;
+
+	if (bytes > MSG_PAYLOAD - 16)
+		bytes = MSG_PAYLOAD - 16;
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	elapsed[0] = kv_run(nodes, size, clients, count, keys, bytes, MSG_PUT, &(failed[0]));
+	slabs[0] = kv_slabs(nodes, size);
+	elapsed[1] = kv_run(nodes, size, clients, count, keys, bytes, MSG_PUT, &(failed[1]));
+	elapsed[2] = kv_run(nodes, size, clients, count, keys, bytes, MSG_GET, &(failed[2]));
+	slabs[1] = kv_slabs(nodes, size);
+	for (i = 0; i < size; i++) {
+		lo = ((nodes[i]->store.count < lo) ? nodes[i]->store.count : lo);
+		hi = ((nodes[i]->store.count > hi) ? nodes[i]->store.count : hi);
+	}
+	elapsed[3] = kv_run(nodes, size, clients, count, keys, bytes, MSG_DEL, &(failed[3]));
+	unsigned int left = 0;
+	for (i = 0; i < size; i++)
+		left += nodes[i]->store.count;
+	ring_stop(nodes, size);
+	loud();
+
+	printf("kv: %d keys with %d byte values, %d clients on a %d node ring\n", keys, bytes, count, size);
+	const char *phases[] = { "put (new)", "put (overwrite)", "get", "del" };
+	for (i = 0; i < 4; i++) {
+		t = elapsed[i];
+		printf("  %-16s %9.0f ops/s  %8.0f ops/s per node  %d failed\n", phases[i], keys / t, keys / t / size, failed[i]);
+	}
+	printf("  keys per node:   min %u max %u, %u left after deleting all\n", lo, hi, left);
+	printf("  slabs:           %u after the first puts, %u more by the end of the gets\n", slabs[0], slabs[1] - slabs[0]);
+	free(clients);
+	return 0;
+}
+
+
+/**
+ * replicas: read throughput against the number of successors keeping a copy
+ * of each key
+ */
+
+/* the share of the messages received by `nodes' since `before' that went to
+ * the busiest one, and updates `before' */
+static double replica_busiest(node_t **nodes, int size, unsigned long *before)
+{
+	unsigned long total = 0, most = 0;
+	int i;
+	for (i = 0; i < size; i++) {
+		unsigned long got = nodes[i]->messages - before[i];
+		before[i] = nodes[i]->messages;
+		total += got;
+		most = ((got > most) ? got : most);
+	}
+	return (total ? ((double)most / total) : 0);
+}
+
+static int bench_replicas(int argc, char **argv)
+{
+	int keys = ((argc > 0) ? atoi(argv[0]) : 20000);
+	int count = ((argc > 1) ? atoi(argv[1]) : 8);
+	int size = ((argc > 2) ? atoi(argv[2]) : 8);
+	int most = ((argc > 3) ? atoi(argv[3]) : 3);
+	int hot = 16, bytes = 100, failed[4], r, i;
+	kv_client_t *clients = malloc(count * sizeof(kv_client_t));
+	unsigned long *before = calloc(size, sizeof(unsigned long));
+
+	if (most >= SUCCESSORS)
+		most = SUCCESSORS - 1;
+	if (most >= size)
+		most = size - 1;
+	if (!ring_fits(size))
+		return 1;
+	printf("replicas: %d keys with %d byte values, %d clients on a %d node ring\n", keys, bytes, count, size);
+	printf("  %2s %11s %11s %11s %15s %7s %13s\n", "r", "puts/s", "gets/s", "hot gets/s", "busiest node", "failed", "lost in crash");
+	for (r = 0; r <= most; r++) {
+		quiet();
+		node_t **nodes = ring_start(size);
+		for (i = 0; i < size; i++) {
+			nodes[i]->replicas = r;
+			while (nodes[i]->nsuccessors < most)
+				usleep(1000);
+		}
+		double put = kv_run(nodes, size, clients, count, keys, bytes, MSG_PUT, &(failed[0]));
+		double get = kv_run(nodes, size, clients, count, keys, bytes, MSG_GET, &(failed[1]));
+		replica_busiest(nodes, size, before);
+		double get_hot = kv_run_hot(nodes, size, clients, count, keys, hot, bytes, MSG_GET, &(failed[2]));
+		double busiest = replica_busiest(nodes, size, before);
+
+		/* the last node stops without leaving, and the others read
+		 * every key once they have noticed */
+		triad_deinit(nodes[size - 1]);
+		free(nodes[size - 1]);
+		for (i = 0; i < size - 1; i++)
+			nodes[i]->stabilize_interval = 20;
+		sleep(1);
+		kv_run(nodes, size - 1, clients, count, keys, bytes, MSG_GET, &(failed[3]));
+		ring_stop(nodes, size - 1);
+		loud();
+		printf("  %2d %11.0f %11.0f %11.0f %14.0f%% %7d %13d\n", r, keys / put, keys / get, keys / get_hot, busiest * 100, failed[0] + failed[1] + failed[2], failed[3]);
+	}
+	printf("  hot gets read %d keys; busiest node is its share of the messages meanwhile\n", hot);
+	printf("  lost in crash: keys unreadable after a node stopped without handing them over\n");
+	free(before);
+	free(clients);
+	return 0;
+}
+
+
+/**
+ * migrate: keys streaming over TCP to a joining node and back as it leaves
+ */
+
+typedef struct migrate_reader {
+	node_t *n;
+	int keys;
+	int size;
+	volatile int running;
+	unsigned long reads;
+	unsigned long failed;
+	double worst;
+	pthread_t thread;
+} migrate_reader_t;
+
+/* reads random keys for as long as the keys move, checking every value */
+static void *migrate_reader(void *arg)
+{
+	migrate_reader_t *r = (migrate_reader_t *)arg;
+	unsigned int seed = (unsigned int)(size_t)&seed;
+	char key[32], value[MSG_PAYLOAD], got[MSG_PAYLOAD];
+	while (r->running) {
+		int k = rand_r(&seed) % r->keys, klen = sprintf(key, "key-%d", k);
+		kv_value(value, k, r->size);
+		double t0 = now();
+		if ((triad_get(r->n, key, klen, got, sizeof(got)) != r->size) || memcmp(got, value, r->size))
+			r->failed++;
+		double t = now() - t0;
+		r->worst = ((t > r->worst) ? t : r->worst);
+		r->reads++;
+	}
+	return NULL;
+}
+
+static int bench_migrate(int argc, char **argv)
+{
+	int keys = ((argc > 0) ? atoi(argv[0]) : 200000);
+	int bytes = ((argc > 1) ? atoi(argv[1]) : 256);
+	int size = ((argc > 2) ? atoi(argv[2]) : 4);
+	kv_client_t clients[8];
+	migrate_reader_t reader;
+	char ip[16];
+	int failed[2], i;
+
+	if (bytes > MSG_PAYLOAD - 16)
+		bytes = MSG_PAYLOAD - 16;
+	if (!ring_fits(size + 1))
+		return 1;
+	quiet();
+	node_t **nodes = ring_start(size);
+	kv_run(nodes, size, clients, 8, keys, bytes, MSG_PUT, &(failed[0]));
+
+	memset(&reader, 0, sizeof(reader));
+	reader.n = nodes[0];
+	reader.keys = keys;
+	reader.size = bytes;
+	reader.running = 1;
+	pthread_create(&(reader.thread), NULL, migrate_reader, &reader);
+
+	/* the joining node is fully responsible for its keys once
+	 * triad_join returns */
+	ring_address(ip, size + 1);
+	node_t *n = triad_init(ip);
+	double t0 = now();
+	triad_join(n, "127.0.0.1");
+	double joined = now() - t0;
+	unsigned long in_keys = n->store.received_keys;
+	unsigned long long in_bytes = n->store.received_bytes;
+	usleep(200000);
+
+	node_t *successor = NULL;
+	for (i = 0; i < size; i++)
+		if (nodes[i]->id == n->successor)
+			successor = nodes[i];
+	unsigned long out_keys = (successor ? successor->store.received_keys : 0);
+	unsigned long long out_bytes = (successor ? successor->store.received_bytes : 0);
+	t0 = now();
+	triad_leave(n);
+	double left = now() - t0;
+	if (successor) {
+		out_keys = successor->store.received_keys - out_keys;
+		out_bytes = successor->store.received_bytes - out_bytes;
+	}
+	usleep(200000);
+	reader.running = 0;
+	pthread_join(reader.thread, NULL);
+
+	kv_run(nodes, size, clients, 8, keys, bytes, MSG_GET, &(failed[1]));
+	triad_deinit(n);
+	free(n);
+	ring_stop(nodes, size);
+	loud();
+
+	printf("migrate: %d keys with %d byte values on a %d node ring, one node joining and leaving\n", keys, bytes, size);
+	printf("  join:  %7lu keys, %7.2f MB in %8.2f ms, %8.1f MB/s; responsible after %.2f ms\n", in_keys, in_bytes / 1e6, joined * 1e3, in_bytes / 1e6 / joined, joined * 1e3);
+	printf("  leave: %7lu keys, %7.2f MB in %8.2f ms, %8.1f MB/s\n", out_keys, out_bytes / 1e6, left * 1e3, out_bytes / 1e6 / left);
+	printf("  reads meanwhile: %lu, %lu failed, slowest %.2f ms\n", reader.reads, reader.failed, reader.worst * 1e3);
+	printf("  keys missing afterwards: %d of %d (%d puts failed)\n", failed[1], keys, failed[0]);
+	return 0;
+}
+
+
+/**
+ * ring: the lookup workload `make bench' runs, as text, CSV or JSON
+ */
+
+#define RING_KEYS 65536  // keys a zipfian workload draws from
+
+typedef struct ring_client {
+	pthread_t thread;
+	node_t **nodes;
+	int size;
+	int first;  // this client looks up keys first, first + step, ...
+	int step;
+	int count;
+	const chord_id_t *keys;
+	const chord_id_t *owners;
+	int cold;  // clear the location cache before each lookup
+	double *latency;
+	unsigned long hops;
+	int failed;
+} ring_client_t;
+
+typedef struct ring_row {
+	const char *keys;
+	const char *routing;
+	const char *cache;
+	double seconds;
+	double p50, p99, p999;  // s
+	double hops;
+	int failed;
+} ring_row_t;
+
+static void *ring_client(void *arg)
+{
+	ring_client_t *c = arg;
+	unsigned int h;
+	int i;
+	for (i = c->first; i < c->count; i += c->step) {
+		node_t *n = c->nodes[i % c->size];
+		if (c->cold)
+			location_clear(n);
+		double t0 = now();
+		if (route_successor(n, c->keys[i], &h) != c->owners[i])
+			c->failed++;
+		c->latency[i] = now() - t0;
+		c->hops += h;
+	}
+	return NULL;
+}
+
+/* `count' keys drawn uniformly from the ring, or (with `skew' > 0) from
+ * RING_KEYS keys, the one of rank r with probability proportional to
+ * 1 / r^skew */
+static void ring_keys(chord_id_t *keys, int count, double skew)
+{
+	double *cdf = malloc(RING_KEYS * sizeof(double)), total = 0;
+	unsigned int r;
+	int i;
+	for (r = 0; r < RING_KEYS; r++)
+		cdf[r] = (total += 1 / pow(r + 1, skew));
+	for (i = 0; i < count; i++) {
+		if (skew <= 0) {
+			keys[i] = random_id();
+			continue;
+		}
+		double u = (rand() / ((double)RAND_MAX + 1)) * total;
+		int lo = 0, hi = RING_KEYS - 1;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		r = lo;
+		keys[i] = triad_hash(&r, sizeof(r));
+	}
+	free(cdf);
+}
+
+static void ring_run(node_t **nodes, int size, chord_id_t *ids, const chord_id_t *keys, int count, int clients, routing_t routing, int cold, ring_row_t *row)
+{
+	ring_client_t *c = calloc(clients, sizeof(ring_client_t));
+	chord_id_t *owners = malloc(count * sizeof(chord_id_t));
+	double *latency = malloc(count * sizeof(double));
+	unsigned long hops = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		owners[i] = ring_successor(ids, size, keys[i]);
+	for (i = 0; i < size; i++) {
+		nodes[i]->routing = routing;
+		location_clear(nodes[i]);
+	}
+	row->failed = 0;
+	double t0 = now();
+	for (i = 0; i < clients; i++) {
+		c[i].nodes = nodes;
+		c[i].size = size;
+		c[i].first = i;
+		c[i].step = clients;
+		c[i].count = count;
+		c[i].keys = keys;
+		c[i].owners = owners;
+		c[i].cold = cold;
+		c[i].latency = latency;
+		pthread_create(&(c[i].thread), NULL, ring_client, &(c[i]));
+	}
+	for (i = 0; i < clients; i++) {
+		pthread_join(c[i].thread, NULL);
+		hops += c[i].hops;
+		row->failed += c[i].failed;
+	}
+	row->seconds = now() - t0;
+	qsort(latency, count, sizeof(double), compare_double);
+	row->p50 = latency[count / 2];
+	row->p99 = latency[(int)(count * 0.99)];
+	row->p999 = latency[(int)(count * 0.999)];
+	row->hops = (double)hops / count;
+	row->routing = ((routing == ROUTE_ITERATIVE) ? "iterative" : "recursive");
+	row->cache = (cold ? "cold" : "warm");
+	free(latency);
+	free(owners);
+	free(c);
+}
+
+static int bench_ring(int argc, char **argv)
+{
+	int size = ((argc > 0) ? atoi(argv[0]) : 64);
+	int count = ((argc > 1) ? atoi(argv[1]) : 20000);
+	int clients = ((argc > 2) ? atoi(argv[2]) : 4);
+	const char *workload = ((argc > 3) ? argv[3] : "all");
+	const char *format = ((argc > 4) ? argv[4] : "text");
+	chord_id_t *ids = malloc(size * sizeof(chord_id_t));
+	chord_id_t *keys = malloc(count * sizeof(chord_id_t));
+	ring_row_t rows[8];
+	char zipf[32];
+	int nrows = 0, i, k, r;
+	double skew = 0.99;
+	if (!strncmp(workload, "zipf:", 5))
+		skew = atof(workload + 5);
+	snprintf(zipf, sizeof(zipf), "zipf:%.2f", skew);
+	const char *workloads[2] = { "uniform", zipf };
+	if (strcmp(workload, "all") && strcmp(workload, "uniform") && strncmp(workload, "zipf", 4)) {
+		fprintf(stderr, "keys are uniform, zipf, zipf:<exponent> or all\n");
+		return 1;
+	}
+
+	if (!ring_fits(size))
+		return 1;
+	quiet();
+	node_t **nodes = malloc(size * sizeof(node_t *));
+	char ip[16];
+	double joined = 0, slowest = 0;
+	for (i = 0; i < size; i++) {
+		ring_address(ip, i + 1);
+		nodes[i] = triad_init(ip);
+		nodes[i]->stabilize_interval = 20;
+		double t0 = now();
+		triad_join(nodes[i], (i ? "127.0.0.1" : ip));
+		double t = now() - t0;
+		joined += t;
+		if (t > slowest)
+			slowest = t;
+		ids[i] = nodes[i]->id;
+	}
+	double t0 = now();
+	ring_wait(nodes, size);
+	double settled = now() - t0;
+	for (i = 0; i < size; i++)
+		nodes[i]->stabilize_interval = STABILIZE_INTERVAL;
+	qsort(ids, size, sizeof(chord_id_t), compare_id);
+	for (k = 0; k < 2; k++) {
+		if (strcmp(workload, "all") && ((k == 0) != !strcmp(workload, "uniform")))
+			continue;
+		ring_keys(keys, count, (k ? skew : 0));
+		for (r = 0; r < 4; r++) {
+			rows[nrows].keys = workloads[k];
+			ring_run(nodes, size, ids, keys, count, clients, ((r & 1) ? ROUTE_RECURSIVE : ROUTE_ITERATIVE), !(r & 2), &(rows[nrows]));
+			nrows++;
+		}
+	}
+	ring_stop(nodes, size);
+	loud();
+
+	if (!strcmp(format, "csv")) {
+		printf("nodes,clients,keyspace,keys,routing,cache,lookups,failed,lookups_per_s,p50_us,p99_us,p999_us,hops,join_ms,join_max_ms,settle_ms\n");
+		for (r = 0; r < nrows; r++)
+			printf("%d,%d,%d,%s,%s,%s,%d,%d,%.0f,%.2f,%.2f,%.2f,%.3f,%.3f,%.3f,%.1f\n", size, clients, KEYSPACE, rows[r].keys, rows[r].routing, rows[r].cache, count, rows[r].failed, count / rows[r].seconds, rows[r].p50 * 1e6, rows[r].p99 * 1e6, rows[r].p999 * 1e6, rows[r].hops, (joined * 1e3) / size, slowest * 1e3, settled * 1e3);
+	}
+	else if (!strcmp(format, "json")) {
+		printf("{\"nodes\": %d, \"clients\": %d, \"keyspace\": %d, \"lookups\": %d, \"join_ms\": %.3f, \"join_max_ms\": %.3f, \"settle_ms\": %.1f, \"runs\": [\n", size, clients, KEYSPACE, count, (joined * 1e3) / size, slowest * 1e3, settled * 1e3);
+		for (r = 0; r < nrows; r++)
+			printf("  {\"keys\": \"%s\", \"routing\": \"%s\", \"cache\": \"%s\", \"failed\": %d, \"lookups_per_s\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"hops\": %.3f}%s\n", rows[r].keys, rows[r].routing, rows[r].cache, rows[r].failed, count / rows[r].seconds, rows[r].p50 * 1e6, rows[r].p99 * 1e6, rows[r].p999 * 1e6, rows[r].hops, ((r + 1 < nrows) ? "," : ""));
+		printf("]}\n");
+	}
+	else {
+		printf("ring: %d nodes, %d lookups per run from %d clients\n", size, count, clients);
+		printf("  join: %.2f ms per node (slowest %.2f ms), settled %.1f ms after the last\n", (joined * 1e3) / size, slowest * 1e3, settled * 1e3);
+		for (r = 0; r < nrows; r++)
+			printf("  %-10s %-9s %-4s cache: %9.0f lookups/s  p50 %8.2f us  p99 %8.2f us  p99.9 %8.2f us  %5.2f hops  %d failed\n", rows[r].keys, rows[r].routing, rows[r].cache, count / rows[r].seconds, rows[r].p50 * 1e6, rows[r].p99 * 1e6, rows[r].p999 * 1e6, rows[r].hops, rows[r].failed);
+	}
+	free(keys);
+	free(ids);
+	return 0;
+}
+
+/**
+ * driver
+ */
+
+static struct {
+	const char *name;
+	int (*run)(int, char **);
+	const char *help;
+} benchmarks[] = {
+	{ "rpc", bench_rpc, "[calls]  per-RPC cost, per-call sockets vs. persistent sockets" },
+	{ "local", bench_local, "[calls]  round trips to co-located nodes, UDP vs. shared memory" },
+	{ "trace", bench_trace, "[calls]  cost of a trace record and of tracing round trips" },
+	{ "stats", bench_stats, "[lookups] [nodes]  metrics of a run of lookups, and the cost of scraping them" },
+	{ "pipeline", bench_pipeline, "[calls] [window]  throughput of outstanding calls on one socket" },
+	{ "mmsg", bench_mmsg, "[calls] [clients] [window]  pipelined UDP calls, a system call per datagram vs. batched" },
+	{ "uring", bench_uring, "[calls] [clients]  pipelined UDP calls, epoll vs. io_uring" },
+	{ "batch", bench_batch, "[keys] [nodes]  triad_lookup vs. triad_lookup_batch" },
+#if !defined(__SANITIZE_ADDRESS__)
+	{ "allocs", bench_allocs, "[lookups] [nodes]  heap allocations per lookup, failing unless there are none" },
+#endif
+	{ "cache", bench_cache, "[lookups] [hot keys] [nodes]  lookups through the location cache" },
+	{ "route", bench_route, "[lookups] [nodes]  hop latency of iterative vs. recursive routing" },
+	{ "cpf", bench_cpf, "[calls]  closest_preceding_finger, original scan vs. SIMD finger index" },
+	{ "wire", bench_wire, "[messages]  encode/decode cost and size of messages on the wire" },
+	{ "stress", bench_stress, "[readers] [seconds] [nodes]  routing state reads racing joins and leaves" },
+	{ "join", bench_join, "[joins] [max nodes]  join latency and messages at 64, 256 and 1024 nodes" },
+	{ "vnodes", bench_vnodes, "[hosts] [max vnodes per host] [lookups]  keyspace balance with virtual nodes" },
+	{ "arcs", bench_arcs, "[hosts per subnet] [max vnodes per host]  ring balance of raw vs. hashed ids" },
+	{ "kv", bench_kv, "[keys] [clients] [nodes] [value bytes]  put/get/del throughput of the key/value store" },
+	{ "replicas", bench_replicas, "[keys] [clients] [nodes] [max replicas]  read throughput against replicas per key" },
+	{ "migrate", bench_migrate, "[keys] [value bytes] [nodes]  keys streaming to a joining node and back as it leaves" },
+	{ "loss", bench_loss, "[lookups] [nodes]  lookup latency at 0-5% datagram loss" },
+	{ "proximity", bench_proximity, "[lookups] [nodes]  lookup latency on a delayed network, first vs. nearest fingers" },
+	{ "ring", bench_ring, "[nodes] [lookups] [clients] [uniform|zipf[:s]|all] [text|csv|json]  lookup workload of `make bench'" },
+};
+
+int main(int argc, char **argv)
+{
+	int b;
+	if (argc > 1)
+		for (b = 0; b < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); b++)
+			if (!strcmp(argv[1], benchmarks[b].name))
+				return benchmarks[b].run(argc - 2, argv + 2);
+	fprintf(stderr, "usage: %s <benchmark> [options]\n", argv[0]);
+	for (b = 0; b < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); b++)
+		fprintf(stderr, "  %-8s %s\n", benchmarks[b].name, benchmarks[b].help);
+	return 1;
+}
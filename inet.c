@@ -1,22 +1,30 @@
+#define _GNU_SOURCE // recvmmsg and sendmmsg
 #include "inet.h"
+#if IN_URING
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 // inet_setup (TCP:client / UDP:client)
 //
-// Sets up an inet_host structure.
+// Sets up an inet_host structure for the IPv4 address `addr' (in network byte
+// order, or `INADDR_ANY') and `port', without looking at any strings.
 void
 inet_setup(inet_host_t *host,
 		int protocol,
-		const char *addr,
+		struct in_addr addr,
 		unsigned short port)
 {
 	// Set up our inet_host structure
 	host->protocol = protocol;
+	host->nonblock = 0;
 
 	// Set up our sockaddr_in structure
 	host->addr.sin_family = AF_INET;
 	host->addr.sin_port = htons(port);
-	host->addr.sin_addr.s_addr =
-		(addr == IN_ADDR_ANY ? IN_ADDR_ANY : inet_addr(addr));
+	host->addr.sin_addr = addr;
 	memset(host->addr.sin_zero, 0, sizeof(host->addr.sin_zero));
 }
 
@@ -33,8 +41,9 @@ inet_setup(inet_host_t *host,
 // IP address.
 //
 // `port' is the port number to bind to on the host machine. Specifying
-// IN_PORT_ANY attempts to use any available port assigned by the kernel. Use
-// this option when the port your host structure is bound to does not matter.
+// IN_PORT_ANY attempts to use any available port assigned by the kernel, which
+// is then stored in `host->addr'. Use this option when the port your host
+// structure is bound to does not matter.
 //
 // Returns one of:
 // 	0		Success.
@@ -54,7 +63,16 @@ inet_open(inet_host_t *host,
 	}
 
 	// Set up our sockaddr_in structure
-	inet_setup(host, protocol, addr, port);
+	struct in_addr in;
+	in.s_addr = (addr ? inet_addr(addr) : htonl(INADDR_ANY));
+	inet_setup(host, protocol, in, port);
+
+	// Let TCP servers bind again while connections of an earlier one linger
+	// in TIME_WAIT
+	if (protocol == IN_PROT_TCP) {
+		int one = 1;
+		setsockopt(host->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
 
 	// If we are not able to bind to a port, fail with a bind error
 	if (bind(host->fd, (struct sockaddr *)&(host->addr),
@@ -63,6 +81,12 @@ inet_open(inet_host_t *host,
 		return -EIN_BIND;
 	}
 
+	// Find out which port the kernel picked, if it was up to the kernel
+	if (port == IN_PORT_ANY) {
+		socklen_t len = sizeof(host->addr);
+		getsockname(host->fd, (struct sockaddr *)&(host->addr), &len);
+	}
+
 	// Set up our host protocol
 	host->protocol = protocol;
 
@@ -141,6 +165,29 @@ inet_connect(inet_host_t *local,
 	return 0;
 }
 
+// inet_nonblock (TCP / UDP)
+//
+// Puts the socket of `host' into non-blocking mode. Calling `inet_receive' with
+// a `timeout' of 0 on such a host reads straight from the socket without
+// waiting on it first, which is what event loops built on top of this library
+// want once they know the socket is readable.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error changing the socket mode.
+int
+inet_nonblock(inet_host_t *host)
+{
+	int flags = fcntl(host->fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(host->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Error setting socket to non-blocking!\n");
+		return -EIN_SOCK;
+	}
+	host->nonblock = 1;
+
+	return 0;
+}
+
 // inet_receive (TCP / UDP)
 //
 // Receives a `len' bytes sent from `remote' to `local' and stores them in
@@ -149,7 +196,8 @@ inet_connect(inet_host_t *local,
 //
 // Setting `timeout' to 0 causes the function to return immediately if there is
 // no data to receive and setting `timeout' to -1 causes the function to block
-// until data is ready to be received.
+// until data is ready to be received. On a host put into non-blocking mode with
+// `inet_nonblock', a `timeout' of 0 skips the wait altogether.
 //
 // Returns one of:
 //      Number of bytes received        Success.
@@ -162,61 +210,215 @@ inet_receive(inet_host_t *remote,
 		int len,
 		int timeout)
 {
-	fd_set fds;
-	struct timeval time;
+	struct pollfd fds;
 	int size;
 
-	// Set the timeout interval
-	time.tv_sec = timeout;
-	time.tv_usec = 0;
+	// Non-blocking hosts are read directly
+	if (timeout == 0 && local->nonblock) {
+		socklen_t n = sizeof(remote->addr);
+		if (local->protocol == IN_PROT_TCP)
+			size = recv(remote->fd, data, len, 0);
+		else
+			size = recvfrom(local->fd, data, len, 0,
+					(struct sockaddr *)&(remote->addr), &n);
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -EIN_TIME;
+			perror("Error receiving data!\n");
+			return -EIN_RECV;
+		}
+		return size;
+	}
 
-	// Initialize the file descriptor set
-	FD_ZERO(&fds);
+	// Block for a specified amount of time on the connection (TCP) or the
+	// socket (UDP); poll, unlike select, takes descriptors past FD_SETSIZE
+	fds.fd = (local->protocol == IN_PROT_TCP ? remote->fd : local->fd);
+	fds.events = POLLIN;
+	fds.revents = 0;
+	if (poll(&fds, 1, (timeout != -1 ? timeout * 1000 : -1)) <= 0)
+		return -EIN_TIME;
 
 	// Depending on the protocol, receive data
 	switch (local->protocol) {
 		case IN_PROT_TCP:
-			FD_SET(remote->fd, &fds);
-			// Block for a specified amount of time
-			if (timeout != -1)
-				select(remote->fd + 1, &fds, NULL, NULL, &time);
-			else
-				select(remote->fd + 1, &fds, NULL, NULL, NULL);
-			if (FD_ISSET(remote->fd, &fds)) {
-				size = recv(remote->fd, data, len, 0);
-				if (size < 0) {
-					perror("Error receiving data!\n");
-					return -EIN_RECV;
-				}
-			}
-			else
-				return -EIN_TIME;
+			size = recv(remote->fd, data, len, 0);
 			break;
 		case IN_PROT_UDP: {
 			socklen_t n = sizeof(remote->addr);
-			FD_SET(local->fd, &fds);
-			// Block for a specified amount of time
-			if (timeout != -1)
-				select(local->fd + 1, &fds, NULL, NULL, &time);
-			else
-				select(local->fd + 1, &fds, NULL, NULL, NULL);
-			if (FD_ISSET(local->fd, &fds)) {
-				size = recvfrom(local->fd, data, len, 0,
-						(struct sockaddr *)&(remote->addr), &n);
-				if (size < 0) {
-					perror("Error receiving data!\n");
-					return -EIN_RECV;
-				}
-			}
-			else
-				return -EIN_TIME;
+			size = recvfrom(local->fd, data, len, 0,
+					(struct sockaddr *)&(remote->addr), &n);
 			break;
 		}
 	}
+	if (size < 0) {
+		perror("Error receiving data!\n");
+		return -EIN_RECV;
+	}
 
 	return size;
 }
 
+// Fraction of outgoing UDP datagrams that `inet_send' silently drops, for
+// testing how callers cope with an unreliable network. Set with
+// `inet_set_loss'.
+static double inet_loss = 0;
+
+// inet_set_loss (UDP)
+//
+// Makes `inet_send' drop each outgoing UDP datagram with probability `rate'
+// (0 to 1) while still reporting it as sent, as a lossy network would. Applies
+// to every host in the process; 0 turns loss injection off.
+void
+inet_set_loss(double rate)
+{
+	inet_loss = rate;
+}
+
+// Delay that `inet_send' adds to outgoing UDP datagrams, for testing how
+// callers fare on a network where some hosts are further away than others.
+// Delayed datagrams wait in a heap ordered by when they are due, and a thread
+// of their own sends them then. Set with `inet_set_delay'.
+typedef struct inet_delayed {
+	long long due;	// us on the monotonic clock
+	int fd;
+	struct sockaddr_in to;
+	int len;
+	char data[];
+} inet_delayed_t;
+
+static inet_delay_t inet_delay = NULL;
+static inet_delayed_t **inet_delayed = NULL;
+static int inet_ndelayed = 0, inet_delayed_size = 0;
+static pthread_mutex_t inet_delay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inet_delay_cond;
+static pthread_once_t inet_delay_once = PTHREAD_ONCE_INIT;
+
+static long long
+inet_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Sends each delayed datagram once it is due.
+static void *
+inet_delayer(void *arg)
+{
+	pthread_mutex_lock(&inet_delay_lock);
+	for (;;) {
+		if (!inet_ndelayed) {
+			pthread_cond_wait(&inet_delay_cond, &inet_delay_lock);
+			continue;
+		}
+		inet_delayed_t *d = inet_delayed[0];
+		long long now = inet_now();
+		if (d->due > now) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (d->due - now) / 1000000;
+			ts.tv_nsec += ((d->due - now) % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&inet_delay_cond, &inet_delay_lock, &ts);
+			continue;
+		}
+
+		// Take the earliest off the heap and sift the last one down
+		inet_delayed_t *last = inet_delayed[--inet_ndelayed];
+		int i = 0, c;
+		while ((c = (2 * i) + 1) < inet_ndelayed) {
+			if ((c + 1 < inet_ndelayed) && (inet_delayed[c + 1]->due < inet_delayed[c]->due))
+				c++;
+			if (last->due <= inet_delayed[c]->due)
+				break;
+			inet_delayed[i] = inet_delayed[c];
+			i = c;
+		}
+		inet_delayed[i] = last;
+
+		pthread_mutex_unlock(&inet_delay_lock);
+		sendto(d->fd, d->data, d->len, 0, (struct sockaddr *)&(d->to), sizeof(d->to));
+		free(d);
+		pthread_mutex_lock(&inet_delay_lock);
+	}
+	return NULL;
+}
+
+static void
+inet_delay_start(void)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&inet_delay_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_create(&thread, NULL, inet_delayer, NULL);
+	pthread_detach(thread);
+}
+
+// Queues `len' bytes of `data' from `local' to `to' if `inet_delay' holds
+// them back. Returns 1 if it did, and 0 if they go out right away.
+static int
+inet_defer(inet_host_t *local, struct sockaddr_in *to, void *data, int len)
+{
+	inet_delay_t delay = inet_delay;
+	double ms;
+	if (!delay || ((ms = delay(&(local->addr), to)) <= 0))
+		return 0;
+	inet_delayed_t *d = malloc(sizeof(inet_delayed_t) + len);
+	d->due = inet_now() + (long long)(ms * 1000);
+	d->fd = local->fd;
+	d->to = *to;
+	d->len = len;
+	memcpy(d->data, data, len);
+
+	pthread_mutex_lock(&inet_delay_lock);
+	if (inet_ndelayed == inet_delayed_size) {
+		inet_delayed_size = (inet_delayed_size ? (2 * inet_delayed_size) : 256);
+		inet_delayed = realloc(inet_delayed, inet_delayed_size * sizeof(inet_delayed_t *));
+	}
+	// Sift the new one up from the bottom of the heap
+	int i = inet_ndelayed++;
+	while (i && (inet_delayed[(i - 1) / 2]->due > d->due)) {
+		inet_delayed[i] = inet_delayed[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	inet_delayed[i] = d;
+	if (!i)
+		pthread_cond_signal(&inet_delay_cond);
+	pthread_mutex_unlock(&inet_delay_lock);
+	return 1;
+}
+
+// inet_set_delay (UDP)
+//
+// Makes `inet_send' hold each outgoing UDP datagram back for as many ms as
+// `delay' returns for the addresses it goes between, as a wide-area network
+// would, while still reporting it as sent right away. Applies to every host
+// in the process; NULL turns delay injection off (datagrams already held back
+// still go out when due, so their sockets should stay open until then).
+void
+inet_set_delay(inet_delay_t delay)
+{
+	pthread_once(&inet_delay_once, inet_delay_start);
+	inet_delay = delay;
+}
+
+// Whether loss injection drops the next outgoing UDP datagram.
+static int
+inet_lost(void)
+{
+	static __thread unsigned int seed;
+	if (inet_loss <= 0)
+		return 0;
+	if (!seed) seed = (unsigned int)(size_t)&seed ^ getpid();
+	return (rand_r(&seed) < inet_loss * RAND_MAX);
+}
+
 // inet_send (TCP / UDP)
 //
 // Sends `len' bytes of `data' from `local' to `remote'.
@@ -235,13 +437,18 @@ inet_send(inet_host_t *local,
 	// Depending on the protocol, send data
 	switch (local->protocol) {
 		case IN_PROT_TCP:
-			size = send(remote->fd, data, len, 0);
+			// A peer that hung up is reported as an error, not SIGPIPE
+			size = send(remote->fd, data, len, MSG_NOSIGNAL);
 			if (size < 0) {
 				perror("Error sending data!\n");
 				return -EIN_SEND;
 			}
 			break;
 		case IN_PROT_UDP: {
+			if (inet_lost())
+				return len;
+			if (inet_delay && inet_defer(local, &(remote->addr), data, len))
+				return len;
 			size = sendto(local->fd, data, len, 0,
 					(struct sockaddr *)&(remote->addr), sizeof(remote->addr));
 			if (size < 0) {
@@ -255,6 +462,695 @@ inet_send(inet_host_t *local,
 	return size;
 }
 
+// inet_receive_many (UDP)
+//
+// Receives up to `count' datagrams (at most `IN_BATCH') waiting on `local' in
+// one system call, without waiting for any to arrive. Datagram `i' is stored
+// in the `dgrams[i].len' bytes at `dgrams[i].data', after which `len' is its
+// size and `addr' its sender.
+//
+// Returns one of:
+//      Number of datagrams received    Success.
+//      -EIN_TIME                       No datagram is waiting.
+//      -EIN_RECV                       Error receiving data.
+int
+inet_receive_many(inet_host_t *local,
+		inet_datagram_t *dgrams,
+		int count)
+{
+	struct mmsghdr msgs[IN_BATCH];
+	struct iovec iovs[IN_BATCH];
+	int i, size;
+
+	if (count > IN_BATCH)
+		count = IN_BATCH;
+	for (i = 0; i < count; i++) {
+		iovs[i].iov_base = dgrams[i].data;
+		iovs[i].iov_len = dgrams[i].len;
+		memset(&(msgs[i].msg_hdr), 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_name = &(dgrams[i].addr);
+		msgs[i].msg_hdr.msg_namelen = sizeof(dgrams[i].addr);
+		msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	size = recvmmsg(local->fd, msgs, count, MSG_DONTWAIT, NULL);
+	if (size < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EIN_TIME;
+		perror("Error receiving data!\n");
+		return -EIN_RECV;
+	}
+	for (i = 0; i < size; i++)
+		dgrams[i].len = msgs[i].msg_len;
+
+	return size;
+}
+
+// Sends the `count' datagrams in `msgs' from `local', as many per system call
+// as the kernel takes; one that cannot be sent is skipped. Returns 0, or
+// -EIN_SEND if any could not be sent.
+static int
+inet_flush(inet_host_t *local, struct mmsghdr *msgs, int count)
+{
+	int done = 0, ret = 0, size;
+	while (done < count) {
+		size = sendmmsg(local->fd, msgs + done, count - done, 0);
+		if (size < 0) {
+			perror("Error sending data!\n");
+			ret = -EIN_SEND;
+			size = 1;
+		}
+		done += size;
+	}
+	return ret;
+}
+
+// inet_send_many (UDP)
+//
+// Sends the `count' datagrams in `dgrams' from `local', each the `len' bytes
+// at `data' to `addr', in as few system calls as `IN_BATCH' at a time allows.
+// Loss and delay injection apply to each as in `inet_send'.
+//
+// Returns one of:
+//      `count'         Success.
+//      -EIN_SEND       Error sending one or more of them.
+int
+inet_send_many(inet_host_t *local,
+		inet_datagram_t *dgrams,
+		int count)
+{
+	struct mmsghdr msgs[IN_BATCH];
+	struct iovec iovs[IN_BATCH];
+	int i, n = 0, ret = count;
+
+	for (i = 0; i < count; i++) {
+		if (inet_lost() || (inet_delay && inet_defer(local, &(dgrams[i].addr), dgrams[i].data, dgrams[i].len)))
+			continue;
+		iovs[n].iov_base = dgrams[i].data;
+		iovs[n].iov_len = dgrams[i].len;
+		memset(&(msgs[n].msg_hdr), 0, sizeof(msgs[n].msg_hdr));
+		msgs[n].msg_hdr.msg_name = &(dgrams[i].addr);
+		msgs[n].msg_hdr.msg_namelen = sizeof(dgrams[i].addr);
+		msgs[n].msg_hdr.msg_iov = &(iovs[n]);
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		if (++n == IN_BATCH) {
+			if (inet_flush(local, msgs, n) < 0)
+				ret = -EIN_SEND;
+			n = 0;
+		}
+	}
+	if (n && (inet_flush(local, msgs, n) < 0))
+		ret = -EIN_SEND;
+
+	return ret;
+}
+
+// inet_set_buffers (TCP / UDP)
+//
+// Sizes the receive and send buffers of the socket of `host' to `rcvbuf' and
+// `sndbuf' bytes; 0 leaves a buffer as it is. The kernel caps them at
+// net.core.rmem_max and net.core.wmem_max.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error sizing a buffer.
+int
+inet_set_buffers(inet_host_t *host,
+		int rcvbuf,
+		int sndbuf)
+{
+	if ((rcvbuf > 0 && setsockopt(host->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) ||
+			(sndbuf > 0 && setsockopt(host->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)) {
+		perror("Error sizing socket buffers!\n");
+		return -EIN_SOCK;
+	}
+
+	return 0;
+}
+
+// inet_set_send_timeout (TCP / UDP)
+//
+// Makes `inet_send' on the socket of `host' give up once it has blocked for
+// `ms' milliseconds (SO_SNDTIMEO); 0 lets it block for good again. A TCP send
+// that times out part way returns the bytes it got into the socket.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error setting the option.
+int
+inet_set_send_timeout(inet_host_t *host,
+		int ms)
+{
+	struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+	if (setsockopt(host->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+		perror("Error setting socket send timeout!\n");
+		return -EIN_SOCK;
+	}
+
+	return 0;
+}
+
+// inet_set_busy_poll (TCP / UDP)
+//
+// Makes blocking reads and polls of the socket of `host' busy-poll the device
+// queue for up to `us' microseconds before sleeping (SO_BUSY_POLL), on drivers
+// that support it; 0 turns it off. Raising it past net.core.busy_read takes
+// CAP_NET_ADMIN.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error setting the option, or it is not supported.
+int
+inet_set_busy_poll(inet_host_t *host,
+		int us)
+{
+#ifdef SO_BUSY_POLL
+	if (setsockopt(host->fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == 0)
+		return 0;
+#endif
+	return -EIN_SOCK;
+}
+
+#if IN_URING
+#define IN_RING_ENTRIES 256 // Submission queue entries of a ring
+
+// What a request of a ring is for, in the low bits of its `user_data'; the
+// file or send slot it is for is above them
+enum { IN_RING_RECV, IN_RING_POLL, IN_RING_SEND };
+
+// A datagram on its way out of a ring, and where it goes
+typedef struct inet_ring_send {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in addr;
+} inet_ring_send_t;
+
+struct inet_ring {
+	int fd;
+	int size; // Most bytes of a datagram
+
+	// Submission and completion queues, shared with the kernel
+	void *rings;
+	size_t rings_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head, *sq_tail, sq_mask;
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Descriptors watched, by their index among the registered files
+	struct {
+		int fd;
+		int tag;
+		int kind; // IN_RING_RECV or IN_RING_POLL
+		int armed; // Whether its multishot request is still going
+	} files[IN_RING_FILES];
+	int nfiles;
+	struct msghdr recv_msg; // What receives fill in besides the data
+
+	// Buffers the kernel picks to receive into, and those handed out by
+	// the last `inet_ring_wait' to be given back
+	struct io_uring_buf_ring *bufs;
+	unsigned char *recv_data;
+	int stride;
+	unsigned short taken[IN_RING_BUFFERS];
+	int ntaken;
+
+	// Datagrams on their way out, and the slots free for more
+	inet_ring_send_t sends[IN_RING_SENDS];
+	unsigned char *send_data;
+	int free_sends[IN_RING_SENDS];
+	int nfree_sends;
+};
+
+// Submits what was queued on `ring', posts the completions the kernel has
+// and, if `wait', waits up to `timeout' ms (forever if negative) for one.
+// Returns what io_uring_enter does.
+static int
+inet_ring_enter(inet_ring_t *ring,
+		int wait,
+		int timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned int queued = *(ring->sq_tail) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (wait && (timeout >= 0)) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		arg.ts = (unsigned long)&ts;
+	}
+	return syscall(__NR_io_uring_enter, ring->fd, queued, (wait ? 1 : 0),
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+// Returns the next free submission queue entry of `ring', cleared, submitting
+// those queued if there is none; NULL if the kernel takes none of them.
+static struct io_uring_sqe *
+inet_ring_sqe(inet_ring_t *ring)
+{
+	unsigned int tail = *(ring->sq_tail);
+	if ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) > ring->sq_mask) {
+		inet_ring_enter(ring, 0, 0);
+		if ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) > ring->sq_mask)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe = &(ring->sqes[tail & ring->sq_mask]);
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// Queues the entry `inet_ring_sqe' returned last.
+static void
+inet_ring_push(inet_ring_t *ring)
+{
+	__atomic_store_n(ring->sq_tail, *(ring->sq_tail) + 1, __ATOMIC_RELEASE);
+}
+
+// Hands the buffers taken out of `ring' back to the kernel.
+static void
+inet_ring_give(inet_ring_t *ring)
+{
+	unsigned short tail = ring->bufs->tail;
+	int i;
+	for (i = 0; i < ring->ntaken; i++) {
+		struct io_uring_buf *b = &(ring->bufs->bufs[(tail + i) & (IN_RING_BUFFERS - 1)]);
+		b->addr = (unsigned long)(ring->recv_data + (ring->taken[i] * ring->stride));
+		b->len = ring->stride;
+		b->bid = ring->taken[i];
+	}
+	__atomic_store_n(&(ring->bufs->tail), (unsigned short)(tail + ring->ntaken), __ATOMIC_RELEASE);
+	ring->ntaken = 0;
+}
+
+// Queues the multishot receive or poll of registered file `file' of `ring'.
+// Returns 0, or -1 if there is no room to.
+static int
+inet_ring_arm(inet_ring_t *ring,
+		int file)
+{
+	struct io_uring_sqe *sqe = inet_ring_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->fd = file;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->user_data = ((unsigned long long)file << 2) | ring->files[file].kind;
+	if (ring->files[file].kind == IN_RING_RECV) {
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->addr = (unsigned long)&(ring->recv_msg);
+		sqe->len = 1;
+		sqe->buf_group = 0;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->poll32_events = POLLIN;
+	}
+	inet_ring_push(ring);
+	ring->files[file].armed = 1;
+	return 0;
+}
+
+// Registers `fd' with `ring' and starts receiving on or polling it, as `kind'
+// says, for `inet_ring_wait' to report as `tag'.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error registering `fd', or the ring watches too many.
+// 	-EIN_RECV	The kernel turned the request down (before Linux 6.0).
+static int
+inet_ring_watch(inet_ring_t *ring,
+		int fd,
+		int tag,
+		int kind)
+{
+	struct io_uring_files_update update;
+	int file = ring->nfiles;
+	unsigned int head, tail;
+
+	if (file == IN_RING_FILES)
+		return -EIN_SOCK;
+	memset(&update, 0, sizeof(update));
+	update.offset = file;
+	update.fds = (unsigned long)&fd;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 1)
+		return -EIN_SOCK;
+	ring->files[file].fd = fd;
+	ring->files[file].tag = tag;
+	ring->files[file].kind = kind;
+	ring->nfiles++;
+	if ((inet_ring_arm(ring, file) < 0) || (inet_ring_enter(ring, 0, 0) < 0))
+		return -EIN_SOCK;
+
+	// Requests the kernel does not support fail as they are submitted
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (head = *(ring->cq_head); head != tail; head++) {
+		struct io_uring_cqe *cqe = &(ring->cqes[head & ring->cq_mask]);
+		if (((cqe->user_data >> 2) == (unsigned int)file) && (cqe->res < 0) && !(cqe->flags & IORING_CQE_F_MORE))
+			return -EIN_RECV;
+	}
+
+	return 0;
+}
+
+// inet_ring_open
+//
+// Opens an io_uring instance receiving datagrams of up to `size' bytes on the
+// sockets given to `inet_ring_receive', into buffers registered with the
+// kernel, and sending them from slots of its own. Only the thread that opens
+// a ring may use it.
+//
+// Returns one of:
+//      Pointer to the ring             Close with `inet_ring_close'.
+//      NULL                            io_uring is missing, turned off, or
+//                                      too old (or IN_URING is 0).
+inet_ring_t *
+inet_ring_open(int size)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	int fds[IN_RING_FILES];
+	unsigned int i;
+
+	inet_ring_t *ring = calloc(1, sizeof(inet_ring_t));
+	ring->size = size;
+	ring->stride = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + size;
+
+	// Have completions posted only as this thread enters the ring, where
+	// the kernel can
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((ring->fd = syscall(__NR_io_uring_setup, IN_RING_ENTRIES, &p)) < 0) {
+		memset(&p, 0, sizeof(p));
+		ring->fd = syscall(__NR_io_uring_setup, IN_RING_ENTRIES, &p);
+	}
+	if ((ring->fd < 0) || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	// Map the queues
+	ring->rings_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	if (ring->rings_len < p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe)))
+		ring->rings_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	ring->rings = mmap(NULL, ring->rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		goto fail;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+	ring->sq_head = (unsigned int *)((char *)ring->rings + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->rings + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)((char *)ring->rings + p.sq_off.ring_mask);
+	ring->cq_head = (unsigned int *)((char *)ring->rings + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->rings + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((char *)ring->rings + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->rings + p.cq_off.cqes);
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned int *)((char *)ring->rings + p.sq_off.array))[i] = i;
+
+	// Leave room for the descriptors to watch
+	for (i = 0; i < IN_RING_FILES; i++)
+		fds[i] = -1;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, IN_RING_FILES) < 0)
+		goto fail;
+
+	// Register the buffers datagrams are received into
+	ring->bufs = mmap(NULL, IN_RING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufs == MAP_FAILED) {
+		ring->bufs = NULL;
+		goto fail;
+	}
+	ring->recv_data = malloc(IN_RING_BUFFERS * ring->stride);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->bufs;
+	reg.ring_entries = IN_RING_BUFFERS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (i = 0; i < IN_RING_BUFFERS; i++)
+		ring->taken[ring->ntaken++] = i;
+	inet_ring_give(ring);
+	ring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+	ring->send_data = malloc(IN_RING_SENDS * size);
+	for (i = 0; i < IN_RING_SENDS; i++)
+		ring->free_sends[ring->nfree_sends++] = IN_RING_SENDS - 1 - i;
+
+	return ring;
+
+fail:
+	inet_ring_close(ring);
+	return NULL;
+}
+
+// inet_ring_receive (UDP)
+//
+// Makes `inet_ring_wait' on `ring' report the datagrams that arrive on
+// `local' as `tag', received with one multishot request that the kernel
+// keeps filling buffers from.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error registering the socket.
+// 	-EIN_RECV	The kernel cannot receive that way.
+int
+inet_ring_receive(inet_ring_t *ring,
+		inet_host_t *local,
+		int tag)
+{
+	return inet_ring_watch(ring, local->fd, tag, IN_RING_RECV);
+}
+
+// inet_ring_poll
+//
+// Makes `inet_ring_wait' on `ring' report `tag' whenever `fd' becomes
+// readable; reading it is up to the caller.
+//
+// Returns one of:
+// 	0		Success.
+// 	-EIN_SOCK	Error registering `fd'.
+int
+inet_ring_poll(inet_ring_t *ring,
+		int fd,
+		int tag)
+{
+	return (inet_ring_watch(ring, fd, tag, IN_RING_POLL) < 0) ? -EIN_SOCK : 0;
+}
+
+// inet_ring_send_many (UDP)
+//
+// Queues the `count' datagrams in `dgrams' to be sent from `local' with the
+// next `inet_ring_wait' on `ring', copying them first; those that do not fit
+// into a free slot go out right away with `inet_send_many'. Loss and delay
+// injection apply to each as in `inet_send'.
+//
+// Returns one of:
+//      `count'         Success.
+//      -EIN_SEND       Error sending one or more of them right away.
+int
+inet_ring_send_many(inet_ring_t *ring,
+		inet_host_t *local,
+		inet_datagram_t *dgrams,
+		int count)
+{
+	struct io_uring_sqe *sqe;
+	int file, i, slot;
+
+	for (file = 0; (file < ring->nfiles) && (ring->files[file].fd != local->fd); file++);
+	for (i = 0; i < count; i++) {
+		if (!ring->nfree_sends || (dgrams[i].len > ring->size) || !(sqe = inet_ring_sqe(ring))) {
+			// Keep what goes out right away behind what was queued
+			inet_ring_enter(ring, 0, 0);
+			return (inet_send_many(local, dgrams + i, count - i) < 0) ? -EIN_SEND : count;
+		}
+		if (inet_lost() || (inet_delay && inet_defer(local, &(dgrams[i].addr), dgrams[i].data, dgrams[i].len)))
+			continue;
+
+		slot = ring->free_sends[--ring->nfree_sends];
+		inet_ring_send_t *s = &(ring->sends[slot]);
+		s->addr = dgrams[i].addr;
+		s->iov.iov_base = ring->send_data + (slot * ring->size);
+		s->iov.iov_len = dgrams[i].len;
+		memcpy(s->iov.iov_base, dgrams[i].data, dgrams[i].len);
+		memset(&(s->msg), 0, sizeof(s->msg));
+		s->msg.msg_name = &(s->addr);
+		s->msg.msg_namelen = sizeof(s->addr);
+		s->msg.msg_iov = &(s->iov);
+		s->msg.msg_iovlen = 1;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		if (file < ring->nfiles) {
+			sqe->fd = file;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else
+			sqe->fd = local->fd;
+		sqe->addr = (unsigned long)&(s->msg);
+		sqe->len = 1;
+		sqe->user_data = ((unsigned long long)slot << 2) | IN_RING_SEND;
+		inet_ring_push(ring);
+	}
+
+	return count;
+}
+
+// inet_ring_wait
+//
+// Submits what was queued on `ring', waits up to `timeout' ms (forever if
+// negative; not at all if 0) for something to complete unless something has,
+// and stores up to `count' of the events that did in `events', all with one
+// system call at most. The data of the datagrams among them stays valid until
+// the next call.
+//
+// Returns one of:
+//      Number of events stored         Success, 0 if it timed out.
+//      -EIN_RECV                       Error entering the ring.
+int
+inet_ring_wait(inet_ring_t *ring,
+		inet_ring_event_t *events,
+		int count,
+		int timeout)
+{
+	unsigned int head, tail;
+	int file, n = 0;
+
+	// Take the buffers handed out last time back, and restart requests that
+	// stopped (a receive stops when it runs out of buffers)
+	if (ring->ntaken)
+		inet_ring_give(ring);
+	for (file = 0; file < ring->nfiles; file++)
+		if (!ring->files[file].armed)
+			inet_ring_arm(ring, file);
+
+	head = *(ring->cq_head);
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if ((head == tail) || (*(ring->sq_tail) != __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE))) {
+		if ((inet_ring_enter(ring, ((head == tail) && timeout), timeout) < 0) &&
+				(errno != ETIME) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+			perror("Error receiving data!\n");
+			return -EIN_RECV;
+		}
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; (head != tail) && (n < count); head++) {
+		struct io_uring_cqe *cqe = &(ring->cqes[head & ring->cq_mask]);
+		int index = cqe->user_data >> 2;
+		switch (cqe->user_data & 3) {
+			case IN_RING_SEND:
+				ring->free_sends[ring->nfree_sends++] = index;
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("Error sending data!\n");
+				}
+				break;
+			case IN_RING_POLL:
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					ring->files[index].armed = 0;
+				if (cqe->res > 0) {
+					events[n].tag = ring->files[index].tag;
+					events[n].dgram.data = NULL;
+					events[n++].dgram.len = 0;
+				}
+				break;
+			case IN_RING_RECV:
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					ring->files[index].armed = 0;
+				if (cqe->flags & IORING_CQE_F_BUFFER) {
+					int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+					unsigned char *buf = ring->recv_data + (bid * ring->stride);
+					struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+					ring->taken[ring->ntaken++] = bid;
+					if ((cqe->res >= 0) && !(out->flags & MSG_TRUNC)) {
+						events[n].tag = ring->files[index].tag;
+						memcpy(&(events[n].dgram.addr), buf + sizeof(*out), sizeof(struct sockaddr_in));
+						events[n].dgram.data = buf + sizeof(*out) + ring->recv_msg.msg_namelen;
+						events[n++].dgram.len = out->payloadlen;
+					}
+				}
+				break;
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+// inet_ring_close
+//
+// Cancels whatever `ring' still has going, closes it and frees it. The
+// descriptors it watched are let go of before it returns; the kernel would
+// otherwise only do that as it gets around to tearing the ring down.
+void
+inet_ring_close(inet_ring_t *ring)
+{
+	struct io_uring_sync_cancel_reg cancel;
+
+	if (ring->fd >= 0) {
+		memset(&cancel, 0, sizeof(cancel));
+		cancel.fd = -1;
+		cancel.flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		cancel.timeout.tv_sec = -1;
+		cancel.timeout.tv_nsec = -1;
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+		syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+		close(ring->fd);
+	}
+	if (ring->rings)
+		munmap(ring->rings, ring->rings_len);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->bufs)
+		munmap(ring->bufs, IN_RING_BUFFERS * sizeof(struct io_uring_buf));
+	free(ring->recv_data);
+	free(ring->send_data);
+	free(ring);
+}
+#else
+// Without io_uring compiled in, rings never open
+inet_ring_t *
+inet_ring_open(int size)
+{
+	return NULL;
+}
+
+int
+inet_ring_receive(inet_ring_t *ring, inet_host_t *local, int tag)
+{
+	return -EIN_SOCK;
+}
+
+int
+inet_ring_poll(inet_ring_t *ring, int fd, int tag)
+{
+	return -EIN_SOCK;
+}
+
+int
+inet_ring_send_many(inet_ring_t *ring, inet_host_t *local, inet_datagram_t *dgrams, int count)
+{
+	return inet_send_many(local, dgrams, count);
+}
+
+int
+inet_ring_wait(inet_ring_t *ring, inet_ring_event_t *events, int count, int timeout)
+{
+	return -EIN_RECV;
+}
+
+void
+inet_ring_close(inet_ring_t *ring)
+{
+}
+#endif
+
 // inet_close (TCP / UDP)
 //
 // Closes an inet connection.
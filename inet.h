@@ -65,12 +65,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 
 #define IN_PORT_ANY 0
 #define IN_ADDR_ANY INADDR_ANY
@@ -80,6 +86,14 @@
 
 #define IN_BACKLOG 10 // Number of simultaneous incoming connections to allow
 #define IN_HOSTLEN 64 //
+#define IN_BATCH 64 // Most datagrams moved by one system call of `inet_*_many'
+
+#ifndef IN_URING
+#define IN_URING 1 // Whether `inet_ring_*' run on io_uring (Linux 6.0 on), or fail to open
+#endif
+#define IN_RING_FILES 4 // Most descriptors one ring watches
+#define IN_RING_BUFFERS 64 // Datagrams a ring receives into before they are handed back
+#define IN_RING_SENDS 64 // Datagrams a ring has on their way out at once
 
 // Set up our error codes
 typedef enum err_code {
@@ -94,19 +108,55 @@ typedef enum err_code {
 	EIN_TIME,	// Timeout
 } err_code_t;
 
+// One-way delay in ms of datagrams from `from' to `to', for `inet_set_delay'
+typedef double (*inet_delay_t)(const struct sockaddr_in *from,
+		const struct sockaddr_in *to);
+
 // Structure representing an internet host
 typedef struct inet_host {
 	int fd;
 	int protocol;
+	int nonblock;
 	struct sockaddr_in addr;
 } inet_host_t;
 
-void inet_setup(inet_host_t *, int, const char *, unsigned short);
+// One datagram of `inet_receive_many' or `inet_send_many'
+typedef struct inet_datagram {
+	struct sockaddr_in addr; // Where it came from, or goes to
+	void *data;
+	int len; // Bytes at `data' (room for them, until received)
+} inet_datagram_t;
+
+// An io_uring instance receiving on and polling a few descriptors
+typedef struct inet_ring inet_ring_t;
+
+// What `inet_ring_wait' found: a datagram received on a socket of the ring,
+// or (with `dgram.data' NULL) a descriptor it polls becoming readable
+typedef struct inet_ring_event {
+	int tag; // As given to `inet_ring_receive' or `inet_ring_poll'
+	inet_datagram_t dgram;
+} inet_ring_event_t;
+
+void inet_setup(inet_host_t *, int, struct in_addr, unsigned short);
 int inet_open(inet_host_t *, int, const char *, unsigned short);
 int inet_accept(inet_host_t *, inet_host_t *);
 int inet_connect(inet_host_t *, inet_host_t *);
+int inet_nonblock(inet_host_t *);
 int inet_receive(inet_host_t *, inet_host_t *, void *, int, int);
 int inet_send(inet_host_t *, inet_host_t *, void *, int);
+int inet_receive_many(inet_host_t *, inet_datagram_t *, int);
+int inet_send_many(inet_host_t *, inet_datagram_t *, int);
+int inet_set_buffers(inet_host_t *, int, int);
+int inet_set_send_timeout(inet_host_t *, int);
+int inet_set_busy_poll(inet_host_t *, int);
+inet_ring_t *inet_ring_open(int);
+int inet_ring_receive(inet_ring_t *, inet_host_t *, int);
+int inet_ring_poll(inet_ring_t *, int, int);
+int inet_ring_send_many(inet_ring_t *, inet_host_t *, inet_datagram_t *, int);
+int inet_ring_wait(inet_ring_t *, inet_ring_event_t *, int, int);
+void inet_ring_close(inet_ring_t *);
+void inet_set_loss(double);
+void inet_set_delay(inet_delay_t);
 int inet_close(inet_host_t *);
 char *inet_lookup(const char *);
 
@@ -15,8 +15,8 @@ int main(int argc, char **argv)
 	/* CLI thread */
 	char *line = NULL;
 	while (line = readline("triad> ")) {
-		char command[32], arg1[32];
-		sscanf(line, "%s %s\n", command, arg1);
+		char command[32] = "", arg1[32] = "", arg2[256] = "";
+		sscanf(line, "%31s %31s %255s\n", command, arg1, arg2);
 
 		/* quit */
 		if (!strcmp(command, "quit")) {
@@ -28,7 +28,10 @@ int main(int argc, char **argv)
 
 		/* status */
 		else if (!strcmp(command, "status")) {
-			rpc_get_status(strtoid(arg1));
+			endpoint_t e;
+			triad_endpoint_at(&e, arg1, RPC_PORT, 0);
+			triad_introduce(n, &e);
+			printf("%s is %s\n", arg1, ((rpc_get_status(n, e.id) == ST_CONNECTED) ? "connected" : "not connected"));
 		}
 
 		/* join */
@@ -46,9 +49,115 @@ int main(int argc, char **argv)
 
 		/* lookup */
 		else if (!strcmp(command, "lookup")) {
-			unsigned int id;
-			sscanf(arg1, "%u", &id);
-			printf("%u => %15s\n", id, triad_lookup(n, id));
+			chord_id_t id = (chord_id_t)strtoull(arg1, NULL, 10);
+			char owner[INET_ADDRSTRLEN];
+			printf("%" PRIid " => %15s\n", id, triad_lookup(n, id, owner));
+		}
+
+		/* key */
+		else if (!strcmp(command, "key")) {
+			char owner[INET_ADDRSTRLEN];
+			printf("%s (%" PRIid ") => %15s\n", arg1, triad_hash(arg1, strlen(arg1)), triad_lookup_key(n, arg1, strlen(arg1), owner));
+		}
+
+		/* put */
+		else if (!strcmp(command, "put")) {
+			if (triad_put(n, arg1, strlen(arg1), arg2, strlen(arg2)))
+				printf("stored %s\n", arg1);
+			else
+				printf("could not store %s!\n", arg1);
+		}
+
+		/* get */
+		else if (!strcmp(command, "get")) {
+			int len = triad_get(n, arg1, strlen(arg1), arg2, sizeof(arg2) - 1);
+			if (len < 0)
+				printf("%s is not stored\n", arg1);
+			else {
+				arg2[(len < (int)sizeof(arg2)) ? len : (int)sizeof(arg2) - 1] = '\0';
+				printf("%s = %s\n", arg1, arg2);
+			}
+		}
+
+		/* del */
+		else if (!strcmp(command, "del")) {
+			printf(triad_del(n, arg1, strlen(arg1)) ? "deleted %s\n" : "%s is not stored\n", arg1);
+		}
+
+		/* routing */
+		else if (!strcmp(command, "routing")) {
+			if (!strcmp(arg1, "iterative"))
+				n->routing = ROUTE_ITERATIVE;
+			else if (!strcmp(arg1, "recursive"))
+				n->routing = ROUTE_RECURSIVE;
+			printf("routing is %s\n", ((n->routing == ROUTE_ITERATIVE) ? "iterative" : "recursive"));
+		}
+
+		/* cache */
+		else if (!strcmp(command, "cache")) {
+			if (!strcmp(arg1, "verify"))
+				n->location_verify = 1;
+			else if (!strcmp(arg1, "trust"))
+				n->location_verify = 0;
+			else if (!strcmp(arg1, "clear"))
+				location_clear(n);
+			printf("location cache: %d ranges, %lu hits, %lu misses%s\n", n->nlocations, n->location_hits, n->location_misses, (n->location_verify ? " (verified)" : ""));
+		}
+
+		/* replicas */
+		else if (!strcmp(command, "replicas")) {
+			if (arg1[0])
+				n->replicas = atoi(arg1);
+			printf("%d replicas per key\n", n->replicas);
+		}
+
+		/* proximity */
+		else if (!strcmp(command, "proximity")) {
+			if (!strcmp(arg1, "on"))
+				n->proximity = 1;
+			else if (!strcmp(arg1, "off"))
+				n->proximity = 0;
+			printf("fingers go to the %s node of their interval\n", (n->proximity ? "nearest" : "first"));
+		}
+
+		/* trace */
+		else if (!strcmp(command, "trace")) {
+			if (!strcmp(arg1, "off"))
+				trace_level = TRACE_OFF;
+			else if (!strcmp(arg1, "events"))
+				trace_level = TRACE_EVENTS;
+			else if (!strcmp(arg1, "messages"))
+				trace_level = TRACE_MESSAGES;
+			else if (!strcmp(arg1, "clear"))
+				trace_clear();
+			else if (!strcmp(arg1, "dump")) {
+				FILE *out = (arg2[0] ? fopen(arg2, "w") : stdout);
+				if (!out)
+					printf("could not open %s!\n", arg2);
+				else {
+					printf("%d records\n", trace_dump(out));
+					if (out != stdout)
+						fclose(out);
+				}
+			}
+			printf("tracing %s (%s compiled in)\n", ((trace_level >= TRACE_MESSAGES) ? "messages" : ((trace_level == TRACE_EVENTS) ? "events" : "off")), ((TRACE_LEVEL >= TRACE_MESSAGES) ? "messages" : ((TRACE_LEVEL == TRACE_EVENTS) ? "events" : "nothing")));
+		}
+
+		/* stats */
+		else if (!strcmp(command, "stats")) {
+			stats_t *s = malloc(sizeof(stats_t));
+			endpoint_t e;
+			if (!arg1[0])
+				stats_collect(s);
+			else {
+				triad_endpoint_at(&e, arg1, RPC_PORT, 0);
+				triad_introduce(n, &e);
+			}
+			if (arg1[0] && !rpc_get_stats(n, e.id, s))
+				printf("%s did not answer!\n", arg1);
+			else
+				stats_print(s, stdout);
+			free(s);
 		}
 
 		/* print */
@@ -60,15 +169,17 @@ int main(int argc, char **argv)
 
 		command[0] = '\0';
 		arg1[0] = '\0';
+		arg2[0] = '\0';
 	}
 
 	free(n);
 
 	/*
-	printf("id: %u = str: %s\n", 0, idtostr(0));
-	printf("id: %u = str: %s\n", 12345678, idtostr(12345678));
-	printf("id: %u = str: %s\n", 2130706433, idtostr(2130706433));
-	printf("id: %u = str: %s\n", 4294967295u, idtostr(4294967295u));
+	char buf[INET_ADDRSTRLEN];
+	printf("id: %u = str: %s\n", 0, idtostr(0, buf));
+	printf("id: %u = str: %s\n", 12345678, idtostr(12345678, buf));
+	printf("id: %u = str: %s\n", 2130706433, idtostr(2130706433, buf));
+	printf("id: %u = str: %s\n", 4294967295u, idtostr(4294967295u, buf));
 	printf("str: %s = id: %u\n", "0.0.0.0", strtoid("0.0.0.0"));
 	printf("str: %s = id: %u\n", "127.0.0.1", strtoid("127.0.0.1"));
 	printf("str: %s = id: %u\n", "255.255.255.255", strtoid("255.255.255.255"));
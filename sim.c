@@ -0,0 +1,1088 @@
+// sim.c
+// A deterministic discrete-event simulator for triad rings.
+//
+// Usage: triadsim [options] (triadsim -h lists them)
+//
+// Every node runs the code of triad.c on a transport of its own, and all of
+// them run on one thread against a virtual clock: a datagram sent becomes an
+// event delivered after a delay drawn from a latency model, unless the loss
+// model drops it, and each transport ticks (retransmissions, timeouts and
+// stabilization) whenever transport_due says it is due.  Calls that block
+// (joins, leaves and lookups) run as tasks on stacks of their own, which
+// give way to the event loop while they wait.  Everything random is drawn
+// from generators seeded with -s, so a run can be repeated exactly.
+//
+// The ring starts out settled, with its nodes at 10.0.0.1 and up.  After a
+// warm-up, nodes join, leave and fail at random while lookups go from random
+// nodes to random keys; each lookup is checked against the ring as it is
+// when the lookup returns.  Messages are put down to the join, leave or
+// lookup that caused them, including those servers send on its behalf, and
+// to maintenance otherwise.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include "inet.h"
+#include "triad.h"
+
+#define SIM_STACK 262144   // bytes of stack per task
+#define SIM_REPLAY 4       // requests each transport remembers, few since hosts are many
+#define SIM_LOCAL 10000    // ns a datagram takes from a host to itself
+#define SIM_TEARDOWN 256   // nodes stopping at once at the end
+
+static int saved_stdout = -1;
+
+static void quiet(void)
+{
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	int fd = open("/dev/null", O_WRONLY);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+static void loud(void)
+{
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+}
+
+static double wall(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/**
+ * random numbers
+ */
+
+/* xoshiro256** seeded through splitmix64, so that runs repeat on any libc */
+typedef struct sim_random {
+	unsigned long long s[4];
+} sim_random_t;
+
+static unsigned long long rotl(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static void random_seed(sim_random_t *r, unsigned long long seed)
+{
+	int i;
+	for (i = 0; i < 4; i++) {
+		unsigned long long z = (seed += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		r->s[i] = z ^ (z >> 31);
+	}
+}
+
+static unsigned long long random_next(sim_random_t *r)
+{
+	unsigned long long *s = r->s, result = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* uniform in [0, 1) */
+static double random_uniform(sim_random_t *r)
+{
+	return (random_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned int random_below(sim_random_t *r, unsigned int n)
+{
+	return (unsigned int)(random_uniform(r) * n);
+}
+
+/* ns until the next event of a Poisson process of `rate' per second */
+static long long random_interval(sim_random_t *r, double rate)
+{
+	return (long long)((-log(1.0 - random_uniform(r)) / rate) * 1e9) + 1;
+}
+
+
+/**
+ * the simulated network
+ */
+
+typedef enum delay_model {
+	DELAY_FIXED = 0,  // `lo' ms
+	DELAY_UNIFORM,    // between `lo' and `hi' ms, drawn for each datagram
+	DELAY_PLANE,      // `lo' ms, and up to `hi' ms across the unit square hosts are in
+} delay_model_t;
+
+/* one address of the simulated network, and the transport serving there */
+typedef struct sim_host {
+	transport_t *t;       // NULL once it closed
+	node_t *node;         // NULL once it stopped
+	unsigned int addr;    // in network byte order
+	unsigned short port;  // of the server, in network byte order; the client is one up
+	double x, y;          // where it is, for DELAY_PLANE
+	long long tick;       // ns, when its tick is scheduled; -1 for never
+	unsigned int gen;     // of the tick scheduled, so earlier ones lapse
+	int failed;           // neither sends, receives nor ticks any more
+	int busy;             // tasks driving its node
+	int ring;             // in the ring lookups are checked against
+} sim_host_t;
+
+/* a datagram on its way, `size' bytes of frames */
+typedef struct sim_datagram {
+	unsigned int addr;    // of the sender
+	unsigned short port;
+	int server;           // to the server of the host, or to its client
+	unsigned int tag;     // of the operation it is part of, 0 for none
+	int size;
+	unsigned char data[];
+} sim_datagram_t;
+
+typedef enum sim_kind {
+	EV_DATAGRAM = 0,
+	EV_TICK,
+	EV_CHURN,
+	EV_LOOKUP,
+} sim_kind_t;
+
+typedef struct sim_event {
+	long long time;       // ns
+	unsigned long long seq;  // events at the same time go in the order they were made
+	sim_kind_t kind;
+	unsigned int gen;     // of an EV_TICK
+	sim_host_t *host;
+	sim_datagram_t *d;
+} sim_event_t;
+
+/* what an operation has cost, in messages */
+typedef enum op_kind {
+	OP_JOIN = 0,
+	OP_LEAVE,
+	OP_LOOKUP,
+	OP_KINDS,
+} op_kind_t;
+
+typedef struct sim_op {
+	op_kind_t kind;
+	int done;             // counted once it finished in the window
+	unsigned long messages;
+} sim_op_t;
+
+/* a call that blocks, run on a stack of its own */
+typedef struct sim_task {
+	ucontext_t context;
+	void *stack;
+	void (*run)(struct sim_task *);
+	sim_host_t *host;
+	sim_host_t *via;      // the node a join goes through
+	chord_id_t key;       // looked up
+	unsigned int tag;     // of its operation, 0 for none
+	long long started;    // ns
+	pthread_cond_t *cond; // waited on, NULL if it is not waiting
+	int done;
+	struct sim_task *prev;  // among those waiting, or in the run queue (`next' only)
+	struct sim_task *next;
+} sim_task_t;
+
+/* a growing array of samples */
+typedef struct samples {
+	double *v;
+	size_t count;
+	size_t size;
+} samples_t;
+
+static struct {
+	long long now;        // ns
+	long long start;      // of the window measured
+	long long end;
+	unsigned long long seq;
+	unsigned long long events;
+	sim_random_t net;     // delays and losses
+	sim_random_t work;    // hosts, nodes and the workload
+	delay_model_t delay;
+	double lo, hi;
+	double loss;
+
+	sim_event_t *heap;
+	size_t nheap;
+	size_t heap_size;
+
+	sim_host_t **hosts;   // every host there ever was, in order
+	size_t nhosts;
+	size_t hosts_size;
+	sim_host_t **map;     // open addressing on addr, grown at half full
+	size_t map_size;
+	unsigned int next_addr;
+	chord_id_t *used;     // ids ever taken, open addressing, grown at half full
+	size_t nused;
+	size_t used_size;
+
+	/* the nodes in the ring, by id, which lookups are checked against */
+	chord_id_t *ring;
+	sim_host_t **ring_hosts;
+	int nring;
+	int ring_size;
+
+	sim_task_t *current;  // running, NULL on the event loop
+	ucontext_t loop;
+	sim_task_t *runnable;
+	sim_task_t *runnable_tail;
+	sim_task_t *waiting;
+	sim_task_t *free_tasks;
+	int tasks;
+	unsigned int tag;     // of the operation whatever runs now is part of
+
+	sim_op_t *ops;        // by tag - 1
+	size_t nops;
+	size_t ops_size;
+
+	/* what happened in the window */
+	unsigned long long sent;
+	unsigned long long lost;
+	unsigned long long dropped;  // sent to hosts that were gone
+	unsigned long long maintenance;
+	unsigned long joins, joins_failed, leaves, failures;
+	unsigned long lookups, correct, wrong, unresolved;
+	unsigned long hops[STATS_HOPS];
+	samples_t join_ms, leave_ms, lookup_ms, hop_counts;
+	samples_t op_messages[OP_KINDS];
+
+	/* how the nodes are set up */
+	int interval;
+	routing_t routing;
+	int proximity;
+	int keep_cache;
+} sim;
+
+static void samples_add(samples_t *s, double v)
+{
+	if (s->count == s->size) {
+		s->size = (s->size ? (2 * s->size) : 1024);
+		s->v = realloc(s->v, s->size * sizeof(double));
+	}
+	s->v[s->count++] = v;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return ((x > y) - (x < y));
+}
+
+static double samples_mean(samples_t *s)
+{
+	double sum = 0;
+	size_t i;
+	for (i = 0; i < s->count; i++)
+		sum += s->v[i];
+	return (s->count ? (sum / s->count) : 0);
+}
+
+/* the `q' quantile; sorts the samples */
+static double samples_percentile(samples_t *s, double q)
+{
+	if (!s->count)
+		return 0;
+	qsort(s->v, s->count, sizeof(double), compare_double);
+	size_t i = (size_t)(q * s->count);
+	return s->v[(i < s->count) ? i : (s->count - 1)];
+}
+
+static void heap_push(long long time, sim_kind_t kind, sim_host_t *host, unsigned int gen, sim_datagram_t *d)
+{
+	if (sim.nheap == sim.heap_size) {
+		sim.heap_size = (sim.heap_size ? (2 * sim.heap_size) : 4096);
+		sim.heap = realloc(sim.heap, sim.heap_size * sizeof(sim_event_t));
+	}
+	sim_event_t e = { time, sim.seq++, kind, gen, host, d };
+	size_t i = sim.nheap++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		sim_event_t *p = &(sim.heap[parent]);
+		if ((p->time < e.time) || ((p->time == e.time) && (p->seq < e.seq)))
+			break;
+		sim.heap[i] = *p;
+		i = parent;
+	}
+	sim.heap[i] = e;
+}
+
+static sim_event_t heap_pop(void)
+{
+	sim_event_t top = sim.heap[0], last = sim.heap[--sim.nheap];
+	size_t i = 0, n = sim.nheap;
+	for (;;) {
+		size_t c = (2 * i) + 1;
+		if (c >= n)
+			break;
+		if (((c + 1) < n) && ((sim.heap[c + 1].time < sim.heap[c].time) || ((sim.heap[c + 1].time == sim.heap[c].time) && (sim.heap[c + 1].seq < sim.heap[c].seq))))
+			c++;
+		if ((last.time < sim.heap[c].time) || ((last.time == sim.heap[c].time) && (last.seq < sim.heap[c].seq)))
+			break;
+		sim.heap[i] = sim.heap[c];
+		i = c;
+	}
+	if (n)
+		sim.heap[i] = last;
+	return top;
+}
+
+static size_t hash_addr(unsigned int addr, size_t size)
+{
+	return (size_t)((addr * 2654435761u) ^ (addr >> 16)) & (size - 1);
+}
+
+static sim_host_t *host_at(unsigned int addr)
+{
+	size_t i;
+	if (!sim.map_size)
+		return NULL;
+	for (i = hash_addr(addr, sim.map_size); sim.map[i]; i = (i + 1) & (sim.map_size - 1))
+		if (sim.map[i]->addr == addr)
+			return sim.map[i];
+	return NULL;
+}
+
+static void host_map(sim_host_t *h)
+{
+	size_t i;
+	if ((2 * (sim.nhosts + 1)) > sim.map_size) {
+		sim_host_t **old = sim.map;
+		size_t size = sim.map_size;
+		sim.map_size = (size ? (2 * size) : 1024);
+		sim.map = calloc(sim.map_size, sizeof(sim_host_t *));
+		for (i = 0; i < size; i++)
+			if (old[i])
+				host_map(old[i]);
+		free(old);
+	}
+	for (i = hash_addr(h->addr, sim.map_size); sim.map[i]; i = (i + 1) & (sim.map_size - 1));
+	sim.map[i] = h;
+}
+
+/* takes `id' if no node has had it before; 0 if one has */
+static int id_take(chord_id_t id)
+{
+	size_t i;
+	if ((2 * (sim.nused + 1)) > sim.used_size) {
+		chord_id_t *old = sim.used;
+		size_t size = sim.used_size;
+		sim.used_size = (size ? (2 * size) : 1024);
+		sim.used = calloc(sim.used_size, sizeof(chord_id_t));
+		sim.nused = 0;
+		for (i = 0; i < size; i++)
+			if (old[i])
+				id_take(old[i]);
+		free(old);
+	}
+	for (i = hash_addr((unsigned int)id, sim.used_size); sim.used[i]; i = (i + 1) & (sim.used_size - 1))
+		if (sim.used[i] == id)
+			return 0;
+	sim.used[i] = id;
+	sim.nused++;
+	return 1;
+}
+
+/* ns a datagram takes from `from' to `to' */
+static long long sim_delay(sim_host_t *from, sim_host_t *to)
+{
+	double ms = sim.lo;
+	if (from == to)
+		return SIM_LOCAL;
+	if (sim.delay == DELAY_UNIFORM)
+		ms += (sim.hi - sim.lo) * random_uniform(&(sim.net));
+	else if (sim.delay == DELAY_PLANE)
+		ms += (sim.hi - sim.lo) * hypot(from->x - to->x, from->y - to->y) / M_SQRT2;
+	return (long long)(ms * 1e6);
+}
+
+/* schedules the tick of `h' for when its transport is due, unless one is
+ * scheduled before that already */
+static void sim_schedule(sim_host_t *h)
+{
+	if (!h->t || h->failed || !h->t->nnodes)
+		return;
+	long long due = transport_due(h->t) * 1000;
+	if (due < sim.now)
+		due = sim.now;
+	if ((h->tick >= 0) && (h->tick <= due))
+		return;
+	h->tick = due;
+	heap_push(due, EV_TICK, h, ++h->gen, NULL);
+}
+
+
+/**
+ * transport operations
+ */
+
+static void sim_address(inet_host_t *host, unsigned int addr, unsigned short port)
+{
+	memset(host, 0, sizeof(*host));
+	host->fd = -1;
+	host->protocol = IN_PROT_UDP;
+	host->addr.sin_family = AF_INET;
+	host->addr.sin_addr.s_addr = addr;
+	host->addr.sin_port = port;
+}
+
+static int sim_open(transport_t *t, const char *ip, unsigned short port)
+{
+	unsigned int addr = inet_addr(ip);
+	if (host_at(addr))
+		return 0;
+	sim_host_t *h = calloc(1, sizeof(sim_host_t));
+	h->t = t;
+	h->addr = addr;
+	h->port = htons(port ? port : RPC_PORT);
+	h->x = random_uniform(&(sim.work));
+	h->y = random_uniform(&(sim.work));
+	h->tick = -1;
+	host_map(h);
+	if (sim.nhosts == sim.hosts_size) {
+		sim.hosts_size = (sim.hosts_size ? (2 * sim.hosts_size) : 1024);
+		sim.hosts = realloc(sim.hosts, sim.hosts_size * sizeof(sim_host_t *));
+	}
+	sim.hosts[sim.nhosts++] = h;
+	sim_address(&(t->server), addr, h->port);
+	sim_address(&(t->client), addr, htons(ntohs(h->port) + 1));
+	t->stream.fd = -1;
+	t->replay_size = SIM_REPLAY;
+	t->driver = h;
+	return 1;
+}
+
+static void sim_start(transport_t *t)
+{
+	sim_schedule((sim_host_t *)t->driver);
+}
+
+static void sim_stop(transport_t *t)
+{
+	((sim_host_t *)t->driver)->t = NULL;
+}
+
+static int sim_send(inet_host_t *local, inet_host_t *remote, void *data, int size)
+{
+	sim_host_t *from = host_at(local->addr.sin_addr.s_addr), *to = host_at(remote->addr.sin_addr.s_addr);
+	int window = ((sim.now >= sim.start) && (sim.now < sim.end));
+	if (window)
+		sim.sent++;
+	if (sim.tag)
+		sim.ops[sim.tag - 1].messages++;
+	else if (window)
+		sim.maintenance++;
+	if (!from || !to)
+		return size;
+	if ((from != to) && (sim.loss > 0) && (random_uniform(&(sim.net)) < sim.loss)) {
+		sim.lost += window;
+		return size;
+	}
+	sim_datagram_t *d = malloc(sizeof(sim_datagram_t) + size);
+	d->addr = local->addr.sin_addr.s_addr;
+	d->port = local->addr.sin_port;
+	d->server = (remote->addr.sin_port == to->port);
+	d->tag = sim.tag;
+	d->size = size;
+	memcpy(d->data, data, size);
+	heap_push(sim.now + sim_delay(from, to), EV_DATAGRAM, to, 0, d);
+	return size;
+}
+
+static void sim_wake(transport_t *t)
+{
+	sim_schedule((sim_host_t *)t->driver);
+}
+
+static void sim_wait(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+	sim_task_t *k = sim.current;
+	if (!k) {
+		fprintf(stderr, "triadsim: a call blocked outside of a task\n");
+		abort();
+	}
+	k->cond = cond;
+	k->prev = NULL;
+	k->next = sim.waiting;
+	if (sim.waiting)
+		sim.waiting->prev = k;
+	sim.waiting = k;
+	pthread_mutex_unlock(lock);
+	swapcontext(&(k->context), &(sim.loop));
+	pthread_mutex_lock(lock);
+}
+
+static void sim_signal(pthread_cond_t *cond)
+{
+	sim_task_t *k;
+	for (k = sim.waiting; k && (k->cond != cond); k = k->next);
+	if (!k)
+		return;
+	if (k->prev)
+		k->prev->next = k->next;
+	else
+		sim.waiting = k->next;
+	if (k->next)
+		k->next->prev = k->prev;
+	k->cond = NULL;
+	k->next = NULL;
+	if (sim.runnable_tail)
+		sim.runnable_tail->next = k;
+	else
+		sim.runnable = k;
+	sim.runnable_tail = k;
+}
+
+static transport_t *sim_reach(const inet_host_t *remote)
+{
+	sim_host_t *h = host_at(remote->addr.sin_addr.s_addr);
+	if (!h || h->failed || (remote->addr.sin_port != h->port))
+		return NULL;
+	return h->t;
+}
+
+static long long sim_clock(void)
+{
+	return sim.now;
+}
+
+static const transport_ops_t sim_ops = {
+	sim_open,
+	sim_start,
+	sim_stop,
+	sim_send,
+	NULL,
+	sim_wake,
+	sim_wait,
+	sim_signal,
+	sim_reach,
+	sim_clock,
+};
+
+
+/**
+ * tasks
+ */
+
+static void task_entry(void)
+{
+	sim_task_t *k = sim.current;
+	k->run(k);
+	k->done = 1;
+}
+
+/* starts `run' for `h' as the operation `kind' (-1 for none) */
+static sim_task_t *task_start(void (*run)(sim_task_t *), sim_host_t *h, int kind)
+{
+	sim_task_t *k = sim.free_tasks;
+	if (k)
+		sim.free_tasks = k->next;
+	else {
+		k = calloc(1, sizeof(sim_task_t));
+		k->stack = malloc(SIM_STACK);
+	}
+	getcontext(&(k->context));
+	k->context.uc_stack.ss_sp = k->stack;
+	k->context.uc_stack.ss_size = SIM_STACK;
+	k->context.uc_link = &(sim.loop);
+	makecontext(&(k->context), task_entry, 0);
+	k->run = run;
+	k->host = h;
+	k->started = sim.now;
+	k->cond = NULL;
+	k->done = 0;
+	k->tag = 0;
+	if (kind >= 0) {
+		if (sim.nops == sim.ops_size) {
+			sim.ops_size = (sim.ops_size ? (2 * sim.ops_size) : 4096);
+			sim.ops = realloc(sim.ops, sim.ops_size * sizeof(sim_op_t));
+		}
+		sim.ops[sim.nops].kind = kind;
+		sim.ops[sim.nops].done = 0;
+		sim.ops[sim.nops].messages = 0;
+		k->tag = ++sim.nops;
+	}
+	h->busy++;
+	sim.tasks++;
+	k->next = NULL;
+	if (sim.runnable_tail)
+		sim.runnable_tail->next = k;
+	else
+		sim.runnable = k;
+	sim.runnable_tail = k;
+	return k;
+}
+
+/* runs the tasks that can run until they all wait or are done */
+static void task_run(void)
+{
+	sim_task_t *k;
+	while ((k = sim.runnable)) {
+		if (!(sim.runnable = k->next))
+			sim.runnable_tail = NULL;
+		sim.current = k;
+		sim.tag = k->tag;
+		swapcontext(&(sim.loop), &(k->context));
+		sim.current = NULL;
+		sim.tag = 0;
+		if (k->done) {
+			k->host->busy--;
+			sim.tasks--;
+			k->next = sim.free_tasks;
+			sim.free_tasks = k;
+		}
+	}
+}
+
+/* marks the operation of `k' done, with its latency */
+static void task_done(sim_task_t *k, samples_t *ms)
+{
+	if (k->tag)
+		sim.ops[k->tag - 1].done = 1;
+	samples_add(ms, (sim.now - k->started) / 1e6);
+}
+
+
+/**
+ * the ring lookups are checked against
+ */
+
+static int ring_find(chord_id_t id)
+{
+	int lo = 0, hi = sim.nring;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (sim.ring[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the successor of `id' in the ring */
+static chord_id_t ring_owner(chord_id_t id)
+{
+	int i = ring_find(id);
+	return sim.ring[(i == sim.nring) ? 0 : i];
+}
+
+static void ring_add(sim_host_t *h)
+{
+	int i = ring_find(h->node->id);
+	if (sim.nring == sim.ring_size) {
+		sim.ring_size = (sim.ring_size ? (2 * sim.ring_size) : 1024);
+		sim.ring = realloc(sim.ring, sim.ring_size * sizeof(chord_id_t));
+		sim.ring_hosts = realloc(sim.ring_hosts, sim.ring_size * sizeof(sim_host_t *));
+	}
+	memmove(&(sim.ring[i + 1]), &(sim.ring[i]), (sim.nring - i) * sizeof(chord_id_t));
+	memmove(&(sim.ring_hosts[i + 1]), &(sim.ring_hosts[i]), (sim.nring - i) * sizeof(sim_host_t *));
+	sim.ring[i] = h->node->id;
+	sim.ring_hosts[i] = h;
+	sim.nring++;
+	h->ring = 1;
+}
+
+static void ring_remove(sim_host_t *h)
+{
+	int i = ring_find(h->node->id);
+	memmove(&(sim.ring[i]), &(sim.ring[i + 1]), (sim.nring - i - 1) * sizeof(chord_id_t));
+	memmove(&(sim.ring_hosts[i]), &(sim.ring_hosts[i + 1]), (sim.nring - i - 1) * sizeof(sim_host_t *));
+	sim.nring--;
+	h->ring = 0;
+}
+
+/* a node in the ring that no task drives, or NULL if none turned up */
+static sim_host_t *ring_idle(void)
+{
+	int tries;
+	for (tries = 0; tries < 16; tries++) {
+		sim_host_t *h = sim.ring_hosts[random_below(&(sim.work), sim.nring)];
+		if (!h->busy)
+			return h;
+	}
+	return NULL;
+}
+
+/* the share of nodes in the ring whose successor (or fingers, if `fingers')
+ * the ring agrees with; with proximity, a finger may be any node in its
+ * interval */
+static double ring_right(int fingers)
+{
+	unsigned long right = 0, all = 0;
+	int i, f;
+	for (i = 0; i < sim.nring; i++) {
+		node_t *n = sim.ring_hosts[i]->node;
+		if (!fingers) {
+			right += (n->successor == ring_owner(n->id + 1));
+			all++;
+		}
+		for (f = 0; fingers && (f < KEYSPACE); f++) {
+			finger_t *finger = &(n->finger_table[f]);
+			chord_id_t owner = ring_owner(finger->start);
+			if (finger->successor == owner)
+				right++;
+			else if (sim.proximity && in_range_in_ex_circular(finger->start, finger->end, owner)) {
+				int at = ring_find(finger->successor);
+				right += ((at < sim.nring) && (sim.ring[at] == finger->successor) && in_range_in_ex_circular(finger->start, finger->end, finger->successor));
+			}
+			all++;
+		}
+	}
+	return (all ? ((100.0 * right) / all) : 0);
+}
+
+
+/**
+ * workload
+ */
+
+/* starts a node at the next free address whose id no node had before */
+static sim_host_t *node_start(void)
+{
+	char ip[16];
+	node_t *n;
+	for (;;) {
+		unsigned int a = ++sim.next_addr;
+		sprintf(ip, "10.%u.%u.%u", (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff);
+		if (id_take(triad_node_id(ip, RPC_PORT, 0)) && (n = triad_init(ip)))
+			break;
+	}
+	sim_host_t *h = (sim_host_t *)n->transport->driver;
+	h->node = n;
+	n->seed = (unsigned int)random_next(&(sim.work));
+	n->stabilize_interval = sim.interval;
+	n->routing = sim.routing;
+	n->proximity = sim.proximity;
+	return h;
+}
+
+static void introduce(node_t *n, chord_id_t id)
+{
+	int i = ring_find(id);
+	if ((id != n->id) && (i < sim.nring) && (sim.ring[i] == id))
+		triad_introduce(n, &(sim.ring_hosts[i]->node->endpoint));
+}
+
+/* gives the nodes in the ring the routing state stabilization would settle
+ * on, and spreads their rounds over one interval */
+static void ring_settle(void)
+{
+	int i, s, f;
+	for (i = 0; i < sim.nring; i++) {
+		node_t *n = sim.ring_hosts[i]->node;
+		n->predecessor = sim.ring[(i + sim.nring - 1) % sim.nring];
+		n->successor = sim.ring[(i + 1) % sim.nring];
+		n->nsuccessors = 0;
+		for (s = 1; (s < sim.nring) && (s <= SUCCESSORS); s++)
+			n->successors[n->nsuccessors++] = sim.ring[(i + s) % sim.nring];
+		for (f = 0; f < KEYSPACE; f++)
+			n->finger_table[f].successor = ring_owner(n->finger_table[f].start);
+		finger_index(n);
+		n->status = ST_CONNECTED;
+		introduce(n, n->predecessor);
+		for (s = 0; s < n->nsuccessors; s++)
+			introduce(n, n->successors[s]);
+		for (f = 0; f < KEYSPACE; f++)
+			introduce(n, n->finger_table[f].successor);
+		n->next_stabilize = (sim.now / 1000) + (long long)(random_uniform(&(sim.work)) * sim.interval * 1000);
+		sim_schedule(sim.ring_hosts[i]);
+	}
+}
+
+static void task_join(sim_task_t *k)
+{
+	sim_host_t *h = k->host;
+	endpoint_t via = k->via->node->endpoint;
+	if (triad_join_endpoint(h->node, &via) && (h->node->status == ST_CONNECTED)) {
+		task_done(k, &(sim.join_ms));
+		sim.joins++;
+		ring_add(h);
+		return;
+	}
+	sim.joins_failed++;
+	triad_deinit(h->node);
+	free(h->node);
+	h->node = NULL;
+}
+
+static void task_leave(sim_task_t *k)
+{
+	sim_host_t *h = k->host;
+	triad_leave(h->node);
+	task_done(k, &(sim.leave_ms));
+	sim.leaves++;
+	/* stopping is not part of leaving */
+	k->tag = sim.tag = 0;
+	triad_deinit(h->node);
+	free(h->node);
+	h->node = NULL;
+}
+
+static void task_lookup(sim_task_t *k)
+{
+	node_t *n = k->host->node;
+	unsigned int hops = 0;
+	if (!sim.keep_cache)
+		location_clear(n);
+	chord_id_t owner = route_successor(n, k->key, &hops);
+	task_done(k, &(sim.lookup_ms));
+	sim.lookups++;
+	if (!owner)
+		sim.unresolved++;
+	else {
+		if (owner == ring_owner(k->key))
+			sim.correct++;
+		else
+			sim.wrong++;
+		sim.hops[(hops < STATS_HOPS) ? hops : (STATS_HOPS - 1)]++;
+		samples_add(&(sim.hop_counts), hops);
+	}
+}
+
+static void task_stop(sim_task_t *k)
+{
+	sim_host_t *h = k->host;
+	triad_deinit(h->node);
+	free(h->node);
+	h->node = NULL;
+}
+
+/* a node joins, or one leaves or fails (`failures' of the time) */
+static void churn(double failures)
+{
+	sim_host_t *h;
+	if (!sim.nring)
+		return;
+	if ((sim.nring < 3) || (random_uniform(&(sim.work)) < 0.5)) {
+		sim_host_t *via = sim.ring_hosts[random_below(&(sim.work), sim.nring)];
+		h = node_start();
+		task_start(task_join, h, OP_JOIN)->via = via;
+	}
+	else if ((h = ring_idle())) {
+		ring_remove(h);
+		if (random_uniform(&(sim.work)) < failures) {
+			h->failed = 1;
+			sim.failures++;
+		}
+		else
+			task_start(task_leave, h, OP_LEAVE);
+	}
+}
+
+static void lookup(void)
+{
+	sim_host_t *h;
+	if (!sim.nring)
+		return;
+	h = sim.ring_hosts[random_below(&(sim.work), sim.nring)];
+	task_start(task_lookup, h, OP_LOOKUP)->key = (chord_id_t)random_next(&(sim.work));
+}
+
+/* handles the next event */
+static void step(double churn_rate, double failures, double lookup_rate)
+{
+	sim_event_t e = heap_pop();
+	sim_host_t *h = e.host;
+	sim.now = e.time;
+	sim.events++;
+	switch (e.kind) {
+		case EV_DATAGRAM:
+			{
+				sim_datagram_t *d = e.d;
+				if (!h->t || h->failed)
+					sim.dropped += ((sim.now >= sim.start) && (sim.now < sim.end));
+				else {
+					inet_host_t from;
+					sim_address(&from, d->addr, d->port);
+					sim.tag = d->tag;
+					if (!transport_receive(h->t, (d->server ? &(h->t->server) : &(h->t->client)), &from, d->data, d->size))
+						transport_tick(h->t);
+					sim.tag = 0;
+				}
+				free(d);
+				break;
+			}
+		case EV_TICK:
+			if ((e.gen != h->gen) || !h->t || h->failed)
+				break;
+			h->tick = -1;
+			transport_tick(h->t);
+			sim_schedule(h);
+			break;
+		case EV_CHURN:
+			if (sim.now >= sim.end)
+				break;
+			churn(failures);
+			heap_push(sim.now + random_interval(&(sim.work), churn_rate), EV_CHURN, NULL, 0, NULL);
+			break;
+		case EV_LOOKUP:
+			if (sim.now >= sim.end)
+				break;
+			lookup();
+			heap_push(sim.now + random_interval(&(sim.work), lookup_rate), EV_LOOKUP, NULL, 0, NULL);
+			break;
+	}
+	task_run();
+}
+
+
+/**
+ * driver
+ */
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options]\n", name);
+	fprintf(stderr, "  -n nodes     in the ring to begin with (1000)\n");
+	fprintf(stderr, "  -t seconds   measured, after the warm-up (30)\n");
+	fprintf(stderr, "  -w seconds   of warm-up, with the ring left to itself (5)\n");
+	fprintf(stderr, "  -c rate      joins, leaves and failures per second (0)\n");
+	fprintf(stderr, "  -f share     of the nodes going that fail rather than leave (0.5)\n");
+	fprintf(stderr, "  -q rate      lookups per second (100)\n");
+	fprintf(stderr, "  -d delay     fixed:ms, uniform:lo:hi or plane:lo:hi, in ms (plane:5:100)\n");
+	fprintf(stderr, "  -p loss      share of datagrams dropped (0)\n");
+	fprintf(stderr, "  -i interval  ms between stabilization rounds (%d)\n", STABILIZE_INTERVAL);
+	fprintf(stderr, "  -r routing   iterative or recursive (iterative)\n");
+	fprintf(stderr, "  -x           fingers go to the nearest node of their interval\n");
+	fprintf(stderr, "  -k           keep location caches across lookups\n");
+	fprintf(stderr, "  -s seed      of everything random (1)\n");
+	fprintf(stderr, "  -o format    text or json (text)\n");
+	fprintf(stderr, "  -v           print message counts by type as well\n");
+}
+
+int main(int argc, char **argv)
+{
+	int size = 1000, verbose = 0, opt, i, k;
+	double seconds = 30, warmup = 5, churn_rate = 0, failures = 0.5, lookup_rate = 100;
+	unsigned long long seed = 1;
+	const char *delay = "plane:5:100", *format = "text";
+	sim.interval = STABILIZE_INTERVAL;
+	while ((opt = getopt(argc, argv, "n:t:w:c:f:q:d:p:i:r:xks:o:vh")) != -1) {
+		switch (opt) {
+			case 'n': size = atoi(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'w': warmup = atof(optarg); break;
+			case 'c': churn_rate = atof(optarg); break;
+			case 'f': failures = atof(optarg); break;
+			case 'q': lookup_rate = atof(optarg); break;
+			case 'd': delay = optarg; break;
+			case 'p': sim.loss = atof(optarg); break;
+			case 'i': sim.interval = atoi(optarg); break;
+			case 'r': sim.routing = (strcmp(optarg, "recursive") ? ROUTE_ITERATIVE : ROUTE_RECURSIVE); break;
+			case 'x': sim.proximity = 1; break;
+			case 'k': sim.keep_cache = 1; break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			case 'o': format = optarg; break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (!strncmp(delay, "fixed:", 6) && (sscanf(delay + 6, "%lf", &sim.lo) == 1))
+		sim.delay = DELAY_FIXED;
+	else if (!strncmp(delay, "uniform:", 8) && (sscanf(delay + 8, "%lf:%lf", &sim.lo, &sim.hi) == 2))
+		sim.delay = DELAY_UNIFORM;
+	else if (!strncmp(delay, "plane:", 6) && (sscanf(delay + 6, "%lf:%lf", &sim.lo, &sim.hi) == 2))
+		sim.delay = DELAY_PLANE;
+	else {
+		usage(argv[0]);
+		return 1;
+	}
+	if ((size < 2) || (sim.interval <= 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	random_seed(&(sim.net), seed);
+	random_seed(&(sim.work), seed ^ 0x5851f42d4c957f2dull);
+	/* the clock starts at 1 s, since 0 stands for never in places */
+	sim.now = 1000000000LL;
+	sim.start = sim.now + (long long)(warmup * 1e9);
+	sim.end = sim.start + (long long)(seconds * 1e9);
+	triad_transport(&sim_ops);
+
+	quiet();
+	double t0 = wall();
+	for (i = 0; i < size; i++)
+		ring_add(node_start());
+	ring_settle();
+	if (churn_rate > 0)
+		heap_push(sim.start + random_interval(&(sim.work), churn_rate), EV_CHURN, NULL, 0, NULL);
+	if (lookup_rate > 0)
+		heap_push(sim.start + random_interval(&(sim.work), lookup_rate), EV_LOOKUP, NULL, 0, NULL);
+	while (sim.nheap && ((sim.now < sim.end) || sim.tasks))
+		step(churn_rate, failures, lookup_rate);
+	double elapsed = wall() - t0;
+	long long simulated = sim.now - sim.start + (long long)(warmup * 1e9);
+	unsigned long long events = sim.events;
+	double successors = ring_right(0), fingers = ring_right(1);
+	int nodes = sim.nring;
+
+	for (i = 0; i < (int)sim.nops; i++)
+		if (sim.ops[i].done)
+			samples_add(&(sim.op_messages[sim.ops[i].kind]), sim.ops[i].messages);
+	stats_t *stats = (verbose ? malloc(sizeof(stats_t)) : NULL);
+	if (stats)
+		stats_collect(stats);
+
+	/* stop the nodes still up, a few at a time; failed ones stay as
+	 * they are */
+	for (i = 0; (i < (int)sim.nhosts) || sim.tasks; ) {
+		for (; (i < (int)sim.nhosts) && (sim.tasks < SIM_TEARDOWN); i++)
+			if (sim.hosts[i]->node && !sim.hosts[i]->failed && !sim.hosts[i]->busy)
+				task_start(task_stop, sim.hosts[i], -1);
+		task_run();
+		if (sim.tasks && sim.nheap)
+			step(0, 0, 0);
+	}
+	loud();
+
+	double join_messages = samples_mean(&(sim.op_messages[OP_JOIN])), leave_messages = samples_mean(&(sim.op_messages[OP_LEAVE])), lookup_messages = samples_mean(&(sim.op_messages[OP_LOOKUP]));
+	double maintenance = (sim.maintenance / ((double)nodes * seconds));
+	double hops = samples_mean(&(sim.hop_counts));
+	int top = STATS_HOPS;
+	while ((top > 1) && !sim.hops[top - 1])
+		top--;
+	if (!strcmp(format, "json")) {
+		printf("{\"nodes\": %d, \"nodes_end\": %d, \"seed\": %llu, \"seconds\": %.3f, \"warmup\": %.3f, \"delay\": \"%s\", \"loss\": %.4f, \"churn\": %.3f, \"fail_share\": %.3f, \"stabilize_ms\": %d, \"routing\": \"%s\",\n", size, nodes, seed, seconds, warmup, delay, sim.loss, churn_rate, failures, sim.interval, ((sim.routing == ROUTE_ITERATIVE) ? "iterative" : "recursive"));
+		printf(" \"simulated_s\": %.3f, \"wall_s\": %.3f, \"events\": %llu,\n", simulated / 1e9, elapsed, events);
+		printf(" \"joins\": %lu, \"joins_failed\": %lu, \"leaves\": %lu, \"failures\": %lu,\n", sim.joins, sim.joins_failed, sim.leaves, sim.failures);
+		printf(" \"join_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"join_messages\": %.2f,\n", samples_percentile(&(sim.join_ms), 0.5), samples_percentile(&(sim.join_ms), 0.99), join_messages);
+		printf(" \"leave_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"leave_messages\": %.2f,\n", samples_percentile(&(sim.leave_ms), 0.5), samples_percentile(&(sim.leave_ms), 0.99), leave_messages);
+		printf(" \"lookups\": %lu, \"correct\": %lu, \"wrong\": %lu, \"unresolved\": %lu, \"lookup_messages\": %.2f,\n", sim.lookups, sim.correct, sim.wrong, sim.unresolved, lookup_messages);
+		printf(" \"lookup_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"hops_mean\": %.3f, \"hops\": [", samples_percentile(&(sim.lookup_ms), 0.5), samples_percentile(&(sim.lookup_ms), 0.99), hops);
+		for (k = 0; k < top; k++)
+			printf("%s%lu", (k ? ", " : ""), sim.hops[k]);
+		printf("],\n \"maintenance_per_node_s\": %.3f, \"sent\": %llu, \"lost\": %llu, \"dropped\": %llu, \"successors_right\": %.3f, \"fingers_right\": %.3f}\n", maintenance, sim.sent, sim.lost, sim.dropped, successors, fingers);
+	}
+	else {
+		printf("triadsim: %d nodes, seed %llu, %.1f s measured after %.1f s of warm-up, %s ms delay, %.2f%% loss\n", size, seed, seconds, warmup, delay, 100 * sim.loss);
+		printf("  simulated %.1f s in %.2f s: %llu events, %.0f events/s\n", simulated / 1e9, elapsed, events, events / elapsed);
+		printf("  churn:   %lu joins (%lu failed), %lu leaves, %lu failures; %d nodes at the end\n", sim.joins, sim.joins_failed, sim.leaves, sim.failures, nodes);
+		printf("  join:    p50 %8.2f ms  p99 %8.2f ms  %6.2f messages\n", samples_percentile(&(sim.join_ms), 0.5), samples_percentile(&(sim.join_ms), 0.99), join_messages);
+		printf("  leave:   p50 %8.2f ms  p99 %8.2f ms  %6.2f messages\n", samples_percentile(&(sim.leave_ms), 0.5), samples_percentile(&(sim.leave_ms), 0.99), leave_messages);
+		printf("  lookups: p50 %8.2f ms  p99 %8.2f ms  %6.2f messages  %lu: %lu right, %lu wrong, %lu unresolved (%.2f%% right)\n", samples_percentile(&(sim.lookup_ms), 0.5), samples_percentile(&(sim.lookup_ms), 0.99), lookup_messages, sim.lookups, sim.correct, sim.wrong, sim.unresolved, (sim.lookups ? ((100.0 * sim.correct) / sim.lookups) : 0));
+		printf("  hops:    mean %.2f  p50 %.0f  p99 %.0f\n", hops, samples_percentile(&(sim.hop_counts), 0.5), samples_percentile(&(sim.hop_counts), 0.99));
+		for (k = 0; k < top; k++)
+			printf("    %2d%s %8lu  %5.1f%%\n", k, (((k + 1) == STATS_HOPS) ? "+" : " "), sim.hops[k], ((sim.lookups - sim.unresolved) ? ((100.0 * sim.hops[k]) / (sim.lookups - sim.unresolved)) : 0));
+		printf("  maintenance: %.2f messages per node per second; %llu sent, %llu lost, %llu to hosts gone\n", maintenance, sim.sent, sim.lost, sim.dropped);
+		printf("  at the end: %.2f%% of successors and %.2f%% of fingers right\n", successors, fingers);
+	}
+	if (stats) {
+		stats_print(stats, stdout);
+		free(stats);
+	}
+	return 0;
+}
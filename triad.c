@@ -1,9 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "triad.h"
 
 /**
- * helper functions for converting between IP addresses and IDs
+ * helper functions for converting between IP addresses and integers
  */
 
 unsigned int strtoid(const char *str)
@@ -13,16 +24,69 @@ unsigned int strtoid(const char *str)
 	return (o1 << 24) + (o2 << 16) + (o3 << 8) + o4;
 }
 
-char *idtostr(int id)
+/* writes `id' as an IP address into `buf', of at least INET_ADDRSTRLEN
+ * bytes */
+char *idtostr(unsigned int id, char *buf)
 {
-	unsigned char o[4];
-	o[0] = id & 0xff;
-	o[1] = (id >> 8) & 0xff;
-	o[2] = (id >> 16) & 0xff;
-	o[3] = (id >> 24) & 0xff;
-	char *ret = malloc(sizeof(char) * ((3 * 4) + 4 + 1));  // 4 octets + 4 dots + 1 null char
-	sprintf(ret, "%u.%u.%u.%u\0", o[3], o[2], o[1], o[0]);
-	return ret;
+	sprintf(buf, "%u.%u.%u.%u", (id >> 24) & 0xff, (id >> 16) & 0xff, (id >> 8) & 0xff, id & 0xff);
+	return buf;
+}
+
+
+/**
+ * ids
+ */
+
+static unsigned long long rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Hashes `len' bytes onto the ring: 64-bit multiply-rotate rounds over
+ * 8-byte words, then the finalizer of MurmurHash3, cut down to KEYSPACE
+ * bits.  Used for node ids and application keys alike.
+ */
+chord_id_t triad_hash(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned long long h = 0x9e3779b97f4a7c15ull ^ (len * 0xff51afd7ed558ccdull), w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h ^= rotl64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+		h = (rotl64(h, 27) * 5) + 0x52dce729;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	h ^= rotl64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return (chord_id_t)h;
+}
+
+/* the id of node `index' among those serving at `ip':`port' (0 for the one
+ * triad_init starts); never 0, which stands for no node */
+chord_id_t triad_node_id(const char *ip, unsigned short port, int index)
+{
+	unsigned char endpoint[10];
+	unsigned int addr = inet_addr(ip);
+	unsigned short p = htons(port);
+	memcpy(endpoint, &addr, 4);
+	memcpy(endpoint + 4, &p, 2);
+	memcpy(endpoint + 6, &index, 4);
+	chord_id_t id = triad_hash(endpoint, sizeof(endpoint));
+	return (id ? id : 1);
+}
+
+/* the endpoint of node `index' among those serving at `ip':`port' */
+void triad_endpoint_at(endpoint_t *e, const char *ip, unsigned short port, int index)
+{
+	e->id = triad_node_id(ip, port, index);
+	e->addr = inet_addr(ip);
+	e->port = htons(port);
 }
 
 
@@ -30,14 +94,14 @@ char *idtostr(int id)
  * circular membership tests
  */
 
-int in_range_ex_ex_circular(unsigned int a, unsigned int b, unsigned int c)
+int in_range_ex_ex_circular(chord_id_t a, chord_id_t b, chord_id_t c)
 {
 	if (a < b)
 		return ((c > a) && (c < b));
 	return ((c > a) || (c < b));
 }
 
-int in_range_in_in_circular(unsigned int a, unsigned int b, unsigned int c)
+int in_range_in_in_circular(chord_id_t a, chord_id_t b, chord_id_t c)
 {
 	if ((c == a) || (c == b))
 		return 1;
@@ -46,7 +110,7 @@ int in_range_in_in_circular(unsigned int a, unsigned int b, unsigned int c)
 	return ((c >= a) || (c <= b));
 }
 
-int in_range_in_ex_circular(unsigned int a, unsigned int b, unsigned int c)
+int in_range_in_ex_circular(chord_id_t a, chord_id_t b, chord_id_t c)
 {
 	if (c == a)
 		return 1;
@@ -55,7 +119,7 @@ int in_range_in_ex_circular(unsigned int a, unsigned int b, unsigned int c)
 	return ((c >= a) || (c < b));
 }
 
-int in_range_ex_in_circular(unsigned int a, unsigned int b, unsigned int c)
+int in_range_ex_in_circular(chord_id_t a, chord_id_t b, chord_id_t c)
 {
 	if (c == b)
 		return 1;
@@ -69,607 +133,4683 @@ int in_range_ex_in_circular(unsigned int a, unsigned int b, unsigned int c)
  * Chord functions and helper functions
  */
 
-unsigned int closest_preceding_finger(node_t *n, unsigned int id)
+/**
+ * routing state
+ */
+
+static void route_begin(node_t *n)
 {
-	int i;
-	for (i = (KEYSPACE - 1); i >= 0; i--) {
-		unsigned int check = n->finger_table[i].successor;
-		if (in_range_ex_ex_circular(n->id, id, check))
-			return check;
-	}
-	return n->id;
+	pthread_mutex_lock(&(n->route_lock));
+	__atomic_store_n(&(n->route_seq), n->route_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-unsigned int find_predecessor(node_t *n, unsigned int id)
+static void route_end(node_t *n)
 {
-	if (in_range_in_ex_circular(n->id, n->successor, id))
-		return n->id;
-	unsigned int i = n->id;
-	while (!in_range_ex_in_circular(i, ((i == n->id) ? n->successor : rpc_get_successor(i)), id)) {
-		if (i == n->id)
-			i = closest_preceding_finger(n, id);
-		else
-			i = rpc_get_closest_preceding_finger(i, id);
-	}
-	return i;
+	__atomic_store_n(&(n->route_seq), n->route_seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(n->route_lock));
 }
 
-unsigned int find_successor(node_t *n, unsigned int id)
+static unsigned int route_read(node_t *n)
 {
-	// if this node is the successor
-	if (in_range_ex_in_circular(n->predecessor, n->id, id))
-		return n->id;
-	unsigned int p = find_predecessor(n, id);
-	return ((p == n->id) ? n->successor : rpc_get_successor(p));
+	unsigned int seq;
+	while ((seq = __atomic_load_n(&(n->route_seq), __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+static int route_retry(node_t *n, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&(n->route_seq), __ATOMIC_RELAXED) != seq);
 }
 
-void init_finger_table(node_t *n, unsigned int remote)
+void route_snapshot(node_t *n, route_t *r)
 {
 	int f;
+	do {
+		r->version = route_read(n);
+		r->predecessor = n->predecessor;
+		r->successor = n->successor;
+		r->nsuccessors = n->nsuccessors;
+		memcpy(r->successors, n->successors, sizeof(r->successors));
+		for (f = 0; f < KEYSPACE; f++)
+			r->fingers[f] = n->finger_table[f].successor;
+		memcpy(r->finger_offsets, n->finger_offsets, sizeof(r->finger_offsets));
+		memcpy(r->finger_nodes, n->finger_nodes, sizeof(r->finger_nodes));
+	} while (route_retry(n, r->version));
+}
+
+/* copies the successor list of `n' to `list' and returns its length */
+static int route_successors(node_t *n, chord_id_t *list)
+{
+	unsigned int seq;
+	int count;
+	do {
+		seq = route_read(n);
+		count = n->nsuccessors;
+		memcpy(list, n->successors, count * sizeof(chord_id_t));
+	} while (route_retry(n, seq));
+	return count;
+}
+
+/* rebuilds the search index of the finger table after it changed */
+void finger_index(node_t *n)
+{
+	chord_id_t offsets[KEYSPACE], nodes[KEYSPACE];
+	int f, i, count = 0;
 	for (f = 0; f < KEYSPACE; f++) {
-		n->finger_table[f].start = (n->id + (1 << f));
-		n->finger_table[f].end = (n->id + (1 << (f + 1)));
+		chord_id_t s = n->finger_table[f].successor, offset = s - n->id - 1;
+		if (s == n->id)
+			continue;
+		for (i = count; (i > 0) && (offsets[i - 1] > offset); i--);
+		if ((i > 0) && (offsets[i - 1] == offset))
+			continue;
+		memmove(offsets + i + 1, offsets + i, (count - i) * sizeof(chord_id_t));
+		memmove(nodes + i + 1, nodes + i, (count - i) * sizeof(chord_id_t));
+		offsets[i] = offset;
+		nodes[i] = s;
+		count++;
 	}
-	unsigned int successor = rpc_find_successor(remote, n->finger_table[0].start);
-	n->finger_table[0].successor = successor;
-	n->successor = successor;
-	n->predecessor = rpc_get_predecessor(successor);
-	rpc_set_predecessor(n->successor, n->id);
-	rpc_set_successor(n->predecessor, n->id);
-	for (f = 0; f < (KEYSPACE - 1); f++) {
-		if (in_range_in_ex_circular(n->id, n->finger_table[f].successor, n->finger_table[f + 1].start))
-			n->finger_table[f + 1].successor = n->finger_table[f].successor;
-		else
-			n->finger_table[f + 1].successor = rpc_find_successor(remote, n->finger_table[f + 1].start);
+	n->finger_nodes[0] = n->id;
+	for (i = 0; i < KEYSPACE; i++) {
+		n->finger_offsets[i] = ((i < count) ? offsets[i] : ~(chord_id_t)0);
+		n->finger_nodes[i + 1] = ((i < count) ? nodes[i] : n->id);
 	}
 }
 
-void deinit_finger_table(node_t *n)
+/*
+ * How many of the KEYSPACE sorted `offsets' are below `target'.  Since they
+ * are sorted, the lanes that compare below form a run of low bits in the
+ * mask, whose length is the count.  The kernels compare with signed
+ * instructions, so both sides are biased by 2^(KEYSPACE - 1) first.
+ */
+static int finger_count_scalar(const chord_id_t *offsets, chord_id_t target)
 {
-	unsigned int temp = n->successor;
-	rpc_set_predecessor(n->successor, n->predecessor);
-	rpc_set_successor(n->predecessor, temp);
+	int i, count = 0;
+	for (i = 0; i < KEYSPACE; i++)
+		count += (offsets[i] < target);
+	return count;
 }
 
-void update_finger_table_join(node_t *n, int f, unsigned int id)
+#if defined(__x86_64__) && (KEYSPACE == 32)
+#define FINGER_SSE "sse2"
+#define FINGER_SSE_WINS 0   /* measured slower than the scalar loop */
+
+static int finger_count_sse(const chord_id_t *offsets, chord_id_t target)
 {
-	if (in_range_ex_ex_circular(n->id, n->finger_table[f].successor, id)) {
-		n->finger_table[f].successor = id;
-		if (f == 0)
-			n->successor = id;
-		unsigned int p = n->predecessor;
-		if (p == n->id)
-			update_finger_table_join(n, f, id);
-		else
-			rpc_update_finger_table_join(p, f, id);
+	const __m128i bias = _mm_set1_epi32(0x80000000);
+	__m128i t = _mm_set1_epi32(target ^ 0x80000000);
+	unsigned long long mask = 0;
+	int i;
+	for (i = 0; i < KEYSPACE; i += 4) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(offsets + i)), bias);
+		mask |= (unsigned long long)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(t, x))) << i;
 	}
+	return __builtin_ctzll(~mask);
 }
 
-void update_finger_table_leave(node_t *n, int f, unsigned int id)
+__attribute__((target("avx2")))
+static int finger_count_avx2(const chord_id_t *offsets, chord_id_t target)
 {
-	if (n->finger_table[f].successor == id)
-		n->finger_table[f].successor = ((id == n->id) ? n->successor : rpc_get_successor(id));
-	unsigned int p = n->predecessor;
-	if (p != n->id)
-		rpc_update_finger_table_leave(p, f, id);
+	const __m256i bias = _mm256_set1_epi32(0x80000000);
+	__m256i t = _mm256_set1_epi32(target ^ 0x80000000);
+	unsigned long long mask = 0;
+	int i;
+	for (i = 0; i < KEYSPACE; i += 8) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(offsets + i)), bias);
+		mask |= (unsigned long long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(t, x))) << i;
+	}
+	return __builtin_ctzll(~mask);
 }
 
-void update_others_join(node_t *n)
+static int (*finger_count)(const chord_id_t *, chord_id_t) = finger_count_sse;
+#elif defined(__x86_64__) && (KEYSPACE == 64)
+#define FINGER_SSE "sse4.2"
+#define FINGER_SSE_WINS 1
+
+/*
+ * A ring of any realistic size fills only some log2(nodes) of the 64 lanes
+ * with distinct fingers, so these stop at the first vector where the run
+ * ends rather than comparing the ~0 padding too.
+ */
+__attribute__((target("sse4.2")))
+static int finger_count_sse(const chord_id_t *offsets, chord_id_t target)
 {
-	int f;
-	for (f = 0; f < KEYSPACE; f++) {
-		unsigned int temp = n->id - (1 << f);
-		unsigned int p = find_predecessor(n, (n->id - (1 << f)));
-		printf("finger %d (checking status of %10u / %15s)\n", f, temp, idtostr(temp)), fflush(stdout);
-		status_t status = ((temp == n->id) ? n->status : rpc_get_status(temp));
-		if (status == ST_CONNECTED)
-			p = temp;
-		rpc_update_finger_table_join(p, f, n->id);
+	const __m128i bias = _mm_set1_epi64x((long long)0x8000000000000000ull);
+	__m128i t = _mm_set1_epi64x((long long)(target ^ 0x8000000000000000ull));
+	int i, mask;
+	for (i = 0; i < KEYSPACE; i += 2) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(offsets + i)), bias);
+		if ((mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(t, x)))) != 0x3)
+			return i + __builtin_ctz(~mask);
 	}
+	return KEYSPACE;
 }
 
-void update_others_leave(node_t *n)
+__attribute__((target("avx2")))
+static int finger_count_avx2(const chord_id_t *offsets, chord_id_t target)
 {
-	int f;
-	for (f = 0; f < KEYSPACE; f++) {
-		unsigned int temp = n->id - (1 << f);
-		unsigned int p = find_predecessor(n, (n->id - (1 << f)));
-		printf("finger %d (checking status of %10u / %15s)\n", f, temp, idtostr(temp)), fflush(stdout);
-		status_t status = ((temp == n->id) ? n->status : rpc_get_status(temp));
-		if (status == ST_CONNECTED)
-			p = temp;
-		rpc_update_finger_table_leave(p, f, n->id);
+	const __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+	__m256i t = _mm256_set1_epi64x((long long)(target ^ 0x8000000000000000ull));
+	int i, mask;
+	for (i = 0; i < KEYSPACE; i += 4) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(offsets + i)), bias);
+		if ((mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(t, x)))) != 0xf)
+			return i + __builtin_ctz(~mask);
 	}
+	return KEYSPACE;
 }
 
-void print_node(node_t *n)
+static int (*finger_count)(const chord_id_t *, chord_id_t) = finger_count_scalar;
+#else
+static int (*finger_count)(const chord_id_t *, chord_id_t) = finger_count_scalar;
+#endif
+
+/* picks the finger_count kernel `kernel' ("avx2", "sse2" or for 64-bit ids
+ * "sse4.2", or "scalar"), or when NULL the fastest the CPU runs: "avx2",
+ * else "sse4.2" for 64-bit ids, else "scalar"; returns its name, or NULL
+ * (keeping the kernel as it is) if there is no such kernel or the CPU
+ * cannot run it */
+const char *finger_kernel(const char *kernel)
 {
-	int f;
-	printf("         id: %u (%s)\n", n->id, idtostr(n->id));
-	printf("predecessor: %u (%s)\n", n->predecessor, idtostr(n->predecessor));
-	printf("  successor: %u (%s)\n", n->successor, idtostr(n->successor));
-	for (f = 0; f < KEYSPACE; f++) {
-		printf("finger %2d range: [ %10u / %15s, %10u / %15s ) successor: %10u / %15s\n", f, n->finger_table[f].start, idtostr(n->finger_table[f].start), n->finger_table[f].end, idtostr(n->finger_table[f].end), n->finger_table[f].successor, idtostr(n->finger_table[f].successor));
+#if defined(FINGER_SSE)
+	if (!kernel)
+		kernel = (__builtin_cpu_supports("avx2") ? "avx2" : ((FINGER_SSE_WINS && __builtin_cpu_supports(FINGER_SSE)) ? FINGER_SSE : "scalar"));
+	if (!strcmp(kernel, "avx2")) {
+		if (!__builtin_cpu_supports("avx2"))
+			return NULL;
+		finger_count = finger_count_avx2;
+		return "avx2";
+	}
+	if (!strcmp(kernel, FINGER_SSE)) {
+		if (!__builtin_cpu_supports(FINGER_SSE))
+			return NULL;
+		finger_count = finger_count_sse;
+		return FINGER_SSE;
 	}
+#endif
+	if (kernel && strcmp(kernel, "scalar"))
+		return NULL;
+	finger_count = finger_count_scalar;
+	return "scalar";
 }
 
+/*
+ * The finger closest before `id': with offsets taken from this node, the
+ * largest one below that of `id' (or any, if `id' is this node, since the
+ * interval then spans the whole ring).
+ */
+chord_id_t closest_preceding_finger(node_t *n, chord_id_t id)
+{
+	chord_id_t next;
+	unsigned int seq;
+	do {
+		seq = route_read(n);
+		next = n->finger_nodes[finger_count(n->finger_offsets, id - n->id - 1)];
+	} while (route_retry(n, seq));
+	return next;
+}
 
-/**
- * RPC wrapper functions
+/*
+ * Looks `id' up in one consistent reading of the routing state of `n', and
+ * returns its owner if that settles it (this node or its successor), or 0
+ * otherwise.  The predecessor, the successor and the closest preceding
+ * finger it went by are stored in the last three arguments.
  */
+static chord_id_t route_local(node_t *n, chord_id_t id, chord_id_t *predecessor, chord_id_t *successor, chord_id_t *next)
+{
+	chord_id_t owner;
+	unsigned int seq;
+	do {
+		seq = route_read(n);
+		*predecessor = n->predecessor;
+		*successor = n->successor;
+		*next = n->finger_nodes[finger_count(n->finger_offsets, id - n->id - 1)];
+		if (*predecessor && in_range_ex_in_circular(*predecessor, n->id, id))
+			owner = n->id;
+		else if (in_range_ex_in_circular(n->id, *successor, id) || (*next == n->id))
+			owner = *successor;
+		else
+			owner = 0;
+	} while (route_retry(n, seq));
+	return owner;
+}
 
-unsigned int rpc_get_status(unsigned int id)
+/*
+ * Walks from this node towards `id', one hop per round trip: each hop
+ * reports its successor and its closest preceding finger at once.  Stores
+ * the predecessor of `id' in `predecessor' and the number of remote hops in
+ * `hops', and returns the successor of `id', or 0 if a hop did not answer.
+ */
+static chord_id_t walk(node_t *n, chord_id_t id, chord_id_t *predecessor, unsigned int *hops)
 {
-	unsigned int ret;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_GET_STATUS;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_GET_STATUS:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), 1);
-	if (ack.type == MSG_GET_STATUS_ACK) {
-		printf("received (MSG_GET_STATUS_ACK)\n"), fflush(stdout);
-		printf("STATUS = %d\n", ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
+	chord_id_t i = n->id, p, successor, next;
+	route_local(n, id, &p, &successor, &next);
+	*hops = 0;
+	while (!in_range_ex_in_circular(i, successor, id)) {
+		i = next;
+		if (i == n->id)
+			route_local(n, id, &p, &successor, &next);
+		else if (!rpc_find_next_hop(n, i, id, &successor, &next)) {
+			successor = 0;
+			break;
+		}
+		else
+			(*hops)++;
 	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	*predecessor = i;
+	return successor;
 }
 
-int rpc_set_status(unsigned int id, status_t status)
+chord_id_t find_predecessor(node_t *n, chord_id_t id)
 {
-	unsigned int ret = 0;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_SET_STATUS;
-	m.data[0] = status;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_SET_STATUS:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_SET_STATUS_ACK) {
-		printf("received (MSG_SET_STATUS_ACK)\n"), fflush(stdout);
-		ret = 1;
-	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	chord_id_t p;
+	unsigned int hops;
+	if (in_range_in_ex_circular(n->id, n->successor, id))
+		return n->id;
+	walk(n, id, &p, &hops);
+	return p;
 }
 
-unsigned int rpc_get_successor(unsigned int id)
+chord_id_t find_successor(node_t *n, chord_id_t id)
 {
-	unsigned int ret;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_GET_SUCCESSOR;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_GET_SUCCESSOR:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_GET_SUCCESSOR_ACK) {
-		printf("received (MSG_GET_SUCCESSOR_ACK)\n"), fflush(stdout);
-		printf("SUCCESSOR = %u\n", ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
-	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	return route_successor(n, id, NULL);
 }
 
-int rpc_set_successor(unsigned int id, unsigned int successor)
+static long long rpc_now(void);
+static void stats_lookup(long long, unsigned int);
+
+/*
+ * Finds the successor of `id' the way `n->routing' says to, and stores the
+ * number of remote hops it took in `hops' unless it is NULL.
+ */
+chord_id_t route_successor(node_t *n, chord_id_t id, unsigned int *hops)
 {
-	unsigned int ret = 0;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_SET_SUCCESSOR;
-	m.data[0] = successor;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_SET_SUCCESSOR:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_SET_SUCCESSOR_ACK) {
-		printf("received (MSG_SET_SUCCESSOR_ACK)\n"), fflush(stdout);
-		ret = 1;
+	chord_id_t p, successor, next, ret;
+	unsigned int count = 0;
+	long long start = rpc_now();
+	// if this node or its successor is the owner
+	if ((ret = route_local(n, id, &p, &successor, &next)))
+		;
+	else if (location_get(n, id, &ret))
+		;
+	else if (n->routing == ROUTE_ITERATIVE) {
+		ret = walk(n, id, &p, &count);
+		if (ret)
+			location_put(n, p, ret);
 	}
-	inet_close(&local);
-	free(ip);
+	else if ((ret = rpc_find_successor_recursive(n, next, id, &p, &count)))
+		location_put(n, p, ret);
+	if (ret)
+		stats_lookup(rpc_now() - start, count);
+	if (hops)
+		*hops = count;
 	return ret;
 }
 
-unsigned int rpc_get_predecessor(unsigned int id)
+void deinit_finger_table(node_t *n)
 {
-	unsigned int ret;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_GET_PREDECESSOR;
-	printf("sent (MSG_GET_PREDECESSOR:%s)\n", ip), fflush(stdout);
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_GET_PREDECESSOR_ACK) {
-		printf("received (MSG_GET_PREDECESSOR_ACK)\n"), fflush(stdout);
-		printf("PREDECESSOR = %u\n", ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
-	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	if (n->successor != n->id)
+		rpc_set_predecessor(n, n->successor, n->predecessor);
+	if (n->predecessor && (n->predecessor != n->id))
+		rpc_set_successor(n, n->predecessor, n->successor);
 }
 
-int rpc_set_predecessor(unsigned int id, unsigned int predecessor)
+/**
+ * location cache
+ */
+
+/* index of the cached range that could hold `id', or -1 */
+static int location_find(node_t *n, chord_id_t id)
 {
-	unsigned int ret = 0;
-	char *ip = idtostr(id);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_SET_PREDECESSOR;
-	m.data[0] = predecessor;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_SET_PREDECESSOR:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_SET_PREDECESSOR_ACK) {
-		printf("received (MSG_SET_PREDECESSOR_ACK)\n"), fflush(stdout);
-		ret = 1;
+	int lo = 0, hi = n->nlocations;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (n->locations[mid].owner < id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	if (lo == n->nlocations)
+		lo = 0;
+	if (n->nlocations && in_range_ex_in_circular(n->locations[lo].predecessor, n->locations[lo].owner, id))
+		return lo;
+	return -1;
 }
 
-unsigned int rpc_get_closest_preceding_finger(unsigned int node, unsigned int id)
+static void location_remove(node_t *n, int l)
 {
-	unsigned int ret;
-	char *ip = idtostr(node);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_GET_CLOSEST_PRECEDING_FINGER;
-	m.data[0] = id;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_GET_CLOSEST_PRECEDING_FINGER:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_GET_CLOSEST_PRECEDING_FINGER_ACK) {
-		printf("received (MSG_GET_CLOSEST_PRECEDING_FINGER_ACK)\n"), fflush(stdout);
-		printf("CLOSEST_PRECEDING_FINGER = %u\n", ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
-	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	n->nlocations--;
+	memmove(&(n->locations[l]), &(n->locations[l + 1]), (n->nlocations - l) * sizeof(location_t));
 }
 
-unsigned int rpc_find_predecessor(unsigned int node, unsigned int id)
+/*
+ * Looks up the owner of `id' in the location cache.  With
+ * `n->location_verify' set, a cached owner is only used once it confirms its
+ * range with one RPC.  Returns 1 on a hit.
+ */
+int location_get(node_t *n, chord_id_t id, chord_id_t *owner)
 {
-	unsigned int ret;
-	char *ip = idtostr(node);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_FIND_PREDECESSOR;
-	m.data[0] = id;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_FIND_PREDECESSOR:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_FIND_PREDECESSOR_ACK) {
-		printf("received (MSG_FIND_PREDECESSOR_ACK)\n"), fflush(stdout);
-		printf("PREDECESSOR(%u) = %u\n", id, ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
+	pthread_mutex_lock(&(n->location_lock));
+	int l = location_find(n, id);
+	if (l >= 0) {
+		*owner = n->locations[l].owner;
+		n->locations[l].used = ++(n->location_clock);
 	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	pthread_mutex_unlock(&(n->location_lock));
+
+	if ((l >= 0) && n->location_verify) {
+		/* an owner that does not answer (0) has not confirmed anything */
+		chord_id_t p = rpc_get_predecessor(n, *owner);
+		if (!p || !in_range_ex_in_circular(p, *owner, id)) {
+			location_invalidate(n, *owner);
+			l = -1;
+		}
+		else
+			location_put(n, p, *owner);
+	}
+
+	pthread_mutex_lock(&(n->location_lock));
+	if (l >= 0)
+		n->location_hits++;
+	else
+		n->location_misses++;
+	pthread_mutex_unlock(&(n->location_lock));
+	return (l >= 0);
 }
 
-unsigned int rpc_find_successor(unsigned int node, unsigned int id)
+/* remembers that ids in (`predecessor', `owner'] are located on `owner' */
+void location_put(node_t *n, chord_id_t predecessor, chord_id_t owner)
 {
-	unsigned int ret;
-	char *ip = idtostr(node);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_FIND_SUCCESSOR;
-	m.data[0] = id;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_FIND_SUCCESSOR:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_FIND_SUCCESSOR_ACK) {
-		printf("received (MSG_FIND_SUCCESSOR_ACK)\n"), fflush(stdout);
-		printf("SUCCESSOR(%u) = %u\n", id, ack.data[0]), fflush(stdout);
-		ret = ack.data[0];
+	int l, oldest = 0;
+	pthread_mutex_lock(&(n->location_lock));
+	/* drop ranges this one contradicts */
+	for (l = 0; l < n->nlocations; ) {
+		location_t *e = &(n->locations[l]);
+		if (in_range_ex_in_circular(predecessor, owner, e->owner) || in_range_ex_in_circular(e->predecessor, e->owner, owner))
+			location_remove(n, l);
+		else
+			l++;
 	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	if (n->nlocations == LOCATION_CACHE) {
+		for (l = 1; l < n->nlocations; l++)
+			if (n->locations[l].used < n->locations[oldest].used)
+				oldest = l;
+		location_remove(n, oldest);
+	}
+	for (l = 0; (l < n->nlocations) && (n->locations[l].owner < owner); l++);
+	memmove(&(n->locations[l + 1]), &(n->locations[l]), (n->nlocations - l) * sizeof(location_t));
+	n->locations[l].predecessor = predecessor;
+	n->locations[l].owner = owner;
+	n->locations[l].used = ++(n->location_clock);
+	n->nlocations++;
+	pthread_mutex_unlock(&(n->location_lock));
 }
 
-int rpc_update_finger_table_join(unsigned int p, unsigned int f, unsigned int id)
+/* forgets every cached range that a change of ring membership at `id' affects */
+void location_invalidate(node_t *n, chord_id_t id)
 {
-	unsigned int ret = 0;
-	char *ip = idtostr(p);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_UPDATE_FINGER_TABLE_JOIN;
-	m.data[0] = f;
-	m.data[1] = id;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_UPDATE_FINGER_TABLE_JOIN:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_UPDATE_FINGER_TABLE_JOIN_ACK) {
-		printf("received (MSG_UPDATE_FINGER_TABLE_JOIN_ACK)\n"), fflush(stdout);
-		ret = 1;
+	int l;
+	pthread_mutex_lock(&(n->location_lock));
+	for (l = 0; l < n->nlocations; ) {
+		if (in_range_in_in_circular(n->locations[l].predecessor, n->locations[l].owner, id))
+			location_remove(n, l);
+		else
+			l++;
 	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	pthread_mutex_unlock(&(n->location_lock));
 }
 
-int rpc_update_finger_table_leave(unsigned int p, unsigned int f, unsigned int id)
+void location_clear(node_t *n)
 {
-	unsigned int ret = 0;
-	char *ip = idtostr(p);
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_UPDATE_FINGER_TABLE_LEAVE;
-	m.data[0] = f;
-	m.data[1] = id;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	printf("sent (MSG_UPDATE_FINGER_TABLE_LEAVE:%s)\n", ip), fflush(stdout);
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_UPDATE_FINGER_TABLE_LEAVE_ACK) {
-		printf("received (MSG_UPDATE_FINGER_TABLE_LEAVE_ACK)\n"), fflush(stdout);
-		ret = 1;
-	}
-	inet_close(&local);
-	free(ip);
-	return ret;
+	pthread_mutex_lock(&(n->location_lock));
+	n->nlocations = 0;
+	pthread_mutex_unlock(&(n->location_lock));
 }
 
-void *rpc_handler(void *data)
+/* "address:port" of node `id' as far as `n' knows, in `buf' */
+static char *print_endpoint(node_t *n, chord_id_t id, char *buf)
 {
-	node_t *n = (node_t *)data;
-	inet_host_t local, remote;
-	while (1) {
-		inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, RPC_PORT);
-		//printf("waiting for node to connect...\n"), fflush(stdout);
-		msg_t m;
-		if (inet_receive(&remote, &local, &m, sizeof(msg_t), -1) == sizeof(msg_t)) {
-			//printf("received message (%d)\n", m.type), fflush(stdout);
-			msg_t ack;
-			switch (m.type) {
-				case MSG_QUIT:
-					printf("received (MSG_QUIT)\n"), fflush(stdout);
-					{
-						ack.type = MSG_QUIT_ACK;
-						printf("quitting...\n"), fflush(stdout);
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						inet_close(&local);
-						pthread_exit(0);
-					}
-				case MSG_GET_STATUS:
-					printf("received (MSG_GET_STATUS)\n"), fflush(stdout);
-					{
-						ack.type = MSG_GET_STATUS_ACK;
-						ack.data[0] = n->status;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_SET_STATUS:
-					printf("received (MSG_SET_STATUS)\n"), fflush(stdout);
-					{
-						n->status = m.data[0];
-						ack.type = MSG_SET_STATUS_ACK;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_GET_SUCCESSOR:
-					printf("received (MSG_GET_SUCCESSOR)\n"), fflush(stdout);
-					{
-						ack.type = MSG_GET_SUCCESSOR_ACK;
-						ack.data[0] = n->successor;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_SET_SUCCESSOR:
-					printf("received (MSG_SET_SUCCESSOR)\n"), fflush(stdout);
-					{
-						n->successor = m.data[0];
-						ack.type = MSG_SET_SUCCESSOR_ACK;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_GET_PREDECESSOR:
-					printf("received (MSG_GET_PREDECESSOR)\n"), fflush(stdout);
-					{
-						ack.type = MSG_GET_PREDECESSOR_ACK;
-						ack.data[0] = n->predecessor;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_SET_PREDECESSOR:
-					printf("received (MSG_SET_PREDECESSOR)\n"), fflush(stdout);
-					{
-						n->predecessor = m.data[0];
-						ack.type = MSG_SET_PREDECESSOR_ACK;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_GET_CLOSEST_PRECEDING_FINGER:
-					printf("received (MSG_GET_CLOSEST_PRECEDING_FINGER)\n"), fflush(stdout);
-					{
-						ack.type = MSG_GET_CLOSEST_PRECEDING_FINGER_ACK;
-						ack.data[0] = closest_preceding_finger(n, m.data[0]);
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_FIND_SUCCESSOR:
-					printf("received (MSG_FIND_SUCCESSOR)\n"), fflush(stdout);
-					{
-						ack.type = MSG_FIND_SUCCESSOR_ACK;
-						ack.data[0] = find_successor(n, m.data[0]);
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_FIND_PREDECESSOR:
-					printf("received (MSG_FIND_PREDECESSOR)\n"), fflush(stdout);
-					{
-						ack.type = MSG_FIND_PREDECESSOR_ACK;
-						ack.data[0] = find_predecessor(n, m.data[0]);
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_UPDATE_FINGER_TABLE_JOIN:
-					printf("received (MSG_UPDATE_FINGER_TABLE_JOIN)\n"), fflush(stdout);
-					{
-						update_finger_table_join(n, m.data[0], m.data[1]);
-						ack.type = MSG_UPDATE_FINGER_TABLE_JOIN_ACK;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-				case MSG_UPDATE_FINGER_TABLE_LEAVE:
-					printf("received (MSG_UPDATE_FINGER_TABLE_LEAVE)\n"), fflush(stdout);
-					{
-						update_finger_table_leave(n, m.data[0], m.data[1]);
-						ack.type = MSG_UPDATE_FINGER_TABLE_LEAVE_ACK;
-						inet_send(&local, &remote, &ack, sizeof(msg_t));
-						break;
-					}
-			}
-		}
-		inet_close(&local);
+	endpoint_t e;
+	if (!triad_endpoint(n, id, &e))
+		return strcpy(buf, "?");
+	inet_ntop(AF_INET, &(e.addr), buf, INET_ADDRSTRLEN);
+	sprintf(buf + strlen(buf), ":%u", ntohs(e.port));
+	return buf;
+}
+
+void print_node(node_t *n)
+{
+	char buf[32];
+	int f;
+	printf("         id: %" PRIid " (%s)\n", n->id, print_endpoint(n, n->id, buf));
+	printf("predecessor: %" PRIid " (%s)\n", n->predecessor, print_endpoint(n, n->predecessor, buf));
+	printf("  successor: %" PRIid " (%s)\n", n->successor, print_endpoint(n, n->successor, buf));
+	for (f = 1; f < n->nsuccessors; f++)
+		printf("       then: %" PRIid " (%s)\n", n->successors[f], print_endpoint(n, n->successors[f], buf));
+	for (f = 0; f < KEYSPACE; f++) {
+		printf("finger %2d range: [ %20" PRIid ", %20" PRIid " ) successor: %20" PRIid " / %21s\n", f, n->finger_table[f].start, n->finger_table[f].end, n->finger_table[f].successor, print_endpoint(n, n->finger_table[f].successor, buf));
 	}
+	printf("   location cache: %d ranges, %lu hits, %lu misses%s\n", n->nlocations, n->location_hits, n->location_misses, (n->location_verify ? " (verified)" : ""));
+	printf("              rpc: %lu retransmissions\n", n->transport->retransmits);
 }
 
+
+
 /**
- * triad functions
+ * tracing
+ *
+ * Each thread traces into a ring of its own, allocated the first time it
+ * traces and kept (with its records) after the thread is gone, so tracing
+ * takes no locks once a thread has its ring.
  */
 
-node_t *triad_init(const char *ip)
+volatile int trace_level = TRACE_OFF;
+static __thread trace_ring_t *trace_mine;
+static trace_ring_t *trace_rings;
+static int trace_threads;
+static long long trace_since;  // records before are cleared
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *msg_names[] = {
+	[MSG_QUIT] = "MSG_QUIT", [MSG_QUIT_ACK] = "MSG_QUIT_ACK",
+	[MSG_GET_STATUS] = "MSG_GET_STATUS", [MSG_GET_STATUS_ACK] = "MSG_GET_STATUS_ACK",
+	[MSG_SET_STATUS] = "MSG_SET_STATUS", [MSG_SET_STATUS_ACK] = "MSG_SET_STATUS_ACK",
+	[MSG_GET_SUCCESSOR] = "MSG_GET_SUCCESSOR", [MSG_GET_SUCCESSOR_ACK] = "MSG_GET_SUCCESSOR_ACK",
+	[MSG_SET_SUCCESSOR] = "MSG_SET_SUCCESSOR", [MSG_SET_SUCCESSOR_ACK] = "MSG_SET_SUCCESSOR_ACK",
+	[MSG_GET_PREDECESSOR] = "MSG_GET_PREDECESSOR", [MSG_GET_PREDECESSOR_ACK] = "MSG_GET_PREDECESSOR_ACK",
+	[MSG_SET_PREDECESSOR] = "MSG_SET_PREDECESSOR", [MSG_SET_PREDECESSOR_ACK] = "MSG_SET_PREDECESSOR_ACK",
+	[MSG_GET_CLOSEST_PRECEDING_FINGER] = "MSG_GET_CLOSEST_PRECEDING_FINGER", [MSG_GET_CLOSEST_PRECEDING_FINGER_ACK] = "MSG_GET_CLOSEST_PRECEDING_FINGER_ACK",
+	[MSG_FIND_SUCCESSOR] = "MSG_FIND_SUCCESSOR", [MSG_FIND_SUCCESSOR_ACK] = "MSG_FIND_SUCCESSOR_ACK",
+	[MSG_FIND_PREDECESSOR] = "MSG_FIND_PREDECESSOR", [MSG_FIND_PREDECESSOR_ACK] = "MSG_FIND_PREDECESSOR_ACK",
+	[MSG_NOTIFY] = "MSG_NOTIFY", [MSG_NOTIFY_ACK] = "MSG_NOTIFY_ACK",
+	[MSG_FIND_SUCCESSOR_BATCH] = "MSG_FIND_SUCCESSOR_BATCH", [MSG_FIND_SUCCESSOR_BATCH_ACK] = "MSG_FIND_SUCCESSOR_BATCH_ACK",
+	[MSG_FIND_NEXT_HOP] = "MSG_FIND_NEXT_HOP", [MSG_FIND_NEXT_HOP_ACK] = "MSG_FIND_NEXT_HOP_ACK",
+	[MSG_FIND_SUCCESSOR_RECURSIVE] = "MSG_FIND_SUCCESSOR_RECURSIVE", [MSG_FIND_SUCCESSOR_RECURSIVE_ACK] = "MSG_FIND_SUCCESSOR_RECURSIVE_ACK",
+	[MSG_PUT] = "MSG_PUT", [MSG_PUT_ACK] = "MSG_PUT_ACK",
+	[MSG_GET] = "MSG_GET", [MSG_GET_ACK] = "MSG_GET_ACK",
+	[MSG_DEL] = "MSG_DEL", [MSG_DEL_ACK] = "MSG_DEL_ACK",
+	[MSG_PUT_REPLICA] = "MSG_PUT_REPLICA", [MSG_PUT_REPLICA_ACK] = "MSG_PUT_REPLICA_ACK",
+	[MSG_GET_REPLICA] = "MSG_GET_REPLICA", [MSG_GET_REPLICA_ACK] = "MSG_GET_REPLICA_ACK",
+	[MSG_DEL_REPLICA] = "MSG_DEL_REPLICA", [MSG_DEL_REPLICA_ACK] = "MSG_DEL_REPLICA_ACK",
+	[MSG_GET_STATS] = "MSG_GET_STATS", [MSG_GET_STATS_ACK] = "MSG_GET_STATS_ACK",
+};
+
+static const char *trace_events[] = {
+	[TRACE_CALL] = "call", [TRACE_RETRANSMIT] = "retransmit", [TRACE_TIMEOUT] = "timeout",
+	[TRACE_ACK] = "ack", [TRACE_SERVE] = "serve", [TRACE_ANSWER] = "answer",
+	[TRACE_FORWARD] = "forward", [TRACE_JOIN] = "join", [TRACE_LEAVE] = "leave",
+};
+
+/* "MSG_..." for `type', or "-" */
+const char *msg_name(msg_type_t type)
 {
-	/* set up node */
-	node_t *n = malloc(sizeof(node_t));
-	n->id = strtoid(ip);
-	n->successor = n->id;
-	n->predecessor = n->id;
-	int f;
-	for (f = 0; f < KEYSPACE; f++) {
-		n->finger_table[f].start = (n->id + (1 << f));
-		n->finger_table[f].end = (n->id + (1 << (f + 1)));
-		n->finger_table[f].successor = n->id;
-	}
-	n->status = ST_DISCONNECTED;
+	if ((type > 0) && (type < (int)(sizeof(msg_names) / sizeof(msg_names[0]))) && msg_names[type])
+		return msg_names[type];
+	return "-";
+}
 
-	/* start RPC thread */
-	pthread_create(&(n->rpc_thread), NULL, rpc_handler, n);
+/* what transports opened from now on run on, whose clock is that of the
+ * process (see triad_transport) */
+static const transport_ops_t *transport_ops = &transport_udp;
 
-	return n;
+static long long trace_now(void)
+{
+	return transport_ops->now();
 }
 
-int triad_deinit(node_t *n)
+/* records `event' of `node' with `peer' (reached at `host') about `m'; the
+ * last two may be NULL.  Called through TRACE. */
+void trace_record(trace_event_t event, chord_id_t node, chord_id_t peer, const inet_host_t *host, const msg_t *m)
 {
-	/* RPC */
-	inet_host_t local, remote;
-	inet_open(&local, IN_PROT_UDP, IN_ADDR_ANY, COM_PORT);
-	char *ip = idtostr(n->id);
-	inet_setup(&remote, IN_PROT_UDP, ip, RPC_PORT);
-	msg_t m;
-	m.type = MSG_QUIT;
-	inet_send(&local, &remote, &m, sizeof(msg_t));
-	msg_t ack;
-	inet_receive(&remote, &local, &ack, sizeof(msg_t), -1);
-	if (ack.type == MSG_QUIT_ACK)
-		printf("received (MSG_QUIT_ACK)\n"), fflush(stdout);
-	inet_close(&local);
+	trace_ring_t *ring = trace_mine;
+	if (!ring) {
+		if (!(ring = calloc(1, sizeof(trace_ring_t))))
+			return;
+		pthread_mutex_lock(&trace_lock);
+		ring->thread = ++trace_threads;
+		ring->next = trace_rings;
+		trace_rings = ring;
+		pthread_mutex_unlock(&trace_lock);
+		trace_mine = ring;
+	}
+	/* the record overwritten is published as gone (head moved past it
+	 * TRACE_RECORDS ago) before any of it changes */
+	unsigned long head = ring->head;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	trace_record_t *r = &(ring->records[head & (TRACE_RECORDS - 1)]);
+	r->time = trace_now();
+	r->node = node;
+	r->peer = peer;
+	r->addr = (host ? host->addr.sin_addr.s_addr : 0);
+	r->port = (host ? host->addr.sin_port : 0);
+	r->event = event;
+	r->type = (m ? m->type : 0);
+	r->rid = (m ? m->rid : 0);
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
 
-	printf("waiting for child thread...\n"), fflush(stdout);
-	pthread_join(n->rpc_thread, NULL);
+/* forgets every record so far */
+void trace_clear(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	trace_since = trace_now();
+	pthread_mutex_unlock(&trace_lock);
+}
 
-	return 1;
+typedef struct trace_line {
+	trace_record_t r;
+	int thread;
+} trace_line_t;
+
+static int trace_compare(const void *a, const void *b)
+{
+	long long x = ((const trace_line_t *)a)->r.time, y = ((const trace_line_t *)b)->r.time;
+	return ((x > y) - (x < y));
 }
 
-int triad_join(node_t *n, const char *ip)
+/*
+ * Prints the records of all threads to `out' in the order they were taken,
+ * one per line: seconds since the first, thread, node, event, message type,
+ * the other end, and the request id.  Threads may go on tracing meanwhile.
+ * Returns the number of records printed.
+ */
+int trace_dump(FILE *out)
 {
-	printf("attempting to join ring at %s...\n", ip);
-	unsigned int id = strtoid(ip);
-	if (rpc_get_status(id) == ST_CONNECTED) {
-		init_finger_table(n, id);
-		update_others_join(n);
-		rpc_set_status(n->id, ST_CONNECTED);
-		printf("joined an existing ring!\n");
+	trace_ring_t *ring;
+	trace_line_t *lines;
+	int count = 0, i, j;
+	pthread_mutex_lock(&trace_lock);
+	long long since = trace_since;
+	for (ring = trace_rings; ring; ring = ring->next)
+		count += TRACE_RECORDS;
+	if (!(lines = malloc((count ? count : 1) * sizeof(trace_line_t)))) {
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
 	}
-	else {
-		int f;
-		for (f = 0; f < KEYSPACE; f++) {
-			n->finger_table[f].start = (n->id + (1 << f));
-			n->finger_table[f].end = (n->id + (1 << (f + 1)));
-			n->finger_table[f].successor = n->id;
+	count = 0;
+	for (ring = trace_rings; ring; ring = ring->next) {
+		unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE), h;
+		unsigned long start = ((head > TRACE_RECORDS) ? (head - TRACE_RECORDS) : 0);
+		for (h = start; h < head; h++) {
+			lines[count].r = ring->records[h & (TRACE_RECORDS - 1)];
+			lines[count++].thread = ring->thread;
+		}
+		/* the thread may have overwritten the oldest of them meanwhile:
+		 * record h is intact as long as head stayed below h + TRACE_RECORDS */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		unsigned long after = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED) + 1;
+		unsigned long stale = ((after > start + TRACE_RECORDS) ? (after - start - TRACE_RECORDS) : 0);
+		if (stale > head - start)
+			stale = head - start;
+		memmove(&(lines[count - (head - start)]), &(lines[count - (head - start) + stale]), (head - start - stale) * sizeof(trace_line_t));
+		count -= stale;
+	}
+	pthread_mutex_unlock(&trace_lock);
+	for (i = j = 0; i < count; i++)
+		if (lines[i].r.time >= since)
+			lines[j++] = lines[i];
+	count = j;
+
+	qsort(lines, count, sizeof(trace_line_t), trace_compare);
+	for (i = 0; i < count; i++) {
+		trace_record_t *r = &(lines[i].r);
+		char peer[24] = "-", where[24] = "-";
+		if (r->peer)
+			sprintf(peer, "%" PRIid, r->peer);
+		if (r->port) {
+			inet_ntop(AF_INET, &(r->addr), where, INET_ADDRSTRLEN);
+			sprintf(where + strlen(where), ":%u", ntohs(r->port));
 		}
-		n->predecessor = n->id;
-		n->successor = n->id;
-		rpc_set_status(n->id, ST_CONNECTED);
-		printf("started a new ring!\n");
+		fprintf(out, "%12.6f  thread %-3d %20" PRIid "  %-10s %-36s %20s %-21s rid %u\n", (r->time - lines[0].r.time) / 1e9, lines[i].thread, r->node, trace_events[r->event], msg_name(r->type), peer, where, r->rid);
 	}
+	free(lines);
+	return count;
 }
 
-int triad_leave(node_t *n)
-{
-	deinit_finger_table(n);
-	update_others_leave(n);
-	int f;
+
+/**
+ * wire format
+ *
+ * A datagram carries one or more frames, each a message of its own.  A frame
+ * starts with an 8-byte header: the version of the format (high 4 bits) and
+ * flags (low 4 bits, none defined yet), the message type, the length of the
+ * rest of the frame, and the request id, the last two in network byte order.
+ * The rest are fields, each a tag byte, a length and a value; a field that
+ * is left out is 0, and one with a tag the receiver does not know is
+ * skipped.  Ids and lengths are varints: 7 bits per byte, lowest first, with
+ * the top bit set on every byte but the last.  Addresses and ports are in
+ * network byte order.
+ */
+
+#define WIRE_HEADER 8
+
+enum {
+	WIRE_TO = 1,     // the node addressed (requests only)
+	WIRE_DATA0,      // data[0] and data[1]
+	WIRE_DATA1,
+	WIRE_ADDR0,      // addr[0] and port[0], 6 bytes
+	WIRE_ADDR1,
+	WIRE_IDS,        // `count' varints, for messages with ids in batch[]
+	WIRE_ENDPOINTS,  // `count' endpoint_t, each a varint id, address and port
+	WIRE_PAYLOAD,    // `count' bytes of payload
+};
+
+/* bytes each of the `count' items in the variable part of a message of type
+ * `type' takes, or 0 if it has none */
+static int msg_unit(msg_type_t type)
+{
+	switch (type) {
+		case MSG_FIND_SUCCESSOR_BATCH:
+		case MSG_FIND_SUCCESSOR_BATCH_ACK:
+		case MSG_FIND_SUCCESSOR_RECURSIVE:
+		case MSG_FIND_SUCCESSOR_RECURSIVE_ACK:
+			return sizeof(chord_id_t);
+		case MSG_GET_PREDECESSOR_ACK:
+			return sizeof(endpoint_t);
+		case MSG_PUT:
+		case MSG_GET:
+		case MSG_GET_ACK:
+		case MSG_DEL:
+		case MSG_PUT_REPLICA:
+		case MSG_GET_REPLICA:
+		case MSG_GET_REPLICA_ACK:
+		case MSG_DEL_REPLICA:
+		case MSG_GET_STATS_ACK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* which of data[0] (bit 0) and data[1] (bit 1) messages of type `type'
+ * carry; the others are not sent, and arrive as 0 */
+static int msg_words(msg_type_t type)
+{
+	switch (type) {
+		case MSG_QUIT:
+		case MSG_GET_STATUS:
+		case MSG_SET_STATUS_ACK:
+		case MSG_GET_SUCCESSOR:
+		case MSG_SET_SUCCESSOR_ACK:
+		case MSG_GET_PREDECESSOR:
+		case MSG_SET_PREDECESSOR_ACK:
+		case MSG_NOTIFY_ACK:
+		case MSG_FIND_SUCCESSOR_BATCH:
+		case MSG_FIND_SUCCESSOR_BATCH_ACK:
+			return 0;
+		case MSG_GET_PREDECESSOR_ACK:
+		case MSG_FIND_NEXT_HOP_ACK:
+		case MSG_FIND_SUCCESSOR_RECURSIVE:
+		case MSG_FIND_SUCCESSOR_RECURSIVE_ACK:
+		case MSG_PUT:
+		case MSG_PUT_ACK:
+		case MSG_GET:
+		case MSG_GET_ACK:
+		case MSG_DEL:
+		case MSG_DEL_ACK:
+		case MSG_PUT_REPLICA:
+		case MSG_PUT_REPLICA_ACK:
+		case MSG_GET_REPLICA:
+		case MSG_GET_REPLICA_ACK:
+		case MSG_DEL_REPLICA:
+		case MSG_DEL_REPLICA_ACK:
+			return 3;
+		default:
+			return 1;
+	}
+}
+
+/* which of data[0] (bit 0) and data[1] (bit 1) name a node in messages of
+ * type `type' */
+static int msg_nodes(msg_type_t type)
+{
+	switch (type) {
+		case MSG_SET_SUCCESSOR:
+		case MSG_SET_PREDECESSOR:
+		case MSG_NOTIFY:
+		case MSG_GET_SUCCESSOR_ACK:
+		case MSG_GET_PREDECESSOR_ACK:
+		case MSG_GET_CLOSEST_PRECEDING_FINGER_ACK:
+		case MSG_FIND_SUCCESSOR_ACK:
+		case MSG_FIND_PREDECESSOR_ACK:
+		case MSG_FIND_SUCCESSOR_RECURSIVE_ACK:
+			return 1;
+		case MSG_FIND_NEXT_HOP_ACK:
+			return 3;
+		case MSG_PUT_ACK:
+		case MSG_GET_ACK:
+		case MSG_DEL_ACK:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+/* the bytes `v' takes as a varint */
+static int wire_size(unsigned long long v)
+{
+	int size = 1;
+	for (; v >= 0x80; v >>= 7)
+		size++;
+	return size;
+}
+
+/* stores `v' as a varint at `p'; returns the bytes it took */
+static int wire_put(unsigned char *p, unsigned long long v)
+{
+	int i = 0;
+	for (; v >= 0x80; v >>= 7)
+		p[i++] = (unsigned char)(v | 0x80);
+	p[i++] = (unsigned char)v;
+	return i;
+}
+
+/* reads a varint from the `len' bytes at `p' into `v'; returns the bytes it
+ * took, or 0 if it runs past them or past 64 bits */
+static int wire_get(const unsigned char *p, int len, unsigned long long *v)
+{
+	unsigned long long x = 0;
+	int i;
+	for (i = 0; (i < len) && (i < 10); i++) {
+		x |= (unsigned long long)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			*v = x;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/* reads the id at `p' that takes `len' bytes (or at most `len' if `exact'
+ * is 0) into `id'; returns the bytes it took, or 0 if there is none or it
+ * does not fit in chord_id_t */
+static int wire_id(const unsigned char *p, int len, int exact, chord_id_t *id)
+{
+	unsigned long long v;
+	int used = wire_get(p, len, &v);
+	if (!used || (exact && (used != len)) || ((chord_id_t)v != v))
+		return 0;
+	*id = (chord_id_t)v;
+	return used;
+}
+
+/* appends the field `tag' with the `len' bytes at `value' to the frame at
+ * `buf', where `pos' bytes of it are in use; returns the bytes in use after
+ * it, or -1 if it does not fit in `size' (or `pos' is already -1) */
+static int wire_field(unsigned char *buf, int pos, int size, int tag, const unsigned char *value, int len)
+{
+	if ((pos < 0) || ((pos + 1 + wire_size(len) + len) > size))
+		return -1;
+	buf[pos++] = tag;
+	pos += wire_put(buf + pos, len);
+	memcpy(buf + pos, value, len);
+	return pos + len;
+}
+
+/* appends the start of a field `tag' of `len' bytes, whose value the caller
+ * writes, as wire_field does */
+static int wire_open(unsigned char *buf, int pos, int size, int tag, int len)
+{
+	if ((pos < 0) || ((pos + 1 + wire_size(len) + len) > size))
+		return -1;
+	buf[pos++] = tag;
+	return pos + wire_put(buf + pos, len);
+}
+
+/*
+ * Encodes `m' as a frame into the `size' bytes at `buf', which frames that
+ * follow in the same datagram go after.  Returns the bytes the frame takes,
+ * or 0 if it does not fit.  Does not allocate.
+ */
+int msg_encode(const msg_t *m, unsigned char *buf, int size)
+{
+	unsigned char value[16];
+	int unit = msg_unit(m->type), words = msg_words(m->type), nodes = msg_nodes(m->type);
+	int pos = WIRE_HEADER, len = 0, i;
+	unsigned int count = (unit ? m->count : 0);
+	/* ids fill batch, which can be larger than payload (KEYSPACE 64) */
+	unsigned int most = ((unit == sizeof(chord_id_t)) ? (sizeof(m->batch) / sizeof(chord_id_t)) : (sizeof(m->payload) / (unit ? unit : 1)));
+	if (size > (WIRE_HEADER + 0xffff))
+		size = WIRE_HEADER + 0xffff;
+	if ((size < WIRE_HEADER) || (count > most))
+		return 0;
+	if ((m->type & 1) && m->to)
+		pos = wire_field(buf, pos, size, WIRE_TO, value, wire_put(value, m->to));
+	for (i = 0; i < 2; i++) {
+		if ((words & (1 << i)) && m->data[i])
+			pos = wire_field(buf, pos, size, WIRE_DATA0 + i, value, wire_put(value, m->data[i]));
+		if ((nodes & (1 << i)) && m->addr[i]) {
+			memcpy(value, &(m->addr[i]), 4);
+			memcpy(value + 4, &(m->port[i]), 2);
+			pos = wire_field(buf, pos, size, WIRE_ADDR0 + i, value, 6);
+		}
+	}
+	if (count && (unit == sizeof(chord_id_t))) {
+		for (i = 0; i < (int)count; i++)
+			len += wire_size(m->batch[i]);
+		if ((pos = wire_open(buf, pos, size, WIRE_IDS, len)) >= 0)
+			for (i = 0; i < (int)count; i++)
+				pos += wire_put(buf + pos, m->batch[i]);
+	}
+	else if (count && (unit == sizeof(endpoint_t))) {
+		const endpoint_t *e = (const endpoint_t *)m->payload;
+		for (i = 0; i < (int)count; i++)
+			len += wire_size(e[i].id) + 6;
+		if ((pos = wire_open(buf, pos, size, WIRE_ENDPOINTS, len)) >= 0)
+			for (i = 0; i < (int)count; i++) {
+				pos += wire_put(buf + pos, e[i].id);
+				memcpy(buf + pos, &(e[i].addr), 4);
+				memcpy(buf + pos + 4, &(e[i].port), 2);
+				pos += 6;
+			}
+	}
+	else if (count)
+		pos = wire_field(buf, pos, size, WIRE_PAYLOAD, m->payload, count);
+	if (pos < 0)
+		return 0;
+	len = pos - WIRE_HEADER;
+	buf[0] = WIRE_VERSION << 4;
+	buf[1] = m->type;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	buf[4] = m->rid >> 24;
+	buf[5] = m->rid >> 16;
+	buf[6] = m->rid >> 8;
+	buf[7] = m->rid;
+	return pos;
+}
+
+/*
+ * Decodes the frame at the start of the `size' bytes at `buf' into `m'.
+ * Returns the bytes the frame takes, where the next frame of the datagram
+ * starts, or 0 if it is malformed (and the rest of the datagram is not to
+ * be trusted either).  A frame of another version or of a type this node
+ * does not know is skipped over with `m->type' set to 0.  Does not
+ * allocate.
+ */
+int msg_decode(const unsigned char *buf, int size, msg_t *m)
+{
+	const unsigned char *p = buf + WIRE_HEADER, *end;
+	unsigned long long v;
+	int len, used, unit;
+	if ((size < WIRE_HEADER) || (size < (WIRE_HEADER + (len = (buf[2] << 8) | buf[3]))))
+		return 0;
+	end = p + len;
+	m->type = buf[1];
+	if (((buf[0] >> 4) != WIRE_VERSION) || (m->type < MSG_QUIT) || (m->type > MSG_GET_STATS_ACK)) {
+		m->type = 0;
+		return WIRE_HEADER + len;
+	}
+	m->rid = ((unsigned int)buf[4] << 24) | ((unsigned int)buf[5] << 16) | ((unsigned int)buf[6] << 8) | buf[7];
+	m->to = 0;
+	m->data[0] = m->data[1] = 0;
+	m->addr[0] = m->addr[1] = 0;
+	m->port[0] = m->port[1] = 0;
+	m->count = 0;
+	unit = msg_unit(m->type);
+	while (p < end) {
+		int tag = *(p++);
+		if (!(used = wire_get(p, end - p, &v)) || (v > (unsigned long long)(end - p - used)))
+			return 0;
+		p += used;
+		len = (int)v;
+		switch (tag) {
+			case WIRE_TO:
+				if (!wire_id(p, len, 1, &(m->to)))
+					return 0;
+				break;
+			case WIRE_DATA0:
+			case WIRE_DATA1:
+				if (!wire_id(p, len, 1, &(m->data[tag - WIRE_DATA0])))
+					return 0;
+				break;
+			case WIRE_ADDR0:
+			case WIRE_ADDR1:
+				if (len != 6)
+					return 0;
+				memcpy(&(m->addr[tag - WIRE_ADDR0]), p, 4);
+				memcpy(&(m->port[tag - WIRE_ADDR0]), p + 4, 2);
+				break;
+			case WIRE_IDS:
+				{
+					const unsigned char *q = p;
+					if (unit != sizeof(chord_id_t))
+						break;
+					for (m->count = 0; q < p + len; q += used)
+						if ((m->count == (sizeof(m->batch) / sizeof(chord_id_t))) || !(used = wire_id(q, p + len - q, 0, &(m->batch[m->count++]))))
+							return 0;
+					break;
+				}
+			case WIRE_ENDPOINTS:
+				{
+					const unsigned char *q = p;
+					endpoint_t *e = (endpoint_t *)m->payload;
+					if (unit != sizeof(endpoint_t))
+						break;
+					for (m->count = 0; q < p + len; q += used + 6) {
+						if ((m->count == (sizeof(m->payload) / sizeof(endpoint_t))) || !(used = wire_id(q, p + len - q, 0, &(e->id))) || ((q + used + 6) > (p + len)))
+							return 0;
+						memcpy(&(e->addr), q + used, 4);
+						memcpy(&(e->port), q + used + 4, 2);
+						e++;
+						m->count++;
+					}
+					break;
+				}
+			case WIRE_PAYLOAD:
+				if (unit != 1)
+					break;
+				if (len > MSG_PAYLOAD)
+					return 0;
+				memcpy(m->payload, p, len);
+				m->count = len;
+				break;
+			default:
+				break;
+		}
+		p += len;
+	}
+	return end - buf;
+}
+
+
+/**
+ * metrics
+ *
+ * Counted into a shard per thread, allocated the first time the thread
+ * counts anything, so counting takes no locks and no atomic operations;
+ * readers may see a count that is a little behind.
+ */
+
+static __thread stats_shard_t *stats_mine;
+static stats_shard_t *stats_shards;
+static stats_shard_t stats_spare;  // shared by threads that could not allocate one
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static stats_t *stats_shard(void)
+{
+	stats_shard_t *shard = stats_mine;
+	if (!shard) {
+		if (!(shard = calloc(1, sizeof(stats_shard_t))))
+			return &(stats_spare.stats);
+		pthread_mutex_lock(&stats_lock);
+		shard->next = stats_shards;
+		stats_shards = shard;
+		pthread_mutex_unlock(&stats_lock);
+		stats_mine = shard;
+	}
+	return &(shard->stats);
+}
+
+/* the bucket of a latency of `us': values below 8 have one each, and every
+ * power of two above is split into 8 */
+static int stats_bucket(long long us)
+{
+	if (us < 8)
+		return ((us > 0) ? (int)us : 0);
+	int e = 63 - __builtin_clzll(us);
+	int b = ((e - 2) * 8) + (int)(us >> (e - 3)) - 8;
+	return ((b < STATS_BUCKETS) ? b : (STATS_BUCKETS - 1));
+}
+
+/* the middle of bucket `b', in us */
+static long long stats_value(int b)
+{
+	if (b < 8)
+		return b;
+	int e = (b / 8) + 2;
+	return (((long long)((b % 8) + 8) << (e - 3)) + ((1LL << (e - 3)) / 2));
+}
+
+static void stats_count(msg_type_t type, stats_counter_t counter)
+{
+	if ((type > 0) && (type < STATS_TYPES))
+		stats_shard()->messages[type][counter]++;
+}
+
+static void stats_bytes(int received, int size)
+{
+	if (size > 0)
+		stats_shard()->bytes[received] += size;
+}
+
+static void stats_call(msg_type_t type, long long us)
+{
+	if ((type > 0) && (type < STATS_TYPES))
+		stats_shard()->calls[type / 2][stats_bucket(us)]++;
+}
+
+static void stats_lookup(long long us, unsigned int hops)
+{
+	stats_t *s = stats_shard();
+	s->lookups[stats_bucket(us)]++;
+	s->hops[(hops < STATS_HOPS) ? hops : (STATS_HOPS - 1)]++;
+}
+
+/* adds up the counts of every thread into `s' */
+void stats_collect(stats_t *s)
+{
+	const unsigned long long *from;
+	unsigned long long *to = (unsigned long long *)s;
+	size_t words = sizeof(stats_t) / sizeof(unsigned long long), i;
+	stats_shard_t *shard;
+	memcpy(s, &(stats_spare.stats), sizeof(stats_t));
+	pthread_mutex_lock(&stats_lock);
+	for (shard = stats_shards; shard; shard = shard->next)
+		for (from = (const unsigned long long *)&(shard->stats), i = 0; i < words; i++)
+			to[i] += __atomic_load_n(&(from[i]), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* the latency in us below which a fraction `q' of those counted in the
+ * latency histogram `buckets' fall, or -1 if it is empty */
+long long stats_percentile(const unsigned long long *buckets, double q)
+{
+	unsigned long long total = 0, seen = 0;
+	int b;
+	for (b = 0; b < STATS_BUCKETS; b++)
+		total += buckets[b];
+	if (!total)
+		return -1;
+	for (b = 0; b < STATS_BUCKETS - 1; b++)
+		if ((seen += buckets[b]) >= q * total)
+			break;
+	return stats_value(b);
+}
+
+static void stats_latencies(FILE *out, const char *name, const unsigned long long *buckets)
+{
+	unsigned long long count = 0;
+	int b;
+	for (b = 0; b < STATS_BUCKETS; b++)
+		count += buckets[b];
+	if (count)
+		fprintf(out, "%-36s %10llu %9lld %9lld %9lld %9lld\n", name, count, stats_percentile(buckets, 0.5), stats_percentile(buckets, 0.9), stats_percentile(buckets, 0.99), stats_percentile(buckets, 1));
+}
+
+/* fills `ack' with (word, value) pairs of varints for the words of `s' that
+ * are not 0, from word `word' on and as many as fit, and data[0] with the
+ * word the next page starts at (the number of words in stats_t after the
+ * last) */
+static void stats_page(const stats_t *s, size_t word, msg_t *ack)
+{
+	const unsigned long long *w = (const unsigned long long *)s;
+	size_t words = sizeof(stats_t) / sizeof(unsigned long long);
+	ack->type = MSG_GET_STATS_ACK;
+	ack->count = 0;
+	for (; (word < words) && (ack->count + wire_size(word) + wire_size(w[word]) <= MSG_PAYLOAD); word++) {
+		if (!w[word])
+			continue;
+		ack->count += wire_put(&(ack->payload[ack->count]), word);
+		ack->count += wire_put(&(ack->payload[ack->count]), w[word]);
+	}
+	ack->data[0] = word;
+}
+
+/* prints the counters, percentiles of the latency histograms and hops of
+ * `s' that are not all 0 */
+void stats_print(const stats_t *s, FILE *out)
+{
+	unsigned long long lookups = 0, hops = 0;
+	int t, h;
+	fprintf(out, "%-36s %10s %10s %10s %10s\n", "messages", "sent", "received", "timed out", "retried");
+	for (t = 1; t < STATS_TYPES; t++) {
+		const unsigned long long *c = s->messages[t];
+		if (c[STATS_SENT] || c[STATS_RECEIVED] || c[STATS_TIMEOUTS] || c[STATS_RETRIES])
+			fprintf(out, "%-36s %10llu %10llu %10llu %10llu\n", msg_name(t), c[STATS_SENT], c[STATS_RECEIVED], c[STATS_TIMEOUTS], c[STATS_RETRIES]);
+	}
+	fprintf(out, "%-36s %10llu %10llu\n", "bytes", s->bytes[0], s->bytes[1]);
+	fprintf(out, "%-36s %10s %9s %9s %9s %9s\n", "round trips (us)", "calls", "p50", "p90", "p99", "max");
+	for (t = 1; t < STATS_TYPES; t += 2)
+		stats_latencies(out, msg_name(t), s->calls[t / 2]);
+	stats_latencies(out, "lookups", s->lookups);
+	for (h = 0; h < STATS_HOPS; h++) {
+		lookups += s->hops[h];
+		hops += h * s->hops[h];
+	}
+	if (lookups) {
+		fprintf(out, "hops per lookup: mean %.2f,", (double)hops / lookups);
+		for (h = 0; h < STATS_HOPS; h++)
+			if (s->hops[h])
+				fprintf(out, " %s%d: %llu", ((h == STATS_HOPS - 1) ? ">=" : ""), h, s->hops[h]);
+		fprintf(out, "\n");
+	}
+}
+
+
+
+/**
+ * key/value store
+ */
+
+static void kv_init(kv_store_t *s)
+{
+	s->size = KV_TABLE;
+	s->entries = calloc(s->size, sizeof(kv_entry_t));
+	pthread_mutex_init(&(s->lock), NULL);
+}
+
+static void kv_free(kv_store_t *s)
+{
+	while (s->slab) {
+		unsigned char *prev = *(unsigned char **)s->slab;
+		free(s->slab);
+		s->slab = prev;
+	}
+	free(s->entries);
+	free(s->migrate_log);
+	pthread_mutex_destroy(&(s->lock));
+}
+
+/* the size class of a chunk that holds `len' bytes */
+static int kv_class(size_t len)
+{
+	int c = 0;
+	while ((size_t)(KV_CHUNK << c) < len)
+		c++;
+	return c;
+}
+
+/* a chunk of size class `c': a freed one if there is any, carved from the
+ * newest slab otherwise, with a new slab allocated once that runs out; NULL
+ * if there is no memory for it */
+static unsigned char *kv_chunk(kv_store_t *s, int c)
+{
+	size_t size = KV_CHUNK << c;
+	unsigned char *chunk = s->free_chunks[c];
+	if (chunk) {
+		s->free_chunks[c] = *(void **)chunk;
+		return chunk;
+	}
+	if (!s->slab || ((s->slab_used + size) > KV_SLAB)) {
+		unsigned char *slab = malloc(KV_SLAB);
+		if (!slab)
+			return NULL;
+		*(unsigned char **)slab = s->slab;
+		s->slab = slab;
+		s->slab_used = KV_CHUNK;  // the link to the previous slab
+		s->slabs++;
+	}
+	chunk = s->slab + s->slab_used;
+	s->slab_used += size;
+	return chunk;
+}
+
+static void kv_release(kv_store_t *s, kv_entry_t *e)
+{
+	int c = kv_class(e->klen + e->vlen);
+	*(void **)e->data = s->free_chunks[c];
+	s->free_chunks[c] = e->data;
+	s->bytes -= e->klen + e->vlen;
+}
+
+/* notes that key `key' changed, if it is in the range being migrated */
+static void kv_log(kv_store_t *s, chord_id_t id, const void *key, unsigned int klen)
+{
+	unsigned short len = klen;
+	if (!s->migrating || s->migrate_failed || !in_range_ex_in_circular(s->migrate_lo, s->migrate_hi, id))
+		return;
+	if ((s->migrate_logged + sizeof(id) + sizeof(len) + klen) > s->migrate_log_size) {
+		size_t size = 2 * (s->migrate_log_size + sizeof(id) + sizeof(len) + klen);
+		unsigned char *log = realloc(s->migrate_log, size);
+		/* the change would never reach the other node then */
+		if (!log) {
+			s->migrate_failed = 1;
+			return;
+		}
+		s->migrate_log = log;
+		s->migrate_log_size = size;
+	}
+	memcpy(s->migrate_log + s->migrate_logged, &id, sizeof(id));
+	memcpy(s->migrate_log + s->migrate_logged + sizeof(id), &len, sizeof(len));
+	memcpy(s->migrate_log + s->migrate_logged + sizeof(id) + sizeof(len), key, klen);
+	s->migrate_logged += sizeof(id) + sizeof(len) + klen;
+}
+
+static unsigned int kv_home(kv_store_t *s, chord_id_t id)
+{
+	return (unsigned int)(((unsigned long long)id * 0x9e3779b97f4a7c15ull) >> 32) & (s->size - 1);
+}
+
+/* the slot of the key `key' of `klen' bytes, which hashes to `id', or the
+ * free slot it would go in */
+static kv_entry_t *kv_slot(kv_store_t *s, chord_id_t id, const void *key, unsigned int klen)
+{
+	unsigned int mask = s->size - 1, i = kv_home(s, id);
+	kv_entry_t *e;
+	while ((e = &(s->entries[i]))->data && ((e->id != id) || (e->klen != klen) || memcmp(e->data, key, klen)))
+		i = (i + 1) & mask;
+	return e;
+}
+
+/* stores `value' under `key', replacing what was there; returns 0 (with
+ * the store as it was) if there is no memory for it */
+static int kv_put(kv_store_t *s, chord_id_t id, const void *key, unsigned int klen, const void *value, unsigned int vlen)
+{
+	kv_entry_t *e = kv_slot(s, id, key, klen);
+	unsigned char *chunk;
+	if (e->data && (kv_class(e->klen + e->vlen) != kv_class(klen + vlen))) {
+		if (!(chunk = kv_chunk(s, kv_class(klen + vlen))))
+			return 0;
+		kv_release(s, e);
+		e->data = chunk;
+	}
+	else if (e->data)
+		s->bytes -= e->klen + e->vlen;
+	else {
+		if (2 * (s->count + 1) > s->size) {
+			kv_entry_t *old = s->entries;
+			unsigned int size = s->size, i;
+			s->size = 2 * size;
+			s->entries = calloc(s->size, sizeof(kv_entry_t));
+			for (i = 0; i < size; i++)
+				if (old[i].data) {
+					kv_entry_t *moved = kv_slot(s, old[i].id, old[i].data, old[i].klen);
+					*moved = old[i];
+					/* a migration scanning the table goes on at the
+					 * same slot, so it has to hear about keys it has
+					 * yet to reach that move before it */
+					if ((i >= s->migrate_scan) && ((unsigned int)(moved - s->entries) < s->migrate_scan))
+						kv_log(s, moved->id, moved->data, moved->klen);
+				}
+			free(old);
+			e = kv_slot(s, id, key, klen);
+		}
+		if (!(e->data = kv_chunk(s, kv_class(klen + vlen))))
+			return 0;
+		s->count++;
+	}
+	e->id = id;
+	e->klen = klen;
+	e->vlen = vlen;
+	memcpy(e->data, key, klen);
+	memcpy(e->data + klen, value, vlen);
+	s->bytes += klen + vlen;
+	kv_log(s, id, key, klen);
+	return 1;
+}
+
+/* copies the value stored under `key' to `value'; returns its length, or
+ * -1 if there is none */
+static int kv_get(kv_store_t *s, chord_id_t id, const void *key, unsigned int klen, void *value)
+{
+	kv_entry_t *e = kv_slot(s, id, key, klen);
+	if (!e->data)
+		return -1;
+	memcpy(value, e->data + e->klen, e->vlen);
+	return e->vlen;
+}
+
+/*
+ * Removes the entry `e'.  The entries after it move back into the gap, up
+ * to the first that cannot since it would then come before its home slot,
+ * so lookups never need tombstones.
+ */
+static void kv_remove(kv_store_t *s, kv_entry_t *e)
+{
+	unsigned int mask = s->size - 1, i, j;
+	kv_log(s, e->id, e->data, e->klen);
+	kv_release(s, e);
+	s->count--;
+	for (i = j = (unsigned int)(e - s->entries); s->entries[j = (j + 1) & mask].data; ) {
+		unsigned int home = kv_home(s, s->entries[j].id);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			/* a migration scanning the table may already be past
+			 * slot i, so it has to hear about the move */
+			s->entries[i] = s->entries[j];
+			kv_log(s, s->entries[i].id, s->entries[i].data, s->entries[i].klen);
+			i = j;
+		}
+	}
+	s->entries[i].data = NULL;
+}
+
+/* removes `key'; returns 0 if it was not there */
+static int kv_del(kv_store_t *s, chord_id_t id, const void *key, unsigned int klen)
+{
+	kv_entry_t *e = kv_slot(s, id, key, klen);
+	if (!e->data)
+		return 0;
+	kv_remove(s, e);
+	return 1;
+}
+
+/* removes every key in (`lo', `hi'] */
+static void kv_drop(kv_store_t *s, chord_id_t lo, chord_id_t hi)
+{
+	unsigned int i;
+	for (i = 0; i < s->size; )
+		if (s->entries[i].data && in_range_ex_in_circular(lo, hi, s->entries[i].id))
+			kv_remove(s, &(s->entries[i]));
+		else
+			i++;
+}
+
+/*
+ * The node that stores `id' as far as `n' can tell: `n' itself if the ring
+ * is up and `id' falls between its predecessor (if known) and itself, its
+ * predecessor if the ring is up otherwise, and its successor, which took
+ * over its keys, if it left.  0 if that would be `n' all the same.  Called
+ * with the store lock held, which is also held while keys are handed over.
+ */
+static chord_id_t kv_owner(node_t *n, chord_id_t id)
+{
+	chord_id_t p = n->predecessor, owner;
+	if (n->status != ST_CONNECTED)
+		owner = n->successor;
+	else if (!p || in_range_ex_in_circular(p, n->id, id))
+		return n->id;
+	else
+		owner = p;
+	return ((owner == n->id) ? 0 : owner);
+}
+
+/*
+ * Carries out the put, get or delete `m' on the store of `n' and fills in
+ * `ack'.  data[0] of the request is the hash of the key and data[1] its
+ * length.  In the acknowledgement data[1] is the owner of the key as far as
+ * `n' knows (see kv_owner); if that is `n', data[0] says whether it held
+ * (or now holds) the key.  A get returns the value as the payload.  The
+ * replica versions work on the copy `n' keeps, whoever owns the key.
+ */
+static void kv_serve(node_t *n, msg_t *m, msg_t *ack)
+{
+	kv_store_t *s = &(n->store);
+	chord_id_t id = m->data[0];
+	unsigned int klen = m->data[1];
+	int replica = (m->type >= MSG_PUT_REPLICA);
+	ack->type = m->type + 1;
+	ack->data[0] = 0;
+	ack->count = 0;
+	pthread_mutex_lock(&(s->lock));
+	if ((((ack->data[1] = kv_owner(n, id)) != n->id) && !replica) || (m->data[1] > m->count) || (m->count > MSG_PAYLOAD)) {
+		pthread_mutex_unlock(&(s->lock));
+		return;
+	}
+	switch (m->type) {
+		case MSG_PUT:
+		case MSG_PUT_REPLICA:
+			ack->data[0] = kv_put(s, id, m->payload, klen, m->payload + klen, m->count - klen);
+			break;
+		case MSG_GET:
+		case MSG_GET_REPLICA:
+			{
+				int len = kv_get(s, id, m->payload, klen, ack->payload);
+				if (len >= 0) {
+					ack->data[0] = 1;
+					ack->count = len;
+				}
+				break;
+			}
+		case MSG_DEL:
+		case MSG_DEL_REPLICA:
+			ack->data[0] = kv_del(s, id, m->payload, klen);
+			break;
+		default:
+			break;
+	}
+	pthread_mutex_unlock(&(s->lock));
+}
+
+
+/**
+ * RPC transport
+ */
+
+/* the slot of node `id' in the peer directory, or the free slot it would go
+ * in; called with peers_lock held */
+static peer_t *peer_slot(transport_t *t, chord_id_t id)
+{
+	unsigned int mask = t->peers_size - 1, i = (unsigned int)(((unsigned long long)id * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+	while (t->peers[i].id && (t->peers[i].id != id))
+		i = (i + 1) & mask;
+	return &(t->peers[i]);
+}
+
+/* the directory entry of node `id', which is added with the RPC server at
+ * `addr':`port' if there is none; called with peers_lock held */
+static peer_t *peer_add(transport_t *t, chord_id_t id, unsigned int addr, unsigned short port)
+{
+	peer_t *p = peer_slot(t, id);
+	if (p->id)
+		return p;
+	if (2 * (t->npeers + 1) > t->peers_size) {
+		peer_t *old = t->peers;
+		unsigned int size = t->peers_size, i;
+		t->peers_size = 2 * size;
+		t->peers = calloc(t->peers_size, sizeof(peer_t));
+		for (i = 0; i < size; i++)
+			if (old[i].id)
+				*peer_slot(t, old[i].id) = old[i];
+		free(old);
+		p = peer_slot(t, id);
+	}
+	struct in_addr in = { addr };
+	t->npeers++;
+	p->id = id;
+	inet_setup(&(p->host), IN_PROT_UDP, in, ntohs(port));
+	p->srtt = 0;
+	p->rttvar = 0;
+	p->rto = RPC_RTO_INIT * 1000LL;
+	return p;
+}
+
+/* records that node `id' is reached at `addr':`port' */
+static void peer_learn(transport_t *t, chord_id_t id, unsigned int addr, unsigned short port)
+{
+	pthread_mutex_lock(&(t->peers_lock));
+	peer_t *p = peer_add(t, id, addr, port);
+	if ((p->host.addr.sin_addr.s_addr != addr) || (p->host.addr.sin_port != port)) {
+		p->host.addr.sin_addr.s_addr = addr;
+		p->host.addr.sin_port = port;
+		p->srtt = 0;
+		p->rttvar = 0;
+		p->rto = RPC_RTO_INIT * 1000LL;
+	}
+	pthread_mutex_unlock(&(t->peers_lock));
+}
+
+/* resolves the RPC server of node `id' into `remote'; returns the current
+ * retransmission timeout of the node in us, or 0 if nobody told us where
+ * the node is */
+static long long rpc_peer(transport_t *t, chord_id_t id, inet_host_t *remote)
+{
+	long long rto = 0;
+	pthread_mutex_lock(&(t->peers_lock));
+	peer_t *p = peer_slot(t, id);
+	if (id && p->id) {
+		*remote = p->host;
+		rto = p->rto;
+	}
+	pthread_mutex_unlock(&(t->peers_lock));
+	return rto;
+}
+
+/* folds a round trip of `rtt' us to node `id' into its estimates */
+static void rpc_sample(transport_t *t, chord_id_t id, long long rtt)
+{
+	if (rtt < 1)
+		rtt = 1;
+	pthread_mutex_lock(&(t->peers_lock));
+	peer_t *p = peer_slot(t, id);
+	if (p->id) {
+		if (!p->srtt) {
+			p->srtt = rtt;
+			p->rttvar = rtt / 2;
+		}
+		else {
+			long long err = ((p->srtt > rtt) ? (p->srtt - rtt) : (rtt - p->srtt));
+			p->rttvar += (err - p->rttvar) / 4;
+			p->srtt += (rtt - p->srtt) / 8;
+		}
+		p->rto = p->srtt + (4 * p->rttvar);
+		if (p->rto < (RPC_RTO_MIN * 1000LL))
+			p->rto = RPC_RTO_MIN * 1000LL;
+		if (p->rto > (RPC_RTO_MAX * 1000LL))
+			p->rto = RPC_RTO_MAX * 1000LL;
+	}
+	pthread_mutex_unlock(&(t->peers_lock));
+}
+
+/* the smoothed round-trip time to node `id' in us; 0 before the first
+ * sample, and -1 if nobody told us where the node is */
+static long long rpc_rtt(transport_t *t, chord_id_t id)
+{
+	long long rtt = -1;
+	pthread_mutex_lock(&(t->peers_lock));
+	peer_t *p = peer_slot(t, id);
+	if (id && p->id)
+		rtt = p->srtt;
+	pthread_mutex_unlock(&(t->peers_lock));
+	return rtt;
+}
+
+/* whether the server answers `type' straight from its own state, so that the
+ * round trip measures the network alone */
+static int msg_direct(msg_type_t type)
+{
+	switch (type) {
+		case MSG_FIND_SUCCESSOR:
+		case MSG_FIND_PREDECESSOR:
+		case MSG_FIND_SUCCESSOR_BATCH:
+		case MSG_FIND_SUCCESSOR_RECURSIVE:
+		case MSG_PUT:
+		case MSG_DEL:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+/* the bytes at the start of `m' that are in use, for copies in memory */
+static int msg_size(msg_t *m)
+{
+	int size = offsetof(msg_t, count), unit = msg_unit(m->type);
+	if (unit)
+		size += sizeof(m->count) + (m->count * unit);
+	return size;
+}
+
+/* sends `m' as a datagram of its own */
+int msg_send(inet_host_t *local, inet_host_t *remote, msg_t *m)
+{
+	unsigned char buf[WIRE_DATAGRAM];
+	int size = msg_encode(m, buf, sizeof(buf));
+	if (!size)
+		return -EIN_SEND;
+	return inet_send(local, remote, buf, size);
+}
+
+/*
+ * Receives a message like inet_receive, except that a datagram whose first
+ * frame is not a well-formed message is consumed and reported as 0 bytes.
+ * Frames after the first are dropped.
+ */
+int msg_receive(inet_host_t *remote, inet_host_t *local, msg_t *m, int timeout)
+{
+	unsigned char buf[WIRE_DATAGRAM];
+	int size = inet_receive(remote, local, buf, sizeof(buf), timeout);
+	if (size < 0)
+		return size;
+	if (!(size = msg_decode(buf, size, m)) || !m->type)
+		return 0;
+	return size;
+}
+
+/*
+ * Frames sent by a thread that runs a transport (its RPC thread, or a driver
+ * handing it datagrams) are gathered into a datagram per destination, up to
+ * WIRE_COALESCE bytes, and go out together once the thread is done with what
+ * woke it.  So the acknowledgements, nested calls and rounds of
+ * stabilization of one wakeup share packets.  Other threads send right away.
+ */
+typedef struct wire_datagram {
+	inet_host_t *local;
+	inet_host_t remote;
+	int size;
+	unsigned char data[WIRE_DATAGRAM];
+} wire_datagram_t;
+
+typedef struct wire_outbox {
+	transport_t *t;       // gathering for, NULL if not
+	int count;
+	wire_datagram_t datagrams[WIRE_OUTBOX];
+} wire_outbox_t;
+
+static __thread wire_outbox_t *outbox_mine;
+
+/* makes this thread gather what `t' sends until transport_flush; returns 0
+ * if it already gathers (and whoever started flushes), or cannot */
+static int transport_gather(transport_t *t)
+{
+	wire_outbox_t *o = outbox_mine;
+	if (!o) {
+		if (!(o = malloc(sizeof(wire_outbox_t))))
+			return 0;
+		o->t = NULL;
+		o->count = 0;
+		outbox_mine = o;
+	}
+	if (o->t)
+		return 0;
+	o->t = t;
+	return 1;
+}
+
+/* sends the datagrams `o' gathered for `t': with one call of send_many per
+ * address they go from, if `t' has it and batching is on */
+static void outbox_send(transport_t *t, wire_outbox_t *o)
+{
+	inet_datagram_t list[WIRE_OUTBOX];
+	inet_host_t *locals[2] = { &(t->server), &(t->client) };
+	int i, l, count;
+	if (!t->ops->send_many || (transport_batch <= 1))
+		for (i = 0; i < o->count; i++)
+			t->ops->send(o->datagrams[i].local, &(o->datagrams[i].remote), o->datagrams[i].data, o->datagrams[i].size);
+	else
+		for (l = 0; l < 2; l++) {
+			for (i = 0, count = 0; i < o->count; i++)
+				if (o->datagrams[i].local == locals[l]) {
+					list[count].addr = o->datagrams[i].remote.addr;
+					list[count].data = o->datagrams[i].data;
+					list[count++].len = o->datagrams[i].size;
+				}
+			if (count)
+				t->ops->send_many(locals[l], list, count);
+		}
+	o->count = 0;
+}
+
+/* sends what was gathered since transport_gather returned `gathering' */
+static void transport_flush(transport_t *t, int gathering)
+{
+	if (!gathering)
+		return;
+	outbox_send(t, outbox_mine);
+	outbox_mine->t = NULL;
+}
+
+/* adds `m' to the datagram gathered for `remote' from `local', which goes
+ * out first if `m' does not fit (as do all of them once there are
+ * WIRE_OUTBOX destinations); returns the bytes of the frame */
+static int transport_queue(transport_t *t, wire_outbox_t *o, inet_host_t *local, inet_host_t *remote, msg_t *m)
+{
+	wire_datagram_t *d = o->datagrams;
+	int size;
+	for (; d < o->datagrams + o->count; d++)
+		if ((d->local == local) && (d->remote.addr.sin_addr.s_addr == remote->addr.sin_addr.s_addr) && (d->remote.addr.sin_port == remote->addr.sin_port))
+			break;
+	if (d == o->datagrams + WIRE_OUTBOX) {
+		outbox_send(t, o);
+		d = o->datagrams;
+	}
+	if (d == o->datagrams + o->count) {
+		o->count++;
+		d->local = local;
+		d->remote = *remote;
+		d->size = 0;
+	}
+	if (!(size = msg_encode(m, d->data + d->size, ((d->size < WIRE_COALESCE) ? (WIRE_COALESCE - d->size) : 0)))) {
+		if (d->size)
+			t->ops->send(local, remote, d->data, d->size);
+		if (!(size = msg_encode(m, d->data, WIRE_DATAGRAM)))
+			return -EIN_SEND;
+		d->size = 0;
+	}
+	d->size += size;
+	return size;
+}
+
+/* sends `m' from the server or client address `local' of `t' the way `t'
+ * runs, gathered with others if this thread runs `t', and counts it */
+static int transport_send(transport_t *t, inet_host_t *local, inet_host_t *remote, msg_t *m)
+{
+	wire_outbox_t *o = outbox_mine;
+	unsigned char buf[WIRE_DATAGRAM];
+	int size;
+	if (o && (o->t == t)) {
+		if ((size = transport_queue(t, o, local, remote, m)) > 0) {
+			stats_count(m->type, STATS_SENT);
+			stats_bytes(0, size);
+		}
+		return size;
+	}
+	if (!(size = msg_encode(m, buf, sizeof(buf))))
+		return -EIN_SEND;
+	stats_count(m->type, STATS_SENT);
+	stats_bytes(0, size);
+	return t->ops->send(local, remote, buf, size);
+}
+
+/* fills in where to reach the nodes `m' names, so the receiver can call them */
+static void rpc_address(transport_t *t, msg_t *m)
+{
+	int nodes = msg_nodes(m->type), i;
+	for (i = 0; i < 2; i++) {
+		m->addr[i] = 0;
+		m->port[i] = 0;
+		if (!(nodes & (1 << i)) || !m->data[i])
+			continue;
+		pthread_mutex_lock(&(t->peers_lock));
+		peer_t *p = peer_slot(t, m->data[i]);
+		if (p->id) {
+			m->addr[i] = p->host.addr.sin_addr.s_addr;
+			m->port[i] = p->host.addr.sin_port;
+		}
+		pthread_mutex_unlock(&(t->peers_lock));
+	}
+}
+
+/* takes note of where to reach the nodes `m' names */
+static void rpc_learn(transport_t *t, msg_t *m)
+{
+	int nodes = msg_nodes(m->type), i;
+	for (i = 0; i < 2; i++)
+		if ((nodes & (1 << i)) && m->data[i] && m->addr[i])
+			peer_learn(t, m->data[i], m->addr[i], m->port[i]);
+	if (m->type == MSG_GET_PREDECESSOR_ACK)
+		for (i = 0; i < (int)m->count; i++) {
+			endpoint_t *e = &(((endpoint_t *)m->payload)[i]);
+			if (e->id && e->addr)
+				peer_learn(t, e->id, e->addr, e->port);
+		}
+}
+
+/* us on the clock of the transports */
+static long long rpc_now(void)
+{
+	return transport_ops->now() / 1000;
+}
+
+/* when the RPC thread next has to look at `p' */
+static long long rpc_due(rpc_pending_t *p)
+{
+	return ((p->deadline && (p->deadline < p->retransmit)) ? p->deadline : p->retransmit);
+}
+
+/*
+ * Removes the outstanding call `rid', if it is still outstanding.  If `now'
+ * is not 0 the acknowledgement arrived then, and the round trip is sampled
+ * unless the call was retransmitted (whose acknowledgement could answer
+ * either copy).
+ */
+static int rpc_take(transport_t *t, unsigned int rid, long long now, node_t **n, rpc_callback_t *callback, void **arg)
+{
+	pthread_mutex_lock(&(t->pending_lock));
+	rpc_pending_t *p = &(t->pending[rid & (t->pending_size - 1)]);
+	if (!rid || (p->rid != rid)) {
+		pthread_mutex_unlock(&(t->pending_lock));
+		return 0;
+	}
+	*n = p->node;
+	*callback = p->callback;
+	*arg = p->arg;
+	int sample = (now && p->sample && !p->retries);
+	chord_id_t id = p->id;
+	msg_type_t type = p->m.type;
+	long long rtt = now - p->sent;
+	p->rid = 0;
+	t->free_slots[t->nfree_slots++] = (rid & (t->pending_size - 1));
+	pthread_mutex_unlock(&(t->pending_lock));
+	if (now)
+		stats_call(type, rtt);
+	if (sample)
+		rpc_sample(t, id, rtt);
+	return 1;
+}
+
+/*
+ * Doubles the room for outstanding calls of `t', with pending_lock held.
+ * Each call moves to slot (rid % the new size), which no other call has,
+ * since they all differed in their low bits to begin with.  Returns 0 at
+ * RPC_PENDING.
+ */
+static int rpc_grow(transport_t *t)
+{
+	unsigned int size = 2 * t->pending_size, slot;
+	rpc_pending_t *pending;
+	unsigned int *free_slots;
+	if ((size > RPC_PENDING) || !(pending = calloc(size, sizeof(rpc_pending_t))))
+		return 0;
+	if (!(free_slots = malloc(size * sizeof(unsigned int)))) {
+		free(pending);
+		return 0;
+	}
+	for (slot = 0; slot < t->pending_size; slot++)
+		if (t->pending[slot].rid)
+			pending[t->pending[slot].rid & (size - 1)] = t->pending[slot];
+	t->nfree_slots = 0;
+	for (slot = size; slot-- > 0; )
+		if (!pending[slot].rid)
+			free_slots[t->nfree_slots++] = slot;
+	free(t->pending);
+	free(t->free_slots);
+	t->pending = pending;
+	t->free_slots = free_slots;
+	t->pending_size = size;
+	return 1;
+}
+
+/*
+ * Sends `m' to node `id' from the client socket of the transport of `n'
+ * without waiting for it.  `callback' runs on the RPC thread with the
+ * acknowledgement once it arrives, or with NULL if none arrived within
+ * `timeout' ms (-1 for no deadline) or after RPC_RETRIES retransmissions,
+ * whichever comes first.  Retransmissions follow the round-trip estimate of
+ * the peer and back off exponentially.  Any number of calls, up to
+ * RPC_PENDING, may be outstanding on the transport at once; acknowledgements
+ * are matched to their calls by request id, in whatever order they arrive.
+ *
+ * Returns 0 on success, or a negative inet error code if the call could not
+ * be sent (or nobody told us where `id' is), in which case `callback' never
+ * runs.
+ */
+int rpc_call_async(node_t *n, chord_id_t id, msg_t *m, int timeout, rpc_callback_t callback, void *arg)
+{
+	transport_t *t = n->transport;
+	inet_host_t remote;
+	long long rto = rpc_peer(t, id, &remote);
+	int direct = msg_direct(m->type);
+	if (!rto)
+		return -EIN_CONN;
+
+	/* the server works on indirect requests before answering, so leave
+	 * it time to do so before asking again */
+	if (!direct && ((rto *= 4) > (RPC_RTO_MAX * 1000LL)))
+		rto = RPC_RTO_MAX * 1000LL;
+
+	m->to = id;
+	rpc_address(t, m);
+	pthread_mutex_lock(&(t->pending_lock));
+	if (!t->nfree_slots && !rpc_grow(t)) {
+		pthread_mutex_unlock(&(t->pending_lock));
+		return -EIN_SEND;
+	}
+	unsigned int slot = t->free_slots[--t->nfree_slots];
+	rpc_pending_t *p = &(t->pending[slot]);
+	do
+		m->rid = ((++t->rid_seq) * t->pending_size) | slot;
+	while (!m->rid);
+	p->rid = m->rid;
+	p->node = n;
+	p->id = id;
+	p->retries = 0;
+	p->sample = direct;
+	p->sent = rpc_now();
+	p->rto = rto;
+	p->retransmit = p->sent + rto;
+	p->deadline = ((timeout < 0) ? 0 : (p->sent + (timeout * 1000LL)));
+	p->callback = callback;
+	p->arg = arg;
+	p->remote = remote;
+	memcpy(&(p->m), m, msg_size(m));
+	long long due = rpc_due(p);
+	int wake = (!t->next_deadline || (due < t->next_deadline));
+	if (wake)
+		t->next_deadline = due;
+	pthread_mutex_unlock(&(t->pending_lock));
+
+	/* the RPC thread may be sleeping past the new deadline */
+	if (wake)
+		t->ops->wake(t);
+
+	TRACE(TRACE_MESSAGES, TRACE_CALL, n->id, id, &remote, m);
+	int ret = transport_send(t, &(t->client), &remote, m);
+	if (ret < 0) {
+		rpc_take(t, m->rid, 0, &n, &callback, &arg);
+		return ret;
+	}
+	return 0;
+}
+
+typedef struct rpc_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	msg_t *ack;
+} rpc_waiter_t;
+
+static void rpc_wake(node_t *n, void *arg, msg_t *ack)
+{
+	rpc_waiter_t *w = (rpc_waiter_t *)arg;
+	pthread_mutex_lock(&(w->lock));
+	if (ack)
+		*(w->ack) = *ack;
+	else
+		w->ack->type = 0;
+	w->done = 1;
+	n->transport->ops->signal(&(w->cond));
+	pthread_mutex_unlock(&(w->lock));
+}
+
+/*
+ * Sends `m' to the RPC server of node `id' and waits for the acknowledgement
+ * as rpc_call_async does, storing it in `ack'.  Must not be
+ * called from the RPC thread, which is the one delivering acknowledgements.
+ */
+int rpc_call(node_t *n, chord_id_t id, msg_t *m, msg_t *ack, int timeout)
+{
+	rpc_waiter_t w;
+	pthread_mutex_init(&(w.lock), NULL);
+	pthread_cond_init(&(w.cond), NULL);
+	w.done = 0;
+	w.ack = ack;
+	int ret = rpc_call_async(n, id, m, timeout, rpc_wake, &w);
+	if (ret < 0)
+		ack->type = 0;
+	else {
+		pthread_mutex_lock(&(w.lock));
+		while (!w.done)
+			n->transport->ops->wait(&(w.cond), &(w.lock));
+		pthread_mutex_unlock(&(w.lock));
+		ret = (ack->type ? msg_size(ack) : -EIN_TIME);
+	}
+	pthread_cond_destroy(&(w.cond));
+	pthread_mutex_destroy(&(w.lock));
+	return ret;
+}
+
+/* runs the callback of the call `ack' from `from' acknowledges, if it is
+ * still outstanding */
+static void rpc_deliver(transport_t *t, inet_host_t *from, msg_t *ack)
+{
+	node_t *n;
+	rpc_callback_t callback;
+	void *arg;
+	if (rpc_take(t, ack->rid, rpc_now(), &n, &callback, &arg)) {
+		TRACE(TRACE_MESSAGES, TRACE_ACK, n->id, 0, from, ack);
+		rpc_learn(t, ack);
+		callback(n, arg, ack);
+	}
+}
+
+/*
+ * Handles every datagram waiting on the socket `local' of `t', receiving up
+ * to transport_batch of them into t->rx per system call.  Returns 0 once the
+ * last node has quit.
+ */
+static int rpc_drain(transport_t *t, inet_host_t *local)
+{
+	inet_datagram_t d[RPC_BATCH];
+	inet_host_t from;
+	int batch = ((transport_batch < RPC_BATCH) ? transport_batch : RPC_BATCH), count, i;
+	memset(&from, 0, sizeof(from));
+	from.fd = -1;
+	from.protocol = IN_PROT_UDP;
+	do {
+		if (batch > 1) {
+			for (i = 0; i < batch; i++) {
+				d[i].data = t->rx + (i * WIRE_DATAGRAM);
+				d[i].len = WIRE_DATAGRAM;
+			}
+			count = inet_receive_many(local, d, batch);
+		}
+		else if ((d[0].len = inet_receive(&from, local, t->rx, WIRE_DATAGRAM, 0)) >= 0) {
+			d[0].addr = from.addr;
+			d[0].data = t->rx;
+			count = 1;
+		}
+		else
+			count = 0;
+		for (i = 0; i < count; i++) {
+			from.addr = d[i].addr;
+			if (!transport_receive(t, local, &from, d[i].data, d[i].len))
+				return 0;
+		}
+	} while (count == batch);
+	return 1;
+}
+
+/* runs the callbacks of calls whose acknowledgements are waiting */
+static void rpc_complete(transport_t *t)
+{
+	rpc_drain(t, &(t->client));
+}
+
+/*
+ * Retransmits calls whose retransmission timeout passed, and times out calls
+ * past their deadline or out of retries.  Calls made by `gone', if not NULL,
+ * time out right away, and so do all calls once the transport has no nodes
+ * left; except for `keep'.
+ */
+static void rpc_expire(transport_t *t, node_t *gone, unsigned int keep)
+{
+	node_t *nodes[RPC_PENDING];
+	rpc_callback_t callbacks[RPC_PENDING];
+	void *args[RPC_PENDING];
+	int e, count = 0, slot, flush = (gone || !t->nnodes);
+	long long now = rpc_now();
+	pthread_mutex_lock(&(t->pending_lock));
+	if (!flush && (!t->next_deadline || (now < t->next_deadline))) {
+		pthread_mutex_unlock(&(t->pending_lock));
+		return;
+	}
+	t->next_deadline = 0;
+	for (slot = 0; slot < (int)t->pending_size; slot++) {
+		rpc_pending_t *p = &(t->pending[slot]);
+		if (!p->rid)
+			continue;
+		if ((flush && ((p->node == gone) || !t->nnodes) && (p->rid != keep)) || (p->deadline && (p->deadline <= now)) || ((p->retransmit <= now) && (p->retries == RPC_RETRIES))) {
+			TRACE(TRACE_EVENTS, TRACE_TIMEOUT, p->node->id, p->id, &(p->remote), &(p->m));
+			stats_count(p->m.type, STATS_TIMEOUTS);
+			nodes[count] = p->node;
+			callbacks[count] = p->callback;
+			args[count++] = p->arg;
+			p->rid = 0;
+			t->free_slots[t->nfree_slots++] = slot;
+			continue;
+		}
+		if (p->retransmit <= now) {
+			p->retries++;
+			t->retransmits++;
+			if ((p->rto *= 2) > (RPC_RTO_MAX * 1000LL))
+				p->rto = RPC_RTO_MAX * 1000LL;
+			p->retransmit = now + p->rto;
+			transport_send(t, &(t->client), &(p->remote), &(p->m));
+			TRACE(TRACE_MESSAGES, TRACE_RETRANSMIT, p->node->id, p->id, &(p->remote), &(p->m));
+			stats_count(p->m.type, STATS_RETRIES);
+		}
+		long long due = rpc_due(p);
+		if (!t->next_deadline || (due < t->next_deadline))
+			t->next_deadline = due;
+	}
+	pthread_mutex_unlock(&(t->pending_lock));
+	for (e = 0; e < count; e++)
+		callbacks[e](nodes[e], args[e], NULL);
+}
+
+/* when (us on the clock of the transports) a call or the next round of
+ * stabilization of one of the nodes of `t' needs attention; 0 for none */
+long long transport_due(transport_t *t)
+{
+	int i;
+	pthread_mutex_lock(&(t->pending_lock));
+	long long due = t->next_deadline;
+	pthread_mutex_unlock(&(t->pending_lock));
+	for (i = 0; i < t->nnodes; i++)
+		if (!due || (t->nodes[i]->next_stabilize < due))
+			due = t->nodes[i]->next_stabilize;
+	return due;
+}
+
+/* how long (ms) the RPC thread may sleep before `t' is due */
+static int rpc_sleep(transport_t *t)
+{
+	long long due = transport_due(t), now = rpc_now();
+	return ((due > now) ? (int)((due - now + 999) / 1000) : 0);
+}
+
+
+/**
+ * RPC wrapper functions
+ */
+
+unsigned int rpc_get_status(node_t *n, chord_id_t id)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_GET_STATUS;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, 1000);
+	if (ack.type == MSG_GET_STATUS_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+int rpc_set_status(node_t *n, chord_id_t id, status_t status)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_SET_STATUS;
+	m.data[0] = status;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, -1);
+	if (ack.type == MSG_SET_STATUS_ACK)
+		ret = 1;
+	return ret;
+}
+
+chord_id_t rpc_get_successor(node_t *n, chord_id_t id)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_GET_SUCCESSOR;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, -1);
+	if (ack.type == MSG_GET_SUCCESSOR_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+int rpc_set_successor(node_t *n, chord_id_t id, chord_id_t successor)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_SET_SUCCESSOR;
+	m.data[0] = successor;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, -1);
+	if (ack.type == MSG_SET_SUCCESSOR_ACK)
+		ret = 1;
+	return ret;
+}
+
+chord_id_t rpc_get_predecessor(node_t *n, chord_id_t id)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_GET_PREDECESSOR;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, -1);
+	if (ack.type == MSG_GET_PREDECESSOR_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+int rpc_set_predecessor(node_t *n, chord_id_t id, chord_id_t predecessor)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_SET_PREDECESSOR;
+	m.data[0] = predecessor;
+	msg_t ack;
+	rpc_call(n, id, &m, &ack, -1);
+	if (ack.type == MSG_SET_PREDECESSOR_ACK)
+		ret = 1;
+	return ret;
+}
+
+chord_id_t rpc_get_closest_preceding_finger(node_t *n, chord_id_t node, chord_id_t id)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_GET_CLOSEST_PRECEDING_FINGER;
+	m.data[0] = id;
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, -1);
+	if (ack.type == MSG_GET_CLOSEST_PRECEDING_FINGER_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+chord_id_t rpc_find_predecessor(node_t *n, chord_id_t node, chord_id_t id)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_FIND_PREDECESSOR;
+	m.data[0] = id;
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, -1);
+	if (ack.type == MSG_FIND_PREDECESSOR_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+chord_id_t rpc_find_successor(node_t *n, chord_id_t node, chord_id_t id)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_FIND_SUCCESSOR;
+	m.data[0] = id;
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, -1);
+	if (ack.type == MSG_FIND_SUCCESSOR_ACK)
+		ret = ack.data[0];
+	return ret;
+}
+
+int rpc_find_next_hop(node_t *n, chord_id_t node, chord_id_t id, chord_id_t *successor, chord_id_t *next)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_FIND_NEXT_HOP;
+	m.data[0] = id;
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, -1);
+	if (ack.type == MSG_FIND_NEXT_HOP_ACK) {
+		*successor = ack.data[0];
+		*next = ack.data[1];
+		ret = 1;
+	}
+	return ret;
+}
+
+chord_id_t rpc_find_successor_recursive(node_t *n, chord_id_t node, chord_id_t id, chord_id_t *predecessor, unsigned int *hops)
+{
+	chord_id_t ret = 0;
+	msg_t m;
+	m.type = MSG_FIND_SUCCESSOR_RECURSIVE;
+	m.data[0] = id;
+	m.data[1] = 0;
+	m.count = 2;
+	m.batch[0] = ntohl(n->transport->client.addr.sin_addr.s_addr);
+	m.batch[1] = ntohs(n->transport->client.addr.sin_port);
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, RPC_TIMEOUT);
+	if (ack.type == MSG_FIND_SUCCESSOR_RECURSIVE_ACK) {
+		ret = ack.data[0];
+		*predecessor = ((ack.count > 0) ? ack.batch[0] : node);
+		*hops = (unsigned int)ack.data[1] + 1;
+	}
+	return ret;
+}
+
+int rpc_notify(node_t *n, chord_id_t node, chord_id_t id)
+{
+	unsigned int ret = 0;
+	msg_t m;
+	m.type = MSG_NOTIFY;
+	m.data[0] = id;
+	msg_t ack;
+	rpc_call(n, node, &m, &ack, -1);
+	if (ack.type == MSG_NOTIFY_ACK)
+		ret = 1;
+	return ret;
+}
+
+/*
+ * Scrapes the metrics of the process node `id' runs in into `s', a page of
+ * them per call; each page is taken when it is asked for.  Returns 1 on
+ * success, 0 if `id' did not answer.
+ */
+int rpc_get_stats(node_t *n, chord_id_t id, stats_t *s)
+{
+	unsigned long long *w = (unsigned long long *)s;
+	size_t words = sizeof(stats_t) / sizeof(unsigned long long), word = 0;
+	unsigned long long index, value;
+	int i, a, b;
+	msg_t m, ack;
+	memset(s, 0, sizeof(stats_t));
+	while (word < words) {
+		m.type = MSG_GET_STATS;
+		m.data[0] = word;
+		rpc_call(n, id, &m, &ack, -1);
+		if ((ack.type != MSG_GET_STATS_ACK) || (ack.data[0] <= word))
+			return 0;
+		for (i = 0; (a = wire_get(&(ack.payload[i]), ack.count - i, &index)) && (b = wire_get(&(ack.payload[i + a]), ack.count - i - a, &value)); i += a + b)
+			if (index < words)
+				w[index] = value;
+		word = ack.data[0];
+	}
+	return 1;
+}
+
+/**
+ * RPC server
+ */
+
+static rpc_replay_t *rpc_replay_slot(transport_t *t, inet_host_t *from, unsigned int rid)
+{
+	unsigned int h = from->addr.sin_addr.s_addr ^ from->addr.sin_port ^ (rid * 2654435761u);
+	return &(t->replay[(h ^ (h >> 16)) % t->replay_size]);
+}
+
+/*
+ * Whether `m' from `from' is a retransmission of a request the server has
+ * already seen.  The first copy is remembered; later ones are dropped while
+ * it is being served, and answered again from the remembered acknowledgement
+ * once it has been.
+ */
+static int rpc_replayed(transport_t *t, inet_host_t *from, msg_t *m)
+{
+	rpc_replay_t *e = rpc_replay_slot(t, from, m->rid);
+	if (e->rid && (e->rid == m->rid) && (e->addr == from->addr.sin_addr.s_addr) && (e->port == from->addr.sin_port)) {
+		if (e->answered)
+			transport_send(t, &(t->server), from, &(e->ack));
+		return 1;
+	}
+	e->addr = from->addr.sin_addr.s_addr;
+	e->port = from->addr.sin_port;
+	e->rid = m->rid;
+	e->answered = 0;
+	return 0;
+}
+
+/* sends `ack' to `to' and remembers it in case the request is retransmitted */
+static void rpc_answer(node_t *n, inet_host_t *to, msg_t *ack)
+{
+	transport_t *t = n->transport;
+	rpc_replay_t *e = rpc_replay_slot(t, to, ack->rid);
+	rpc_address(t, ack);
+	transport_send(t, &(t->server), to, ack);
+	TRACE(TRACE_MESSAGES, TRACE_ANSWER, n->id, 0, to, ack);
+	if ((e->rid == ack->rid) && (e->addr == to->addr.sin_addr.s_addr) && (e->port == to->addr.sin_port)) {
+		memcpy(&(e->ack), ack, msg_size(ack));
+		e->answered = 1;
+	}
+}
+
+static rpc_request_t *rpc_request_new(node_t *n, msg_t *m, inet_host_t *from)
+{
+	rpc_request_t *r = n->transport->free_requests;
+	if (r)
+		n->transport->free_requests = r->next;
+	else {
+		r = malloc(sizeof(rpc_request_t));
+		r->batch = NULL;
+	}
+	r->state = RQ_NEW;
+	r->m = *m;
+	r->from = *from;
+	r->i = n->id;
+	return r;
+}
+
+static void rpc_request_free(node_t *n, rpc_request_t *r)
+{
+	r->next = n->transport->free_requests;
+	n->transport->free_requests = r;
+}
+
+static void rpc_reply(node_t *n, rpc_request_t *r, chord_id_t data)
+{
+	msg_t ack;
+	ack.type = r->m.type + 1;
+	ack.rid = r->m.rid;
+	ack.data[0] = data;
+	rpc_answer(n, &(r->from), &ack);
+	rpc_request_free(n, r);
+}
+
+static void rpc_step(node_t *, rpc_request_t *, msg_t *);
+
+static void rpc_resume(node_t *n, void *arg, msg_t *ack)
+{
+	rpc_request_t *r = (rpc_request_t *)arg;
+	if (ack)
+		rpc_step(n, r, ack);
+	else
+		rpc_reply(n, r, 0);
+}
+
+/*
+ * Makes a nested call to node `id' on behalf of `r' and parks the request in
+ * `state' until the acknowledgement arrives.  The server goes back to
+ * serving other requests in the meantime.
+ */
+static void rpc_suspend(node_t *n, rpc_request_t *r, rpc_state_t state, chord_id_t id, msg_type_t type, chord_id_t d0, chord_id_t d1)
+{
+	msg_t m;
+	m.type = type;
+	m.data[0] = d0;
+	m.data[1] = d1;
+	r->state = state;
+	if (rpc_call_async(n, id, &m, RPC_TIMEOUT, rpc_resume, r) < 0)
+		rpc_reply(n, r, 0);
+}
+
+/*
+ * The find_predecessor loop, starting from hop `r->i' whose successor is
+ * `successor' and whose closest preceding finger is `next'.
+ */
+static void rpc_walk(node_t *n, rpc_request_t *r, chord_id_t successor, chord_id_t next)
+{
+	chord_id_t id = r->m.data[0];
+	while (!in_range_ex_in_circular(r->i, successor, id)) {
+		chord_id_t p;
+		r->i = next;
+		if (r->i != n->id) {
+			rpc_suspend(n, r, RQ_NEXT_HOP, r->i, MSG_FIND_NEXT_HOP, id, 0);
+			return;
+		}
+		route_local(n, id, &p, &successor, &next);
+	}
+	rpc_reply(n, r, ((r->m.type == MSG_FIND_PREDECESSOR) ? r->i : successor));
+}
+
+/* advances `r' after it was created or after `ack' arrived for it */
+static void rpc_step(node_t *n, rpc_request_t *r, msg_t *ack)
+{
+	chord_id_t id = r->m.data[0], owner, p, successor, next;
+	switch (r->state) {
+		case RQ_NEW:
+			owner = route_local(n, id, &p, &successor, &next);
+			switch (r->m.type) {
+				case MSG_FIND_SUCCESSOR:
+					if (owner)
+						rpc_reply(n, r, owner);
+					else
+						rpc_walk(n, r, successor, next);
+					break;
+				case MSG_FIND_PREDECESSOR:
+					if (in_range_in_ex_circular(n->id, successor, id))
+						rpc_reply(n, r, n->id);
+					else
+						rpc_walk(n, r, successor, next);
+					break;
+				default:
+					rpc_reply(n, r, 0);
+			}
+			break;
+		case RQ_NEXT_HOP:
+			rpc_walk(n, r, ack->data[0], ack->data[1]);
+			break;
+		/* these finish in batch_done and kv_replicated, never through here */
+		case RQ_BATCH:
+		case RQ_REPLICATE:
+			break;
+	}
+}
+
+/**
+ * batched lookups
+ */
+
+static lookup_batch_t *batch_new(size_t capacity)
+{
+	size_t nparts = (capacity / BATCH_KEYS) + KEYSPACE + 1;
+	lookup_batch_t *b = malloc(sizeof(lookup_batch_t) + (nparts * sizeof(batch_part_t)) + (2 * capacity * sizeof(chord_id_t)) + (capacity * sizeof(unsigned int)));
+	b->parts = (batch_part_t *)(b + 1);
+	b->owners = (chord_id_t *)(b->parts + nparts);
+	b->next = b->owners + capacity;
+	b->hops = (unsigned int *)(b->next + capacity);
+	b->r = NULL;
+	pthread_mutex_init(&(b->lock), NULL);
+	pthread_cond_init(&(b->cond), NULL);
+	return b;
+}
+
+static void batch_free(lookup_batch_t *b)
+{
+	pthread_cond_destroy(&(b->cond));
+	pthread_mutex_destroy(&(b->lock));
+	free(b);
+}
+
+/* answers the request an intermediate hop was resolving `b' for */
+static void batch_reply(node_t *n, lookup_batch_t *b)
+{
+	rpc_request_t *r = b->r;
+	msg_t ack;
+	size_t i;
+	ack.type = MSG_FIND_SUCCESSOR_BATCH_ACK;
+	ack.rid = r->m.rid;
+	ack.count = 0;
+	for (i = 0; i < b->count; i++) {
+		ack.batch[ack.count++] = b->owners[i];
+		ack.batch[ack.count++] = b->hops[i];
+	}
+	rpc_answer(n, &(r->from), &ack);
+	rpc_request_free(n, r);
+}
+
+static void batch_release(node_t *n, lookup_batch_t *b)
+{
+	pthread_mutex_lock(&(b->lock));
+	int last = !--(b->outstanding);
+	int reply = (b->r != NULL);
+	if (last && !reply)
+		n->transport->ops->signal(&(b->cond));
+	pthread_mutex_unlock(&(b->lock));
+	if (last && reply)
+		batch_reply(n, b);
+}
+
+static void batch_done(node_t *n, void *arg, msg_t *ack)
+{
+	batch_part_t *part = (batch_part_t *)arg;
+	lookup_batch_t *b = part->b;
+	unsigned int t = 0;
+	size_t i;
+	for (i = part->first; t < part->count; i++) {
+		if (b->next[i] != part->node)
+			continue;
+		if (ack && (((2 * t) + 1) < ack->count)) {
+			b->owners[i] = ack->batch[2 * t];
+			b->hops[i] = (unsigned int)ack->batch[(2 * t) + 1] + 1;
+		}
+		else {
+			b->owners[i] = 0;
+			pthread_mutex_lock(&(b->lock));
+			b->failed++;
+			pthread_mutex_unlock(&(b->lock));
+		}
+		t++;
+	}
+	batch_release(n, b);
+}
+
+static void batch_send(node_t *n, batch_part_t *part)
+{
+	lookup_batch_t *b = part->b;
+	msg_t m;
+	size_t i;
+	m.type = MSG_FIND_SUCCESSOR_BATCH;
+	m.count = 0;
+	for (i = part->first; m.count < part->count; i++)
+		if (b->next[i] == part->node)
+			m.batch[m.count++] = b->ids[i];
+	if (rpc_call_async(n, part->node, &m, RPC_TIMEOUT, batch_done, part) < 0)
+		batch_done(n, part, NULL);
+}
+
+/*
+ * Resolves the keys of `b' that this node knows the owner of, and sends the
+ * rest on in one message per next hop (split into BATCH_KEYS keys at most),
+ * where the same happens recursively.  Completes once every part has been
+ * answered.
+ */
+static void batch_route(node_t *n, lookup_batch_t *b)
+{
+	chord_id_t nodes[KEYSPACE];
+	int nnodes = 0, nparts = 0, k;
+	size_t i;
+
+	b->outstanding = 1;
+	b->failed = 0;
+	for (i = 0; i < b->count; i++) {
+		chord_id_t id = b->ids[i], p, successor, hop;
+		b->hops[i] = 0;
+		b->next[i] = n->id;
+		if (!(b->owners[i] = route_local(n, id, &p, &successor, &hop))) {
+			b->next[i] = hop;
+			for (k = 0; (k < nnodes) && (nodes[k] != hop); k++);
+			if (k == nnodes)
+				nodes[nnodes++] = hop;
+		}
+	}
+
+	for (k = 0; k < nnodes; k++) {
+		batch_part_t *part = NULL;
+		for (i = 0; i < b->count; i++) {
+			if (b->next[i] != nodes[k])
+				continue;
+			if (!part || (part->count == BATCH_KEYS)) {
+				part = &(b->parts[nparts++]);
+				part->b = b;
+				part->node = nodes[k];
+				part->first = i;
+				part->count = 0;
+			}
+			part->count++;
+		}
+	}
+
+	pthread_mutex_lock(&(b->lock));
+	b->outstanding += nparts;
+	pthread_mutex_unlock(&(b->lock));
+	for (k = 0; k < nparts; k++)
+		batch_send(n, &(b->parts[k]));
+	batch_release(n, b);
+}
+
+static void rpc_batch(node_t *n, rpc_request_t *r)
+{
+	if (!r->batch)
+		r->batch = batch_new(BATCH_KEYS);
+	r->batch->ids = r->m.batch;
+	r->batch->count = ((r->m.count < BATCH_KEYS) ? r->m.count : BATCH_KEYS);
+	r->batch->r = r;
+	r->state = RQ_BATCH;
+	batch_route(n, r->batch);
+}
+
+/*
+ * One hop of a recursive lookup: answers the originator directly if the
+ * owner of the key is known here, and passes the query on otherwise.
+ */
+static void rpc_recurse(node_t *n, msg_t *m)
+{
+	chord_id_t id = m->data[0], owner, predecessor, successor, next;
+	if (m->count < 2)
+		return;
+	if ((owner = route_local(n, id, &predecessor, &successor, &next))) {
+		if (owner != n->id)
+			predecessor = n->id;
+	}
+	else {
+		inet_host_t remote;
+		if (rpc_peer(n->transport, next, &remote)) {
+			m->to = next;
+			m->data[1]++;
+			transport_send(n->transport, &(n->transport->server), &remote, m);
+			TRACE(TRACE_MESSAGES, TRACE_FORWARD, n->id, next, &remote, m);
+			return;
+		}
+		/* the next hop has no known endpoint: the lookup fails at once, as
+		 * rpc_reply(n, r, 0) makes an iterative one */
+		predecessor = 0;
+	}
+	inet_host_t origin;
+	struct in_addr in = { htonl((unsigned int)m->batch[0]) };
+	msg_t ack;
+	inet_setup(&origin, IN_PROT_UDP, in, (unsigned short)m->batch[1]);
+	ack.type = MSG_FIND_SUCCESSOR_RECURSIVE_ACK;
+	ack.rid = m->rid;
+	ack.data[0] = owner;
+	ack.data[1] = m->data[1];
+	ack.count = 1;
+	ack.batch[0] = predecessor;
+	rpc_address(n->transport, &ack);
+	transport_send(n->transport, &(n->transport->server), &origin, &ack);
+}
+
+/**
+ * replicated writes
+ *
+ * The owner of a key copies every put and delete to the first `replicas'
+ * nodes of its successor list, and answers the writer once all of them have
+ * taken it (or timed out), so that a read from any of them sees the write.
+ */
+
+static void kv_replicated(node_t *n, void *arg, msg_t *ack)
+{
+	rpc_request_t *r = (rpc_request_t *)arg;
+	msg_t done;
+	if (--r->outstanding)
+		return;
+	done.type = r->m.type + 1;
+	done.rid = r->m.rid;
+	done.data[0] = r->i;
+	done.data[1] = n->id;
+	done.count = 0;
+	rpc_answer(n, &(r->from), &done);
+	rpc_request_free(n, r);
+}
+
+/*
+ * Copies the write `m' from `from', which `n' has carried out with `ack' as
+ * the outcome, to the replicas of the key if `n' owns it, and answers once
+ * they have it.  Returns 0 if there is nothing to copy, and the caller
+ * answers right away.
+ */
+static int kv_replicate(node_t *n, msg_t *m, msg_t *ack, inet_host_t *from)
+{
+	chord_id_t list[SUCCESSORS];
+	int count, i;
+	if ((n->replicas <= 0) || (ack->data[1] != n->id) || !(count = route_successors(n, list)))
+		return 0;
+	rpc_request_t *r = rpc_request_new(n, m, from);
+	r->state = RQ_REPLICATE;
+	r->i = ack->data[0];
+	r->outstanding = 1;
+	for (i = 0; (i < count) && (i < n->replicas); i++) {
+		msg_t copy;
+		memcpy(&copy, m, msg_size(m));
+		copy.type = ((m->type == MSG_PUT) ? MSG_PUT_REPLICA : MSG_DEL_REPLICA);
+		if (rpc_call_async(n, list[i], &copy, RPC_TIMEOUT, kv_replicated, r) == 0)
+			r->outstanding++;
+	}
+	kv_replicated(n, r, NULL);
+	return 1;
+}
+
+
+/**
+ * stabilization
+ *
+ * Every node periodically checks that its successor has not gained a closer
+ * predecessor (stabilize), tells the successor about itself (notify), fixes
+ * one finger table entry (fix_fingers) and checks that its predecessor is
+ * still up (check_predecessor).  All of it runs on the RPC thread, with
+ * nested calls made asynchronously.
+ */
+
+/* makes `id' the successor; the successor list goes on from `id' if it was
+ * on it, and starts over from it otherwise */
+static void set_successor(node_t *n, chord_id_t id)
+{
+	int i;
+	location_invalidate(n, n->successor);
+	route_begin(n);
+	n->successor = id;
+	n->finger_table[0].successor = id;
+	for (i = 0; (i < n->nsuccessors) && (n->successors[i] != id); i++);
+	if (i < n->nsuccessors) {
+		n->nsuccessors -= i;
+		memmove(n->successors, n->successors + i, n->nsuccessors * sizeof(chord_id_t));
+	}
+	else {
+		n->successors[0] = id;
+		n->nsuccessors = (id != n->id);
+	}
+	finger_index(n);
+	route_end(n);
+	location_invalidate(n, id);
+}
+
+/* the endpoints of the successor list of `n' in `e', as many as a node
+ * asking keeps after its own successor; returns how many */
+static int successor_endpoints(node_t *n, endpoint_t *e)
+{
+	chord_id_t list[SUCCESSORS];
+	int count = route_successors(n, list), i, known = 0;
+	for (i = 0; (i < count) && (known < SUCCESSORS - 1); i++)
+		known += triad_endpoint(n, list[i], &(e[known]));
+	return known;
+}
+
+/* continues the successor list with the one the successor sent in `ack',
+ * up to where it wraps around to `n' */
+static void successor_list(node_t *n, msg_t *ack)
+{
+	endpoint_t *e = (endpoint_t *)ack->payload;
+	int i;
+	route_begin(n);
+	n->successors[0] = n->successor;
+	n->nsuccessors = 1;
+	for (i = 0; (i < (int)ack->count) && (e[i].id != n->id) && (n->nsuccessors < SUCCESSORS); i++)
+		n->successors[n->nsuccessors++] = e[i].id;
+	route_end(n);
+}
+
+/* takes `id' as predecessor if it is closer than the current one */
+static void notify(node_t *n, chord_id_t id)
+{
+	if ((n->status != ST_CONNECTED) || !id || (id == n->id))
+		return;
+	if (!n->predecessor || in_range_ex_ex_circular(n->predecessor, n->id, id)) {
+		location_invalidate(n, n->predecessor);
+		route_begin(n);
+		n->predecessor = id;
+		route_end(n);
+	}
+}
+
+static void stabilize_ignore(node_t *n, void *arg, msg_t *ack)
+{
+}
+
+/* replaces the fingers on `id', which stopped answering, by `next' */
+static void finger_failed(node_t *n, chord_id_t id, chord_id_t next)
+{
+	int f;
+	route_begin(n);
+	for (f = 1; f < KEYSPACE; f++)
+		if (n->finger_table[f].successor == id)
+			n->finger_table[f].successor = next;
+	finger_index(n);
+	route_end(n);
+	location_invalidate(n, id);
+}
+
+static void stabilize_done(node_t *, void *, msg_t *);
+
+/*
+ * Adopts `x', the predecessor of the successor, if it sits in between, and
+ * asks it in turn right away; a node that has just learnt of a whole stretch
+ * of the ring would otherwise only get one step closer per round.  Notifies
+ * the successor once it has settled.
+ */
+static void stabilize_adopt(node_t *n, chord_id_t x)
+{
+	msg_t m;
+	if (x && (x != n->id) && in_range_ex_ex_circular(n->id, n->successor, x)) {
+		set_successor(n, x);
+		m.type = MSG_GET_PREDECESSOR;
+		rpc_call_async(n, x, &m, -1, stabilize_done, (void *)(size_t)x);
+		return;
+	}
+	if (n->successor == n->id)
+		return;
+	m.type = MSG_NOTIFY;
+	m.data[0] = n->id;
+	rpc_call_async(n, n->successor, &m, -1, stabilize_ignore, NULL);
+}
+
+static void stabilize_done(node_t *n, void *arg, msg_t *ack)
+{
+	chord_id_t successor = (chord_id_t)(size_t)arg, next = n->id;
+	int f;
+	if ((n->status != ST_CONNECTED) || (successor != n->successor))
+		return;
+	if (ack) {
+		successor_list(n, ack);
+		stabilize_adopt(n, ack->data[0]);
+		return;
+	}
+	/* fall back on the next node of the successor list, else on the
+	 * closest finger that is not the successor; with neither, the
+	 * predecessor gets adopted in the next round */
+	for (f = 1; (f < n->nsuccessors) && (next == n->id); f++)
+		if (n->successors[f] != successor)
+			next = n->successors[f];
+	for (f = 1; (f < KEYSPACE) && (next == n->id); f++)
+		if (n->finger_table[f].successor != successor)
+			next = n->finger_table[f].successor;
+	finger_failed(n, successor, next);
+	set_successor(n, next);
+}
+
+/*
+ * Sets finger `f' to `successor', along with the fingers after it whose
+ * start also falls before `successor' and so have the same successor.
+ */
+static void fix_finger(node_t *n, int f, chord_id_t successor)
+{
+	chord_id_t start = n->finger_table[f].start, replaced[KEYSPACE];
+	int count = 0, i;
+	route_begin(n);
+	for (; (f < KEYSPACE) && ((n->finger_table[f].start - start) <= (successor - start)); f++)
+		if (n->finger_table[f].successor != successor) {
+			replaced[count++] = n->finger_table[f].successor;
+			n->finger_table[f].successor = successor;
+		}
+	if (count)
+		finger_index(n);
+	route_end(n);
+	for (i = 0; i < count; i++)
+		location_invalidate(n, replaced[i]);
+	n->next_finger = f;
+}
+
+/*
+ * With n->proximity, finger `f' may be any node in its interval rather than
+ * the first, `list[0]'; the ones after it, in `list' up to `count', are the
+ * candidates.  Returns the one with the lowest round-trip time, probing the
+ * ones not measured yet so that they count the next time around.
+ */
+static chord_id_t finger_nearest(node_t *n, int f, const chord_id_t *list, int count)
+{
+	finger_t *finger = &(n->finger_table[f]);
+	chord_id_t best = list[0];
+	long long lowest = 0, rtt;
+	int i;
+	for (i = 0; (i < count) && (list[i] != n->id) && in_range_in_ex_circular(finger->start, finger->end, list[i]); i++) {
+		if (!(rtt = rpc_rtt(n->transport, list[i]))) {
+			msg_t m;
+			m.type = MSG_GET_STATUS;
+			rpc_call_async(n, list[i], &m, -1, stabilize_ignore, NULL);
+		}
+		else if ((rtt > 0) && (!lowest || (rtt < lowest))) {
+			best = list[i];
+			lowest = rtt;
+		}
+	}
+	return best;
+}
+
+/* picks finger `f' among the node that answered `ack' and its successor
+ * list (see finger_nearest) */
+static void fix_nearest(node_t *n, void *arg, msg_t *ack)
+{
+	int f = (int)(size_t)arg, count = 1, i;
+	chord_id_t list[SUCCESSORS];
+	if ((n->status != ST_CONNECTED) || !ack)
+		return;
+	list[0] = ack->data[1];
+	for (i = 0; (i < (int)ack->count) && (count < SUCCESSORS); i++)
+		list[count++] = ((endpoint_t *)ack->payload)[i].id;
+	fix_finger(n, f, finger_nearest(n, f, list, count));
+}
+
+static void fix_done(node_t *n, void *arg, msg_t *ack)
+{
+	int f = (int)(size_t)arg;
+	if (n->status != ST_CONNECTED)
+		return;
+	if (ack && ack->data[0]) {
+		/* the other candidates are on the successor list of the first */
+		if (n->proximity && in_range_in_ex_circular(n->finger_table[f].start, n->finger_table[f].end, ack->data[0])) {
+			msg_t m;
+			m.type = MSG_GET_PREDECESSOR;
+			if (!rpc_call_async(n, ack->data[0], &m, -1, fix_nearest, arg))
+				return;
+		}
+		fix_finger(n, f, ack->data[0]);
+		return;
+	}
+	chord_id_t hop = closest_preceding_finger(n, n->finger_table[f].start);
+	if ((hop != n->id) && (hop != n->successor))
+		finger_failed(n, hop, n->successor);
+	n->next_finger = f + 1;
+}
+
+static void fix_fingers(node_t *n)
+{
+	int f = n->next_finger;
+	if ((f < 1) || (f >= KEYSPACE))
+		f = 1;
+	chord_id_t start = n->finger_table[f].start, hop, list[SUCCESSORS];
+	if (in_range_ex_in_circular(n->id, n->successor, start) || ((hop = closest_preceding_finger(n, start)) == n->id)) {
+		int count = route_successors(n, list);
+		fix_finger(n, f, ((n->proximity && count) ? finger_nearest(n, f, list, count) : n->successor));
+	}
+	else {
+		msg_t m;
+		m.type = MSG_FIND_SUCCESSOR;
+		m.data[0] = start;
+		if (rpc_call_async(n, hop, &m, -1, fix_done, (void *)(size_t)f) < 0)
+			n->next_finger = f + 1;
+	}
+}
+
+static void check_done(node_t *n, void *arg, msg_t *ack)
+{
+	chord_id_t predecessor = (chord_id_t)(size_t)arg;
+	if ((n->predecessor == predecessor) && (!ack || (ack->data[0] != ST_CONNECTED))) {
+		location_invalidate(n, predecessor);
+		route_begin(n);
+		n->predecessor = 0;
+		route_end(n);
+	}
+}
+
+/* one round of stabilization */
+static void stabilize(node_t *n)
+{
+	msg_t m;
+	if (n->status != ST_CONNECTED)
+		return;
+	if (n->successor == n->id)
+		stabilize_adopt(n, n->predecessor);
+	else {
+		m.type = MSG_GET_PREDECESSOR;
+		rpc_call_async(n, n->successor, &m, -1, stabilize_done, (void *)(size_t)n->successor);
+	}
+	fix_fingers(n);
+	if (n->predecessor && (n->predecessor != n->id)) {
+		m.type = MSG_GET_STATUS;
+		rpc_call_async(n, n->predecessor, &m, -1, check_done, (void *)(size_t)n->predecessor);
+	}
+}
+
+/* schedules the next round `stabilize_interval' ms from now, give or take
+ * `stabilize_jitter' percent so that nodes do not fall into lockstep */
+static void stabilize_schedule(node_t *n)
+{
+	long long interval = n->stabilize_interval * 1000LL;
+	int jitter = n->stabilize_jitter;
+	if (jitter > 0)
+		interval += (interval * ((rand_r(&(n->seed)) % (2 * jitter + 1)) - jitter)) / 100;
+	n->next_stabilize = rpc_now() + interval;
+}
+
+/* makes the RPC thread run a round right away */
+static void stabilize_soon(node_t *n)
+{
+	n->next_stabilize = 0;
+	n->transport->ops->wake(n->transport);
+}
+
+/* the node of `t' that is `id', or NULL */
+static node_t *rpc_node(transport_t *t, chord_id_t id)
+{
+	int i;
+	for (i = 0; i < t->nnodes; i++)
+		if (t->nodes[i]->id == id)
+			return t->nodes[i];
+	return NULL;
+}
+
+/* takes `n' off `t', abandoning the calls it still has outstanding other
+ * than `keep' */
+static void rpc_detach(transport_t *t, node_t *n, unsigned int keep)
+{
+	int i;
+	for (i = 0; t->nodes[i] != n; i++);
+	memmove(&(t->nodes[i]), &(t->nodes[i + 1]), (t->nnodes - i - 1) * sizeof(node_t *));
+	t->nnodes--;
+	rpc_expire(t, n, keep);
+}
+
+/* serves the request `m' from `remote'; returns 0 once the last node has
+ * quit */
+static int rpc_handle(transport_t *t, inet_host_t *remote, msg_t *m)
+{
+	node_t *n;
+	msg_t ack;
+	/* datagrams for nodes that are not (or no longer) here go unanswered,
+	 * like those for a host that is down */
+	if (!(n = rpc_node(t, m->to)))
+		return 1;
+	n->messages++;
+	TRACE(TRACE_MESSAGES, TRACE_SERVE, n->id, 0, remote, m);
+	/* recursive lookups are answered by another node, and may be resent
+	 * through this one at will */
+	if ((m->type != MSG_FIND_SUCCESSOR_RECURSIVE) && rpc_replayed(t, remote, m))
+		return 1;
+	rpc_learn(t, m);
+	ack.rid = m->rid;
+	switch (m->type) {
+		case MSG_QUIT:
+			{
+				rpc_detach(t, n, m->rid);
+				ack.type = MSG_QUIT_ACK;
+				ack.data[0] = !t->nnodes;
+				rpc_answer(n, remote, &ack);
+				if (!t->nnodes)
+					return 0;
+				break;
+			}
+		case MSG_GET_STATUS:
+			{
+				ack.type = MSG_GET_STATUS_ACK;
+				ack.data[0] = n->status;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_SET_STATUS:
+			{
+				n->status = m->data[0];
+				ack.type = MSG_SET_STATUS_ACK;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_GET_SUCCESSOR:
+			{
+				ack.type = MSG_GET_SUCCESSOR_ACK;
+				ack.data[0] = n->successor;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_SET_SUCCESSOR:
+			{
+				set_successor(n, m->data[0]);
+				ack.type = MSG_SET_SUCCESSOR_ACK;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_GET_PREDECESSOR:
+			{
+				ack.type = MSG_GET_PREDECESSOR_ACK;
+				ack.data[0] = n->predecessor;
+				ack.data[1] = n->id;
+				ack.count = successor_endpoints(n, (endpoint_t *)ack.payload);
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_SET_PREDECESSOR:
+			{
+				location_invalidate(n, n->predecessor);
+				route_begin(n);
+				n->predecessor = m->data[0];
+				route_end(n);
+				location_invalidate(n, n->predecessor);
+				ack.type = MSG_SET_PREDECESSOR_ACK;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_GET_CLOSEST_PRECEDING_FINGER:
+			{
+				ack.type = MSG_GET_CLOSEST_PRECEDING_FINGER_ACK;
+				ack.data[0] = closest_preceding_finger(n, m->data[0]);
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_FIND_NEXT_HOP:
+			{
+				chord_id_t p;
+				ack.type = MSG_FIND_NEXT_HOP_ACK;
+				route_local(n, m->data[0], &p, &(ack.data[0]), &(ack.data[1]));
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_FIND_SUCCESSOR_RECURSIVE:
+			rpc_recurse(n, m);
+			break;
+		case MSG_FIND_SUCCESSOR:
+			rpc_step(n, rpc_request_new(n, m, remote), NULL);
+			break;
+		case MSG_FIND_PREDECESSOR:
+			rpc_step(n, rpc_request_new(n, m, remote), NULL);
+			break;
+		case MSG_NOTIFY:
+			{
+				notify(n, m->data[0]);
+				ack.type = MSG_NOTIFY_ACK;
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+		case MSG_FIND_SUCCESSOR_BATCH:
+			rpc_batch(n, rpc_request_new(n, m, remote));
+			break;
+		case MSG_PUT:
+			kv_serve(n, m, &ack);
+			if (!kv_replicate(n, m, &ack, remote))
+				rpc_answer(n, remote, &ack);
+			break;
+		case MSG_GET:
+			kv_serve(n, m, &ack);
+			rpc_answer(n, remote, &ack);
+			break;
+		case MSG_DEL:
+			kv_serve(n, m, &ack);
+			if (!kv_replicate(n, m, &ack, remote))
+				rpc_answer(n, remote, &ack);
+			break;
+		case MSG_PUT_REPLICA:
+			kv_serve(n, m, &ack);
+			rpc_answer(n, remote, &ack);
+			break;
+		case MSG_GET_REPLICA:
+			kv_serve(n, m, &ack);
+			rpc_answer(n, remote, &ack);
+			break;
+		case MSG_DEL_REPLICA:
+			kv_serve(n, m, &ack);
+			rpc_answer(n, remote, &ack);
+			break;
+		case MSG_GET_STATS:
+			{
+				stats_t stats;
+				stats_collect(&stats);
+				stats_page(&stats, m->data[0], &ack);
+				rpc_answer(n, remote, &ack);
+				break;
+			}
+	}
+	return 1;
+}
+
+/* serves every datagram waiting on the server socket; returns 0 once the
+ * last node has quit */
+static int rpc_serve(transport_t *t)
+{
+	return rpc_drain(t, &(t->server));
+}
+
+/*
+ * Handles the messages of the datagram of `size' bytes at `data' that
+ * reached `t' from `from', at its server address if `local' is &t->server
+ * and at its client address otherwise, as its RPC thread would; frames from
+ * the first malformed one on are dropped.  What they make `t' send is
+ * gathered until the end (see transport_gather).  For drivers of transports
+ * that carry datagrams themselves.  Returns 0 once the last node of `t' has
+ * quit, after which the driver calls transport_tick once more.
+ */
+int transport_receive(transport_t *t, inet_host_t *local, inet_host_t *from, const void *data, int size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	int gathering = transport_gather(t), running = 1, used;
+	msg_t m;
+	for (; running && (size > 0) && (used = msg_decode(p, size, &m)); p += used, size -= used) {
+		if (!m.type)
+			continue;
+		stats_count(m.type, STATS_RECEIVED);
+		stats_bytes(1, used);
+		if (local != &(t->server))
+			rpc_deliver(t, from, &m);
+		else
+			running = rpc_handle(t, from, &m);
+	}
+	transport_flush(t, gathering);
+	return running;
+}
+
+/*
+ * Retransmits and times out calls as they come due, and runs the rounds of
+ * stabilization that are due; once `t' has no nodes left, gives up on all
+ * its calls.  Returns transport_due.
+ */
+long long transport_tick(transport_t *t)
+{
+	int gathering = transport_gather(t), i;
+	rpc_expire(t, NULL, 0);
+	for (i = 0; i < t->nnodes; i++) {
+		node_t *n = t->nodes[i];
+		if (rpc_now() >= n->next_stabilize) {
+			stabilize(n);
+			stabilize_schedule(n);
+		}
+	}
+	transport_flush(t, gathering);
+	return transport_due(t);
+}
+
+enum { EV_SERVER, EV_CLIENT, EV_WAKE, EV_BELL };
+
+static int shm_idle(shm_ring_t *);
+static int shm_serve(transport_t *, int);
+
+void *rpc_handler(void *data)
+{
+	transport_t *t = (transport_t *)data;
+	struct epoll_event events[RPC_EVENTS];
+	uint64_t wakeups;
+	char bells[64];
+	int running = 1, gathering, busy = transport_busy_poll;
+	long long active = rpc_now();
+	t->rx = malloc(RPC_BATCH * WIRE_DATAGRAM);
+	while (running) {
+		int timeout = rpc_sleep(t);
+		/* with busy polling, only sleep once nothing came for a while */
+		if (timeout && busy && ((rpc_now() - active) < busy))
+			timeout = 0;
+		else if (timeout && t->inbox && !shm_idle(t->inbox))
+			timeout = 0;
+		int e, count = epoll_wait(t->epfd, events, RPC_EVENTS, timeout);
+		if (count > 0)
+			active = rpc_now();
+		if (t->inbox)
+			__atomic_store_n(&(t->inbox->sleeping), 0, __ATOMIC_RELAXED);
+		gathering = transport_gather(t);
+		for (e = 0; (e < count) && running; e++) {
+			switch (events[e].data.u32) {
+				case EV_SERVER:
+					running = rpc_serve(t);
+					break;
+				case EV_CLIENT:
+					rpc_complete(t);
+					break;
+				case EV_WAKE:
+					read(t->wakefd, &wakeups, sizeof(wakeups));
+					break;
+				case EV_BELL:
+					while (read(t->bellfd, bells, sizeof(bells)) > 0);
+					break;
+			}
+		}
+		if (running && t->inbox)
+			running = shm_serve(t, 1);
+		transport_tick(t);
+		transport_flush(t, gathering);
+	}
+
+	/* deliver what already arrived (such as our own MSG_QUIT_ACK), then
+	 * abandon everything else */
+	gathering = transport_gather(t);
+	rpc_complete(t);
+	if (t->inbox)
+		shm_serve(t, 0);
+	transport_tick(t);
+	transport_flush(t, gathering);
+	free(outbox_mine);
+	outbox_mine = NULL;
+	free(t->rx);
+	t->rx = NULL;
+	return NULL;
+}
+
+/**
+ * key migration
+ */
+
+/* a connection keys stream over, with writes gathered into MIGRATE_BUFFER
+ * bytes; `ok' drops to 0 once a write fails */
+typedef struct migrate_stream {
+	inet_host_t *local;
+	inet_host_t *remote;
+	unsigned char *buf;
+	size_t used;
+	int ok;
+} migrate_stream_t;
+
+/* sends all `len' bytes at `data' on the connection to `remote' */
+static int migrate_write(inet_host_t *local, inet_host_t *remote, const void *data, size_t len)
+{
+	while (len > 0) {
+		int size = inet_send(local, remote, (void *)data, len);
+		if (size <= 0)
+			return 0;
+		data = (const unsigned char *)data + size;
+		len -= size;
+	}
+	return 1;
+}
+
+/* receives exactly `len' bytes from `remote' into `data', waiting at most
+ * `timeout' seconds for each part */
+static int migrate_read(inet_host_t *remote, inet_host_t *local, void *data, size_t len, int timeout)
+{
+	while (len > 0) {
+		int size = inet_receive(remote, local, data, len, timeout);
+		if (size <= 0)
+			return 0;
+		data = (unsigned char *)data + size;
+		len -= size;
+	}
+	return 1;
+}
+
+static void migrate_flush(migrate_stream_t *st)
+{
+	if (st->used && st->ok)
+		st->ok = migrate_write(st->local, st->remote, st->buf, st->used);
+	st->used = 0;
+}
+
+static void migrate_emit(migrate_stream_t *st, migrate_op_t op, chord_id_t id, const void *key, unsigned int klen, const void *value, unsigned int vlen)
+{
+	migrate_record_t r;
+	if ((st->used + sizeof(r) + klen + vlen) > MIGRATE_BUFFER)
+		migrate_flush(st);
+	r.op = op;
+	r.klen = klen;
+	r.vlen = vlen;
+	r.id = id;
+	memcpy(st->buf + st->used, &r, sizeof(r));
+	if (klen)
+		memcpy(st->buf + st->used + sizeof(r), key, klen);
+	if (vlen)
+		memcpy(st->buf + st->used + sizeof(r) + klen, value, vlen);
+	st->used += sizeof(r) + klen + vlen;
+}
+
+/* writes out what `st' gathered with the lock of `s' released, and fails
+ * the stream if a change went unlogged meanwhile */
+static void migrate_drain(kv_store_t *s, migrate_stream_t *st)
+{
+	pthread_mutex_unlock(&(s->lock));
+	migrate_flush(st);
+	pthread_mutex_lock(&(s->lock));
+	if (s->migrate_failed)
+		st->ok = 0;
+}
+
+/* emits the final state of the keys logged from `off' on, all of them if
+ * `all' and else as many as fit in the buffer; returns where it stopped */
+static size_t migrate_replay(kv_store_t *s, migrate_stream_t *st, size_t off, int all)
+{
+	while ((off < s->migrate_logged) && (all || ((st->used + sizeof(migrate_record_t) + MSG_PAYLOAD) <= MIGRATE_BUFFER))) {
+		chord_id_t id;
+		unsigned short klen;
+		memcpy(&id, s->migrate_log + off, sizeof(id));
+		memcpy(&klen, s->migrate_log + off + sizeof(id), sizeof(klen));
+		unsigned char *key = s->migrate_log + off + sizeof(id) + sizeof(klen);
+		kv_entry_t *e = kv_slot(s, id, key, klen);
+		if (e->data)
+			migrate_emit(st, MIGRATE_PUT, id, key, klen, e->data + klen, e->vlen);
+		else
+			migrate_emit(st, MIGRATE_DEL, id, key, klen, NULL, 0);
+		off += sizeof(id) + sizeof(klen) + klen;
+	}
+	return off;
+}
+
+/*
+ * Streams the keys of `s' in (`lo', `hi'] to `remote' while they stay in
+ * use.  The table is copied out a buffer at a time with the lock held and
+ * written without it, and keys that change meanwhile are logged.  The
+ * logged keys follow the same way for as long as the log shrinks.  Then,
+ * with the lock held for good, the final state of the rest follows, and
+ * the receiver confirms it has applied it all, each within MIGRATE_LOCKED
+ * seconds.  Returns 1 then, with the lock still held so the caller can
+ * hand the range over before anyone sees the store again, and must call
+ * migrate_done.
+ */
+static int migrate_send(kv_store_t *s, inet_host_t *local, inet_host_t *remote, chord_id_t lo, chord_id_t hi)
+{
+	migrate_stream_t st = { local, remote, malloc(MIGRATE_BUFFER), 0, 1 };
+	unsigned int i = 0, size;
+	size_t off = 0, left;
+	unsigned char ack;
+	int done = 0;
+	if (!st.buf)
+		return 0;
+	pthread_mutex_lock(&(s->lock));
+	s->migrating = 1;
+	s->migrate_failed = 0;
+	s->migrate_lo = lo;
+	s->migrate_hi = hi;
+	s->migrate_scan = 0;
+	s->migrate_logged = 0;
+	while (!done && st.ok) {
+		/* the table may have grown meanwhile (see kv_put) */
+		size = s->size;
+		for (; (i < size) && ((st.used + sizeof(migrate_record_t) + MSG_PAYLOAD) <= MIGRATE_BUFFER); i++) {
+			kv_entry_t *e = &(s->entries[i]);
+			if (e->data && in_range_ex_in_circular(lo, hi, e->id))
+				migrate_emit(&st, MIGRATE_PUT, e->id, e->data, e->klen, e->data + e->klen, e->vlen);
+		}
+		done = (i == size);
+		s->migrate_scan = i;
+		migrate_drain(s, &st);
+	}
+	for (left = (size_t)-1; st.ok && (off < s->migrate_logged) && ((s->migrate_logged - off) < left); ) {
+		left = s->migrate_logged - off;
+		off = migrate_replay(s, &st, off, 0);
+		migrate_drain(s, &st);
+	}
+	if (st.ok && (inet_set_send_timeout(remote, MIGRATE_LOCKED * 1000) < 0))
+		st.ok = 0;
+	migrate_replay(s, &st, off, 1);
+	migrate_emit(&st, MIGRATE_END, 0, NULL, 0, NULL, 0);
+	migrate_flush(&st);
+	free(st.buf);
+	if (st.ok && migrate_read(remote, local, &ack, 1, MIGRATE_LOCKED))
+		return 1;
+	s->migrating = 0;
+	pthread_mutex_unlock(&(s->lock));
+	return 0;
+}
+
+/* ends the migration migrate_send started, dropping the keys that went if
+ * `drop' */
+static void migrate_done(kv_store_t *s, int drop)
+{
+	s->migrating = 0;
+	if (drop)
+		kv_drop(s, s->migrate_lo, s->migrate_hi);
+	pthread_mutex_unlock(&(s->lock));
+}
+
+/*
+ * Applies the records arriving from `remote' to `s' up to MIGRATE_END.
+ * Returns 1 once that arrived, with the lock of `s' held so the caller can
+ * take the keys over before answering with migrate_ack; 0 if the stream
+ * broke off or made no sense.
+ */
+static int migrate_receive(kv_store_t *s, inet_host_t *remote, inet_host_t *local)
+{
+	unsigned char *buf = malloc(MIGRATE_BUFFER);
+	size_t used = 0, off;
+	int size, ret = -1;
+	while ((ret < 0) && ((size = inet_receive(remote, local, buf + used, MIGRATE_BUFFER - used, RPC_TIMEOUT / 1000)) > 0)) {
+		used += size;
+		pthread_mutex_lock(&(s->lock));
+		for (off = 0; (ret < 0) && ((off + sizeof(migrate_record_t)) <= used); ) {
+			migrate_record_t r;
+			memcpy(&r, buf + off, sizeof(r));
+			if ((r.op == MIGRATE_END) || ((r.klen + r.vlen) > MSG_PAYLOAD) || ((r.op != MIGRATE_PUT) && (r.op != MIGRATE_DEL))) {
+				ret = (r.op == MIGRATE_END);
+				break;
+			}
+			if ((off + sizeof(r) + r.klen + r.vlen) > used)
+				break;
+			unsigned char *key = buf + off + sizeof(r);
+			if (r.op == MIGRATE_PUT) {
+				/* keys that do not fit stay with the sender */
+				if (!kv_put(s, r.id, key, r.klen, key + r.klen, r.vlen)) {
+					ret = 0;
+					break;
+				}
+				s->received_keys++;
+				s->received_bytes += r.klen + r.vlen;
+			}
+			else
+				kv_del(s, r.id, key, r.klen);
+			off += sizeof(r) + r.klen + r.vlen;
+		}
+		if (ret <= 0)
+			pthread_mutex_unlock(&(s->lock));
+		memmove(buf, buf + off, used - off);
+		used -= off;
+	}
+	free(buf);
+	return (ret > 0);
+}
+
+/* releases the lock migrate_receive left held and confirms the migration */
+static int migrate_ack(kv_store_t *s, inet_host_t *remote, inet_host_t *local)
+{
+	unsigned char ack = 1;
+	pthread_mutex_unlock(&(s->lock));
+	return migrate_write(local, remote, &ack, 1);
+}
+
+/* fills in where to reach the nodes `req' names, as far as `n' knows */
+static void migrate_address(node_t *n, migrate_request_t *req)
+{
+	transport_t *t = n->transport;
+	req->addr[0] = n->endpoint.addr;
+	req->port[0] = n->endpoint.port;
+	req->addr[1] = 0;
+	req->port[1] = 0;
+	if (req->predecessor) {
+		pthread_mutex_lock(&(t->peers_lock));
+		peer_t *p = peer_slot(t, req->predecessor);
+		if (p->id) {
+			req->addr[1] = p->host.addr.sin_addr.s_addr;
+			req->port[1] = p->host.addr.sin_port;
+		}
+		pthread_mutex_unlock(&(t->peers_lock));
+	}
+}
+
+/* takes note of where to reach the nodes `req' names */
+static void migrate_learn(transport_t *t, migrate_request_t *req)
+{
+	if (req->addr[0])
+		peer_learn(t, req->from, req->addr[0], req->port[0]);
+	if (req->predecessor && req->addr[1])
+		peer_learn(t, req->predecessor, req->addr[1], req->port[1]);
+}
+
+/* makes `n', whose keys in (lo, hi] went to `req->from', take `from' as
+ * its predecessor if it falls in between; returns whether it did */
+static int migrate_handed(node_t *n, migrate_request_t *req)
+{
+	chord_id_t p = n->predecessor;
+	int handed = (!p || in_range_ex_ex_circular(p, n->id, req->from));
+	if (handed) {
+		location_invalidate(n, p);
+		route_begin(n);
+		n->predecessor = req->from;
+		route_end(n);
+	}
+	return handed;
+}
+
+/* makes `n', which took the keys of `req->from' over, adopt the predecessor
+ * of `from' */
+static void migrate_adopt(node_t *n, migrate_request_t *req)
+{
+	if (!n->predecessor || (n->predecessor == req->from)) {
+		location_invalidate(n, req->from);
+		route_begin(n);
+		n->predecessor = req->predecessor;
+		route_end(n);
+	}
+}
+
+/* copies the keys of `from' in (lo, hi] to `to', with both locks held;
+ * returns 0 if some did not fit */
+static int migrate_copy(kv_store_t *from, kv_store_t *to, chord_id_t lo, chord_id_t hi)
+{
+	unsigned int i;
+	int ok = 1;
+	for (i = 0; i < from->size; i++) {
+		kv_entry_t *e = &(from->entries[i]);
+		if (e->data && in_range_ex_in_circular(lo, hi, e->id)) {
+			if (!kv_put(to, e->id, e->data, e->klen, e->data + e->klen, e->vlen)) {
+				ok = 0;
+				continue;
+			}
+			to->received_keys++;
+			to->received_bytes += e->klen + e->vlen;
+		}
+	}
+	from->migrate_lo = lo;
+	from->migrate_hi = hi;
+	return ok;
+}
+
+/*
+ * Moves keys as `req' says between `n' and node `req->to' on a transport
+ * that ops->reach finds in this process, by copying them from store to
+ * store; with both locks held, so nothing can tell that apart from what
+ * the stream does.  For drivers that run every transport on one thread.
+ */
+static int migrate_local(node_t *n, migrate_request_t *req)
+{
+	transport_t *peer;
+	inet_host_t remote;
+	node_t *to;
+	migrate_address(n, req);
+	if (!rpc_peer(n->transport, req->to, &remote) || !(peer = n->transport->ops->reach(&remote)) || !(to = rpc_node(peer, req->to)))
+		return 0;
+	migrate_learn(peer, req);
+	pthread_mutex_lock(&(to->store.lock));
+	pthread_mutex_lock(&(n->store.lock));
+	if (req->op == MIGRATE_PULL) {
+		int copied = migrate_copy(&(to->store), &(n->store), req->lo, req->hi);
+		n->status = ST_CONNECTED;
+		pthread_mutex_unlock(&(n->store.lock));
+		migrate_done(&(to->store), copied && migrate_handed(to, req) && (to->replicas <= 0));
+	}
+	else {
+		migrate_copy(&(n->store), &(to->store), req->lo, req->hi);
+		migrate_adopt(to, req);
+		pthread_mutex_unlock(&(to->store.lock));
+		n->status = ST_DISCONNECTED;
+		migrate_done(&(n->store), 1);
+	}
+	return 1;
+}
+
+/* connects to the stream server of node `id' and sends `req' */
+static int migrate_open(node_t *n, chord_id_t id, inet_host_t *local, inet_host_t *remote, migrate_request_t *req)
+{
+	migrate_address(n, req);
+	if (!rpc_peer(n->transport, id, remote) || (inet_open(local, IN_PROT_TCP, IN_ADDR_ANY, IN_PORT_ANY) < 0))
+		return 0;
+	if ((inet_connect(local, remote) < 0) || !migrate_write(local, remote, req, sizeof(*req))) {
+		inet_close(local);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Takes the keys that fall to `n', which is joining in front of `id', over
+ * from `id'.  `id' keeps serving them while they stream over, and hands
+ * them over once they are all here by taking `n' as its predecessor; `n'
+ * starts serving them at the same point.  The copies `id' keeps of keys
+ * before `n' as a replica come along, since `n' now is a replica of them.
+ * Returns 0 if `id' could not be reached that way.
+ */
+static int migrate_pull(node_t *n, chord_id_t id)
+{
+	migrate_request_t req = { MIGRATE_PULL, id, n->id, id, n->id, 0 };
+	inet_host_t local, remote;
+	int ok = 0;
+	if (n->transport->ops->reach)
+		return migrate_local(n, &req);
+	if (!migrate_open(n, id, &local, &remote, &req))
+		return 0;
+	if (migrate_receive(&(n->store), &remote, &local)) {
+		n->status = ST_CONNECTED;
+		ok = migrate_ack(&(n->store), &remote, &local);
+	}
+	inet_close(&local);
+	return ok;
+}
+
+/*
+ * Hands all keys of `n', which is leaving, to its successor, which takes
+ * the predecessor of `n' as its own at the point it starts serving them.
+ * `n' serves them until then, and turns requests away from then on.
+ */
+static int migrate_push(node_t *n)
+{
+	migrate_request_t req = { MIGRATE_PUSH, n->successor, n->id, n->id, n->id, n->predecessor };
+	inet_host_t local, remote;
+	int ok = 0;
+	if (n->transport->ops->reach)
+		return migrate_local(n, &req);
+	if (!migrate_open(n, n->successor, &local, &remote, &req))
+		return 0;
+	if ((ok = migrate_send(&(n->store), &local, &remote, n->id, n->id))) {
+		n->status = ST_DISCONNECTED;
+		migrate_done(&(n->store), 1);
+	}
+	inet_close(&local);
+	return ok;
+}
+
+/* serves the migration connection from `remote' for one of the nodes of `t' */
+static void migrate_serve(transport_t *t, inet_host_t *remote)
+{
+	migrate_request_t req;
+	node_t *n;
+	if (!migrate_read(remote, &(t->stream), &req, sizeof(req), RPC_TIMEOUT / 1000) || !(n = rpc_node(t, req.to)))
+		return;
+	migrate_learn(t, &req);
+	/* with replicas, `n' goes on keeping a copy as a successor of `from' */
+	if ((req.op == MIGRATE_PULL) && migrate_send(&(n->store), &(t->stream), remote, req.lo, req.hi))
+		migrate_done(&(n->store), migrate_handed(n, &req) && (n->replicas <= 0));
+	else if ((req.op == MIGRATE_PUSH) && migrate_receive(&(n->store), remote, &(t->stream))) {
+		migrate_adopt(n, &req);
+		migrate_ack(&(n->store), remote, &(t->stream));
+	}
+}
+
+/* accepts migration connections one after the other until the transport
+ * closes */
+static void *stream_handler(void *data)
+{
+	transport_t *t = (transport_t *)data;
+	inet_host_t remote;
+	while (!t->stream_closing) {
+		if ((remote.fd = accept(t->stream.fd, NULL, NULL)) < 0)
+			continue;
+		remote.protocol = IN_PROT_TCP;
+		pthread_mutex_lock(&(t->stream_lock));
+		migrate_serve(t, &remote);
+		pthread_mutex_unlock(&(t->stream_lock));
+		inet_close(&remote);
+	}
+	return NULL;
+}
+
+
+/**
+ * shared memory
+ */
+
+#define SHM_MAGIC 0x74726961  /* "tria" */
+
+/* whether transports reach peers on this host through their inboxes rather
+ * than over UDP; checked as each message goes out (and as transports open) */
+volatile int transport_shared = 1;
+
+/* what senders of this process know about the inbox at `addr':`port' */
+typedef struct shm_peer {
+	unsigned int addr;    // in network byte order; 0 if the slot is free
+	unsigned short port;
+	shm_ring_t *ring;     // NULL if it has none
+	transport_t *t;       // the transport it belongs to, if that is in this process
+	ino_t ino;            // of its file otherwise
+	int bell;             // and its FIFO, -1 if it could not be opened
+	long long checked;    // us, when its file was last looked for
+} shm_peer_t;
+
+static struct {
+	pthread_rwlock_t lock;
+	shm_peer_t *peers;    // open addressing on addr and port, grown at half full
+	unsigned int npeers;
+	unsigned int size;
+} shm = { PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0 };
+
+static void shm_path(char *path, size_t len, unsigned int addr, unsigned short port, const char *suffix)
+{
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+	snprintf(path, len, "/dev/shm/triad-%s-%u%s", ip, ntohs(port), suffix);
+}
+
+static shm_peer_t *shm_slot(unsigned int addr, unsigned short port)
+{
+	unsigned int i = ((addr * 2654435761u) ^ port) & (shm.size - 1);
+	while (shm.peers[i].addr && ((shm.peers[i].addr != addr) || (shm.peers[i].port != port)))
+		i = (i + 1) & (shm.size - 1);
+	return &(shm.peers[i]);
+}
+
+/* the entry for `addr':`port', added if there is none (and the lock is
+ * held for writing); NULL if there is none */
+static shm_peer_t *shm_peer(unsigned int addr, unsigned short port, int add)
+{
+	shm_peer_t *p = (shm.size ? shm_slot(addr, port) : NULL);
+	if ((p && p->addr) || !add)
+		return ((p && p->addr) ? p : NULL);
+	if (2 * (shm.npeers + 1) > shm.size) {
+		shm_peer_t *old = shm.peers;
+		unsigned int size = shm.size, i;
+		shm.size = (size ? (2 * size) : PEER_TABLE);
+		shm.peers = calloc(shm.size, sizeof(shm_peer_t));
+		for (i = 0; i < size; i++)
+			if (old[i].addr)
+				*shm_slot(old[i].addr, old[i].port) = old[i];
+		free(old);
+		p = shm_slot(addr, port);
+	}
+	shm.npeers++;
+	p->addr = addr;
+	p->port = port;
+	p->bell = -1;
+	return p;
+}
+
+/* drops the mapping of the inbox of `p', if it is in another process */
+static void shm_forget(shm_peer_t *p)
+{
+	if (p->ring && !p->t)
+		munmap(p->ring, sizeof(shm_ring_t));
+	if (p->bell >= 0)
+		close(p->bell);
+	p->bell = -1;
+	p->ring = NULL;
+	p->t = NULL;
+}
+
+/* looks for the inbox of `p' in another process, keeping the one mapped
+ * if its file is still there; with the lock held for writing */
+static void shm_map(shm_peer_t *p, long long now)
+{
+	char path[64];
+	struct stat st;
+	shm_ring_t *ring = MAP_FAILED;
+	p->checked = now;
+	shm_path(path, sizeof(path), p->addr, p->port, "");
+	if (p->ring && !p->ring->closed && !stat(path, &st) && (st.st_ino == p->ino))
+		return;
+	shm_forget(p);
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+	if (!fstat(fd, &st) && (st.st_size == sizeof(shm_ring_t)))
+		ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return;
+
+	/* left behind by a process that died */
+	if ((ring->magic != SHM_MAGIC) || ring->closed || (kill(ring->pid, 0) && (errno == ESRCH))) {
+		munmap(ring, sizeof(shm_ring_t));
+		return;
+	}
+	p->ring = ring;
+	p->ino = st.st_ino;
+	shm_path(path, sizeof(path), p->addr, ring->server_port, ".bell");
+	p->bell = open(path, O_WRONLY | O_NONBLOCK);
+}
+
+/* puts the datagram of `size' bytes at `data' from `local' in a free slot
+ * of the inbox of `p', and rings its doorbell if it sleeps; 0 if the inbox
+ * is full */
+static int shm_push(shm_peer_t *p, inet_host_t *local, inet_host_t *remote, void *data, int size)
+{
+	shm_ring_t *ring = p->ring;
+	unsigned long pos = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+	shm_slot_t *slot;
+	for (;;) {
+		slot = &(ring->slots[pos & (SHM_SLOTS - 1)]);
+		long diff = (long)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - pos);
+		if (diff < 0)
+			return 0;
+		if (diff > 0)
+			pos = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+		else if (__atomic_compare_exchange_n(&(ring->tail), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	slot->addr = local->addr.sin_addr.s_addr;
+	slot->port = local->addr.sin_port;
+	slot->server = (remote->addr.sin_port == ring->server_port);
+	slot->size = size;
+	memcpy(slot->data, data, size);
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in shm_idle: either the reader sees the
+	 * message before it sleeps, or we see that it sleeps */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ring->sleeping), __ATOMIC_RELAXED) && __atomic_exchange_n(&(ring->sleeping), 0, __ATOMIC_RELAXED)) {
+		if (p->t)
+			p->t->ops->wake(p->t);
+		else if ((p->bell < 0) || (write(p->bell, "", 1) < 0))
+			inet_send(local, remote, "", 0);
+	}
+	return 1;
+}
+
+/*
+ * Hands the datagram of `size' bytes at `data' from `local' to the inbox of
+ * the transport serving at `remote', if it is on this host and has room.
+ * Returns `size' if it did, and -1 if it has to go over UDP.
+ */
+static int shm_send(inet_host_t *local, inet_host_t *remote, void *data, int size)
+{
+	unsigned int addr = remote->addr.sin_addr.s_addr;
+	unsigned short port = remote->addr.sin_port;
+	long long now = rpc_now();
+	int sent = 0;
+	if (size > WIRE_DATAGRAM)
+		return -1;
+	pthread_rwlock_rdlock(&(shm.lock));
+	shm_peer_t *p = shm_peer(addr, port, 0);
+	if (!p || (!p->t && ((now - p->checked) >= (SHM_RECHECK * 1000LL)))) {
+		pthread_rwlock_unlock(&(shm.lock));
+		pthread_rwlock_wrlock(&(shm.lock));
+		p = shm_peer(addr, port, 1);
+		if (!p->t && ((now - p->checked) >= (SHM_RECHECK * 1000LL)))
+			shm_map(p, now);
+	}
+	if (p->ring && !p->ring->closed)
+		sent = shm_push(p, local, remote, data, size);
+	pthread_rwlock_unlock(&(shm.lock));
+	return (sent ? size : -1);
+}
+
+/* marks `ring' as slept on, unless messages are waiting in it (0) */
+static int shm_idle(shm_ring_t *ring)
+{
+	__atomic_store_n(&(ring->sleeping), 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ring->slots[ring->head & (SHM_SLOTS - 1)].seq), __ATOMIC_ACQUIRE) != (ring->head + 1))
+		return 1;
+	__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Handles the datagrams waiting in the inbox of `t' where they are, as they
+ * would be had they come over UDP; only acknowledgements unless `requests'.
+ * Returns 0 once the last node has quit.
+ */
+static int shm_serve(transport_t *t, int requests)
+{
+	shm_ring_t *ring = t->inbox;
+	inet_host_t from;
+	int running = 1;
+	memset(&from, 0, sizeof(from));
+	from.fd = -1;
+	from.protocol = IN_PROT_UDP;
+	from.addr.sin_family = AF_INET;
+	while (running) {
+		unsigned long pos = ring->head;
+		shm_slot_t *slot = &(ring->slots[pos & (SHM_SLOTS - 1)]);
+		if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != (pos + 1))
+			break;
+		int size = (((slot->size > 0) && (slot->size <= WIRE_DATAGRAM)) ? slot->size : 0);
+		from.addr.sin_addr.s_addr = slot->addr;
+		from.addr.sin_port = slot->port;
+		if (!slot->server)
+			transport_receive(t, &(t->client), &from, slot->data, size);
+		else if (requests)
+			running = transport_receive(t, &(t->server), &from, slot->data, size);
+		__atomic_store_n(&(slot->seq), pos + SHM_SLOTS, __ATOMIC_RELEASE);
+		ring->head = pos + 1;
+	}
+	return running;
+}
+
+/* points the entries of the addresses of `t' at `ring' (and `t'), or
+ * forgets them if `ring' is NULL */
+static void shm_register(transport_t *t, shm_ring_t *ring)
+{
+	inet_host_t *hosts[2] = { &(t->server), &(t->client) };
+	int i;
+	pthread_rwlock_wrlock(&(shm.lock));
+	for (i = 0; i < 2; i++) {
+		shm_peer_t *p = shm_peer(hosts[i]->addr.sin_addr.s_addr, hosts[i]->addr.sin_port, 1);
+		shm_forget(p);
+		p->ring = ring;
+		p->t = (ring ? t : NULL);
+		p->checked = 0;
+	}
+	pthread_rwlock_unlock(&(shm.lock));
+}
+
+/*
+ * Creates the inbox of `t' in /dev/shm, under the names of its server and
+ * client addresses.  Without one, its peers on this host send to it over
+ * UDP as everyone else does.
+ */
+static void shm_create(transport_t *t)
+{
+	char path[64], client[64], bell[72], tmp[80];
+	shm_ring_t *ring = MAP_FAILED;
+	unsigned int slot;
+	shm_path(path, sizeof(path), t->server.addr.sin_addr.s_addr, t->server.addr.sin_port, "");
+	shm_path(client, sizeof(client), t->client.addr.sin_addr.s_addr, t->client.addr.sin_port, "");
+	shm_path(bell, sizeof(bell), t->server.addr.sin_addr.s_addr, t->server.addr.sin_port, ".bell");
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+	/* whatever was under these names belonged to a process that had our
+	 * ports before, and is gone */
+	unlink(client);
+	unlink(bell);
+	if (mkfifo(bell, 0600) || ((t->bellfd = open(bell, O_RDWR | O_NONBLOCK)) < 0)) {
+		unlink(bell);
+		return;
+	}
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if ((fd >= 0) && !ftruncate(fd, sizeof(shm_ring_t)))
+		ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (ring != MAP_FAILED) {
+		ring->pid = getpid();
+		ring->server_port = t->server.addr.sin_port;
+		ring->client_port = t->client.addr.sin_port;
+		for (slot = 0; slot < SHM_SLOTS; slot++)
+			ring->slots[slot].seq = slot;
+		ring->magic = SHM_MAGIC;
+		if (!link(tmp, client) && !rename(tmp, path)) {
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.u32 = EV_BELL;
+			epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->bellfd, &ev);
+			t->inbox = ring;
+			shm_register(t, ring);
+			return;
+		}
+		munmap(ring, sizeof(shm_ring_t));
+	}
+	unlink(tmp);
+	unlink(client);
+	unlink(bell);
+	close(t->bellfd);
+	t->bellfd = -1;
+}
+
+/* removes the inbox of `t' once its RPC thread is gone */
+static void shm_destroy(transport_t *t)
+{
+	char path[72];
+	if (!t->inbox)
+		return;
+	shm_register(t, NULL);
+	t->inbox->closed = 1;
+	shm_path(path, sizeof(path), t->server.addr.sin_addr.s_addr, t->server.addr.sin_port, "");
+	unlink(path);
+	shm_path(path, sizeof(path), t->client.addr.sin_addr.s_addr, t->client.addr.sin_port, "");
+	unlink(path);
+	shm_path(path, sizeof(path), t->server.addr.sin_addr.s_addr, t->server.addr.sin_port, ".bell");
+	unlink(path);
+	close(t->bellfd);
+	t->bellfd = -1;
+	munmap(t->inbox, sizeof(shm_ring_t));
+	t->inbox = NULL;
+}
+
+
+/**
+ * transports
+ */
+
+/* datagrams the RPC threads receive per recvmmsg, up to RPC_BATCH, and
+ * whether they send what they gathered with one sendmmsg; 1 for a recvfrom
+ * or sendto each.  Checked as they go */
+volatile int transport_batch = RPC_BATCH;
+
+/* for transports opened from now on: SO_RCVBUF and SO_SNDBUF of their
+ * sockets in bytes (0 for the system default), and the us their RPC threads
+ * poll for more without sleeping once something arrived, which the sockets
+ * also busy-poll the device for (SO_BUSY_POLL; 0 for neither) */
+int transport_rcvbuf = 0;
+int transport_sndbuf = 0;
+int transport_busy_poll = 0;
+
+/*
+ * Opens the server socket, the client socket (on an ephemeral port), the
+ * TCP server keys move through, the inbox peers on this host send to and the
+ * event loop that watches them.
+ */
+static int udp_open(transport_t *t, const char *ip, unsigned short port)
+{
+	if ((inet_open(&(t->server), IN_PROT_UDP, ip, port) < 0) || (inet_open(&(t->client), IN_PROT_UDP, ip, IN_PORT_ANY) < 0)) {
+		inet_close(&(t->server));
+		return 0;
+	}
+	inet_nonblock(&(t->server));
+	inet_nonblock(&(t->client));
+	inet_set_buffers(&(t->server), transport_rcvbuf, transport_sndbuf);
+	inet_set_buffers(&(t->client), transport_rcvbuf, transport_sndbuf);
+	if (transport_busy_poll) {
+		inet_set_busy_poll(&(t->server), transport_busy_poll);
+		inet_set_busy_poll(&(t->client), transport_busy_poll);
+	}
+
+	/* keys move over TCP, on the same port; without it they stay put */
+	if ((inet_open(&(t->stream), IN_PROT_TCP, ip, ntohs(t->server.addr.sin_port)) < 0) || (listen(t->stream.fd, IN_BACKLOG) < 0)) {
+		inet_close(&(t->stream));
+		t->stream.fd = -1;
+	}
+	t->wakefd = eventfd(0, EFD_NONBLOCK);
+	t->bellfd = -1;
+	t->epfd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = EV_SERVER;
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->server.fd, &ev);
+	ev.data.u32 = EV_CLIENT;
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->client.fd, &ev);
+	ev.data.u32 = EV_WAKE;
+	epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd, &ev);
+	if (transport_shared)
+		shm_create(t);
+	return 1;
+}
+
+/* starts the RPC thread of `t', and its stream server if it has one */
+static void udp_start(transport_t *t)
+{
+	pthread_create(&(t->rpc_thread), NULL, rpc_handler, t);
+	if (t->stream.fd >= 0)
+		pthread_create(&(t->stream_thread), NULL, stream_handler, t);
+}
+
+static void udp_stop(transport_t *t)
+{
+	pthread_join(t->rpc_thread, NULL);
+	shm_destroy(t);
+	if (t->stream.fd >= 0) {
+		t->stream_closing = 1;
+		shutdown(t->stream.fd, SHUT_RDWR);
+		pthread_join(t->stream_thread, NULL);
+		inet_close(&(t->stream));
+	}
+	inet_close(&(t->server));
+	inet_close(&(t->client));
+	close(t->wakefd);
+	close(t->epfd);
+}
+
+/* sends through the inbox of the peer at `remote' if it is on this host,
+ * and over UDP otherwise */
+static int udp_send(inet_host_t *local, inet_host_t *remote, void *data, int size)
+{
+	int sent = (transport_shared ? shm_send(local, remote, data, size) : -1);
+	return ((sent >= 0) ? sent : inet_send(local, remote, data, size));
+}
+
+/* sends through inboxes what of `dgrams' it can, as udp_send does, and
+ * moves the rest to the front; returns how many are left */
+static int shm_send_many(inet_host_t *local, inet_datagram_t *dgrams, int count)
+{
+	inet_host_t remote;
+	int i, rest = 0;
+	if (!transport_shared)
+		return count;
+	memset(&remote, 0, sizeof(remote));
+	remote.fd = -1;
+	remote.protocol = IN_PROT_UDP;
+	for (i = 0; i < count; i++) {
+		remote.addr = dgrams[i].addr;
+		if (shm_send(local, &remote, dgrams[i].data, dgrams[i].len) < 0)
+			dgrams[rest++] = dgrams[i];
+	}
+	return rest;
+}
+
+/* sends through inboxes what it can, and the rest over UDP in as few system
+ * calls as it takes */
+static int udp_send_many(inet_host_t *local, inet_datagram_t *dgrams, int count)
+{
+	int rest = shm_send_many(local, dgrams, count);
+	return ((rest && (inet_send_many(local, dgrams, rest) < 0)) ? -EIN_SEND : count);
+}
+
+static void udp_wake(transport_t *t)
+{
+	uint64_t one = 1;
+	write(t->wakefd, &one, sizeof(one));
+}
+
+static void udp_wait(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+	pthread_cond_wait(cond, lock);
+}
+
+static void udp_signal(pthread_cond_t *cond)
+{
+	pthread_cond_signal(cond);
+}
+
+static long long udp_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+const transport_ops_t transport_udp = {
+	udp_open,
+	udp_start,
+	udp_stop,
+	udp_send,
+	udp_send_many,
+	udp_wake,
+	udp_wait,
+	udp_signal,
+	NULL,
+	udp_now,
+};
+
+/*
+ * transport_uring: transport_udp with an RPC thread that waits in io_uring
+ * instead of epoll.  Its sockets and the descriptors that wake it are
+ * registered with the ring, datagrams arrive through one multishot receive
+ * per socket into buffers registered with the kernel, and what the thread
+ * gathered goes out with the submission of its next wait, so a busy thread
+ * makes one system call per wakeup.  Where io_uring is not compiled in or
+ * the kernel cannot do that, the thread runs rpc_handler on epoll instead.
+ */
+
+static __thread transport_t *uring_mine;  /* whose RPC thread this is */
+
+/* queues what does not go through inboxes on the ring of the RPC thread of
+ * the transport `local' belongs to, if this is that thread */
+static int uring_send_many(inet_host_t *local, inet_datagram_t *dgrams, int count)
+{
+	transport_t *t = uring_mine;
+	int rest;
+	if (!t || ((local != &(t->server)) && (local != &(t->client))))
+		return udp_send_many(local, dgrams, count);
+	rest = shm_send_many(local, dgrams, count);
+	return ((rest && (inet_ring_send_many((inet_ring_t *)t->driver, local, dgrams, rest) < 0)) ? -EIN_SEND : count);
+}
+
+/* rpc_handler, waiting on a ring its thread opens and keeps in t->driver */
+static void *uring_handler(void *data)
+{
+	transport_t *t = (transport_t *)data;
+	inet_ring_t *ring = inet_ring_open(WIRE_DATAGRAM);
+	inet_ring_event_t events[RPC_BATCH];
+	inet_host_t from;
+	uint64_t wakeups;
+	char bells[64];
+	int running = 1, gathering, busy = transport_busy_poll, count, e;
+	long long active = rpc_now();
+	if (!ring || (inet_ring_receive(ring, &(t->server), EV_SERVER) < 0) || (inet_ring_receive(ring, &(t->client), EV_CLIENT) < 0) ||
+			(inet_ring_poll(ring, t->wakefd, EV_WAKE) < 0) || ((t->bellfd >= 0) && (inet_ring_poll(ring, t->bellfd, EV_BELL) < 0))) {
+		if (ring)
+			inet_ring_close(ring);
+		return rpc_handler(t);
+	}
+	t->driver = ring;
+	uring_mine = t;
+	memset(&from, 0, sizeof(from));
+	from.fd = -1;
+	from.protocol = IN_PROT_UDP;
+	while (running) {
+		int timeout = rpc_sleep(t);
+		if (timeout && busy && ((rpc_now() - active) < busy))
+			timeout = 0;
+		else if (timeout && t->inbox && !shm_idle(t->inbox))
+			timeout = 0;
+		count = inet_ring_wait(ring, events, RPC_BATCH, timeout);
+		if (count > 0)
+			active = rpc_now();
+		if (t->inbox)
+			__atomic_store_n(&(t->inbox->sleeping), 0, __ATOMIC_RELAXED);
+		gathering = transport_gather(t);
+		for (e = 0; (e < count) && running; e++) {
+			from.addr = events[e].dgram.addr;
+			switch (events[e].tag) {
+				case EV_SERVER:
+					running = transport_receive(t, &(t->server), &from, events[e].dgram.data, events[e].dgram.len);
+					break;
+				case EV_CLIENT:
+					transport_receive(t, &(t->client), &from, events[e].dgram.data, events[e].dgram.len);
+					break;
+				case EV_WAKE:
+					read(t->wakefd, &wakeups, sizeof(wakeups));
+					break;
+				case EV_BELL:
+					while (read(t->bellfd, bells, sizeof(bells)) > 0);
+					break;
+			}
+		}
+		if (running && t->inbox)
+			running = shm_serve(t, 1);
+		transport_tick(t);
+		transport_flush(t, gathering);
+	}
+
+	/* send what is queued and deliver what already arrived, as rpc_handler
+	 * does; anything sent from here on goes out right away */
+	uring_mine = NULL;
+	count = inet_ring_wait(ring, events, RPC_BATCH, 0);
+	gathering = transport_gather(t);
+	for (e = 0; e < count; e++)
+		if (events[e].tag == EV_CLIENT) {
+			from.addr = events[e].dgram.addr;
+			transport_receive(t, &(t->client), &from, events[e].dgram.data, events[e].dgram.len);
+		}
+	if (t->inbox)
+		shm_serve(t, 0);
+	transport_tick(t);
+	transport_flush(t, gathering);
+	free(outbox_mine);
+	outbox_mine = NULL;
+	t->driver = NULL;
+	inet_ring_close(ring);
+	return NULL;
+}
+
+static void uring_start(transport_t *t)
+{
+	pthread_create(&(t->rpc_thread), NULL, uring_handler, t);
+	if (t->stream.fd >= 0)
+		pthread_create(&(t->stream_thread), NULL, stream_handler, t);
+}
+
+const transport_ops_t transport_uring = {
+	udp_open,
+	uring_start,
+	udp_stop,
+	udp_send,
+	uring_send_many,
+	udp_wake,
+	udp_wait,
+	udp_signal,
+	NULL,
+	udp_now,
+};
+
+/*
+ * Makes the transports opened from now on run on `ops', and the clock of
+ * the process that of `ops' (transport_udp until then).  Meant to be
+ * called before any node starts.
+ */
+void triad_transport(const transport_ops_t *ops)
+{
+	transport_ops = ops;
+}
+
+static void transport_free(transport_t *t)
+{
+	while (t->free_requests) {
+		rpc_request_t *r = t->free_requests;
+		t->free_requests = r->next;
+		if (r->batch)
+			batch_free(r->batch);
+		free(r);
+	}
+	pthread_mutex_destroy(&(t->stream_lock));
+	pthread_mutex_destroy(&(t->pending_lock));
+	pthread_mutex_destroy(&(t->peers_lock));
+	free(t->replay);
+	free(t->pending);
+	free(t->free_slots);
+	free(t->peers);
+	free(t->nodes);
+	free(t);
+}
+
+/*
+ * Opens a transport for `count' nodes, serving at `ip':`port' (a port
+ * picked by the kernel if 0).  Its RPC thread starts once the nodes are in
+ * place.
+ */
+static transport_t *transport_open(const char *ip, unsigned short port, int count)
+{
+	transport_t *t = calloc(1, sizeof(transport_t));
+	t->ops = transport_ops;
+	t->nodes = calloc(count, sizeof(node_t *));
+
+	/* set up the table of outstanding calls */
+	unsigned int slot;
+	t->pending_size = RPC_PENDING_INIT;
+	t->pending = calloc(t->pending_size, sizeof(rpc_pending_t));
+	t->free_slots = malloc(t->pending_size * sizeof(unsigned int));
+	for (slot = 0; slot < t->pending_size; slot++)
+		t->free_slots[t->nfree_slots++] = (t->pending_size - 1 - slot);
+	pthread_mutex_init(&(t->pending_lock), NULL);
+	t->replay_size = RPC_REPLAY;
+	t->peers_size = PEER_TABLE;
+	t->peers = calloc(t->peers_size, sizeof(peer_t));
+	pthread_mutex_init(&(t->peers_lock), NULL);
+	pthread_mutex_init(&(t->stream_lock), NULL);
+	if (!t->ops->open(t, ip, port)) {
+		transport_free(t);
+		return NULL;
+	}
+	t->replay = calloc(t->replay_size, sizeof(rpc_replay_t));
+	return t;
+}
+
+/* closes `t' once its RPC thread (or driver) has let go of its last node,
+ * giving up on the calls it still has outstanding */
+static void transport_close(transport_t *t)
+{
+	t->ops->stop(t);
+	rpc_expire(t, NULL, 0);
+	transport_free(t);
+}
+
+
+/**
+ * triad functions
+ */
+
+/* adds a node with id `id' to `t' */
+static node_t *node_new(transport_t *t, chord_id_t id)
+{
+	node_t *n = calloc(1, sizeof(node_t));
+	n->id = id;
+	n->endpoint.id = id;
+	n->endpoint.addr = t->server.addr.sin_addr.s_addr;
+	n->endpoint.port = t->server.addr.sin_port;
+	n->transport = t;
+	t->nodes[t->nnodes++] = n;
+	peer_learn(t, id, n->endpoint.addr, n->endpoint.port);
+
+	n->successor = n->id;
+	n->predecessor = n->id;
+	int f;
 	for (f = 0; f < KEYSPACE; f++) {
-		n->finger_table[f].start = (n->id + (1 << f));
-		n->finger_table[f].end = (n->id + (1 << (f + 1)));
+		n->finger_table[f].start = n->id + ((chord_id_t)1 << f);
+		n->finger_table[f].end = n->id + ((chord_id_t)2 << f);
 		n->finger_table[f].successor = n->id;
-		n->successor = n->id;
-		n->predecessor = n->id;
 	}
-	rpc_set_status(n->id, ST_DISCONNECTED);
+	finger_index(n);
+	finger_kernel(NULL);
+	n->status = ST_DISCONNECTED;
+	n->stabilize_interval = STABILIZE_INTERVAL;
+	n->stabilize_jitter = STABILIZE_JITTER;
+	n->replicas = REPLICAS;
+	n->next_finger = 1;
+	n->seed = (unsigned int)n->id ^ (unsigned int)time(NULL);
+	kv_init(&(n->store));
+	pthread_mutex_init(&(n->location_lock), NULL);
+	pthread_mutex_init(&(n->route_lock), NULL);
+	return n;
+}
+
+/*
+ * Starts a node at `ip', serving on RPC_PORT with a transport of its own;
+ * its id is triad_node_id(ip, RPC_PORT, 0).
+ */
+node_t *triad_init(const char *ip)
+{
+	transport_t *t = transport_open(ip, RPC_PORT, 1);
+	if (!t)
+		return NULL;
+	node_t *n = node_new(t, triad_node_id(ip, RPC_PORT, 0));
+	t->ops->start(t);
+	return n;
+}
+
+/*
+ * Starts `count' virtual nodes at `ip':`port' (a port picked by the kernel
+ * if 0), with ids from triad_node_id, and stores them in `nodes'.  They
+ * share one pair of sockets and one RPC thread, and each joins and leaves
+ * the ring on its own, so a process owns about `count' shares of the
+ * keyspace.  Returns the number of nodes started: `count', or 0 if the
+ * sockets could not be opened.
+ */
+int triad_init_virtual(const char *ip, unsigned short port, int count, node_t **nodes)
+{
+	transport_t *t = transport_open(ip, port, count);
+	int i;
+	if (!t)
+		return 0;
+	port = ntohs(t->server.addr.sin_port);
+	for (i = 0; i < count; i++)
+		nodes[i] = node_new(t, triad_node_id(ip, port, i));
+	t->ops->start(t);
+	return count;
+}
+
+/*
+ * Stops `n'.  The sockets and RPC thread it used go with the last of the
+ * nodes sharing them.
+ */
+int triad_deinit(node_t *n)
+{
+	transport_t *t = n->transport;
+	msg_t m, ack;
+	m.type = MSG_QUIT;
+	/* a migration served for `n' finishes first */
+	pthread_mutex_lock(&(t->stream_lock));
+	rpc_call(n, n->id, &m, &ack, -1);
+	pthread_mutex_unlock(&(t->stream_lock));
+	if ((ack.type != MSG_QUIT_ACK) || ack.data[0]) {
+		printf("waiting for child thread...\n"), fflush(stdout);
+		transport_close(t);
+	}
+	pthread_mutex_destroy(&(n->location_lock));
+	pthread_mutex_destroy(&(n->route_lock));
+	kv_free(&(n->store));
+
+	return 1;
+}
+
+/*
+ * Joins the ring node `e' is part of by looking up the successor of `n'
+ * there, or starts a new ring if `e' is not connected (such as when it is
+ * `n' itself).  The keys that now fall to `n' stream over from the
+ * successor before this returns.  Everything else (the predecessor, the
+ * other fingers, and the nodes that should now point at `n') is left to
+ * stabilization.
+ */
+int triad_join_endpoint(node_t *n, const endpoint_t *e)
+{
+	char ip[INET_ADDRSTRLEN];
+	printf("attempting to join ring at %" PRIid " (%s:%u)...\n", e->id, inet_ntop(AF_INET, &(e->addr), ip, sizeof(ip)), ntohs(e->port));
+	location_clear(n);
+	triad_introduce(n, e);
+	chord_id_t successor = n->id;
+	if (rpc_get_status(n, e->id) == ST_CONNECTED) {
+		/* a ring that has yet to notice `n' left earlier can still
+		 * name `n' itself; the node after it is the successor then */
+		if ((successor = rpc_find_successor(n, e->id, n->id)) == n->id)
+			successor = rpc_find_successor(n, e->id, n->id + 1);
+		if (!successor || (successor == n->id)) {
+			printf("could not join the ring at %" PRIid "!\n", e->id);
+			return 0;
+		}
+	}
+	int f;
+	route_begin(n);
+	n->predecessor = ((successor == n->id) ? n->id : 0);
+	for (f = 0; f < KEYSPACE; f++) {
+		n->finger_table[f].start = n->id + ((chord_id_t)1 << f);
+		n->finger_table[f].end = n->id + ((chord_id_t)2 << f);
+		n->finger_table[f].successor = successor;
+	}
+	n->successor = successor;
+	n->successors[0] = successor;
+	n->nsuccessors = (successor != n->id);
+	finger_index(n);
+	route_end(n);
+	n->next_finger = 1;
+	if ((successor != n->id) && !migrate_pull(n, successor))
+		printf("could not take keys over from %" PRIid "!\n", successor);
+	rpc_set_status(n, n->id, ST_CONNECTED);
+	stabilize_soon(n);
+	TRACE(TRACE_EVENTS, TRACE_JOIN, n->id, successor, NULL, NULL);
+	printf((successor == n->id) ? "started a new ring!\n" : "joined an existing ring!\n");
+	return 1;
+}
+
+/* joins the ring the node started by triad_init at `ip' is part of */
+int triad_join(node_t *n, const char *ip)
+{
+	endpoint_t e;
+	triad_endpoint_at(&e, ip, RPC_PORT, 0);
+	return triad_join_endpoint(n, &e);
+}
+
+/*
+ * Streams the keys of `n' to its successor and links its predecessor and
+ * successor together.  `n' keeps forwarding lookups to its old successor
+ * until the fingers of other nodes pointing at it have been fixed.
+ */
+int triad_leave(node_t *n)
+{
+	if ((n->status == ST_CONNECTED) && (n->successor != n->id) && !migrate_push(n))
+		printf("could not hand keys over to %" PRIid "!\n", n->successor);
+	TRACE(TRACE_EVENTS, TRACE_LEAVE, n->id, n->successor, NULL, NULL);
+	rpc_set_status(n, n->id, ST_DISCONNECTED);
+	location_clear(n);
+	deinit_finger_table(n);
+	int f;
+	route_begin(n);
+	for (f = 0; f < KEYSPACE; f++)
+		n->finger_table[f].successor = n->successor;
+	finger_index(n);
+	n->predecessor = 0;
+	route_end(n);
+	return 1;
+}
+
+/* tells `n' where node `e->id' is reached, so that it can call it */
+void triad_introduce(node_t *n, const endpoint_t *e)
+{
+	peer_learn(n->transport, e->id, e->addr, e->port);
+}
+
+/* stores where node `id' is reached in `e'; returns 0 if `n' does not know */
+int triad_endpoint(node_t *n, chord_id_t id, endpoint_t *e)
+{
+	inet_host_t remote;
+	if (!rpc_peer(n->transport, id, &remote))
+		return 0;
+	e->id = id;
+	e->addr = remote.addr.sin_addr.s_addr;
+	e->port = remote.addr.sin_port;
+	return 1;
+}
+
+/* writes the IP address of the node `id' is located on into `buf', of at
+ * least INET_ADDRSTRLEN bytes; 0.0.0.0 if it could not be found */
+char *triad_lookup(node_t *n, chord_id_t id, char *buf)
+{
+	endpoint_t e;
+	chord_id_t node = find_successor(n, id);
+	if (!node || !triad_endpoint(n, node, &e))
+		return idtostr(0, buf);
+	return (char *)inet_ntop(AF_INET, &(e.addr), buf, INET_ADDRSTRLEN);
+}
+
+/* looks up the IP address of the node that application key `key' of `len'
+ * bytes is located on, by hashing it onto the ring */
+char *triad_lookup_key(node_t *n, const void *key, size_t len, char *buf)
+{
+	return triad_lookup(n, triad_hash(key, len), buf);
+}
+
+/*
+ * Looks up the owners of the `count' ids in `ids' and stores them in
+ * `owners'.  If `hops' is not NULL, the number of hops each lookup took is
+ * stored there as well.  Keys are grouped by next hop, so each hop handles
+ * a whole group with one message.
+ *
+ * Returns the number of ids that could not be resolved; their owner is 0.
+ */
+int triad_lookup_batch(node_t *n, const chord_id_t *ids, size_t count, chord_id_t *owners, unsigned int *hops)
+{
+	lookup_batch_t *b = batch_new(count);
+	b->ids = ids;
+	b->count = count;
+	batch_route(n, b);
+	pthread_mutex_lock(&(b->lock));
+	while (b->outstanding)
+		n->transport->ops->wait(&(b->cond), &(b->lock));
+	pthread_mutex_unlock(&(b->lock));
+	memcpy(owners, b->owners, count * sizeof(chord_id_t));
+	if (hops)
+		memcpy(hops, b->hops, count * sizeof(unsigned int));
+	int failed = b->failed;
+	batch_free(b);
+	return failed;
+}
+
+/*
+ * Sends the key/value request `m' for `id' to the owner of `id', and stores
+ * the acknowledgement in `ack'.  The request is served in place if `n' is
+ * the owner, except for writes its replicas need to see.  A node that turns
+ * the request down (found through a stale location cache, or just after
+ * keys moved) names the node it takes for the owner, which is asked next;
+ * with no such node, the owner is looked up again.  Returns 0 if no owner
+ * answered within four tries.
+ */
+static int kv_call(node_t *n, chord_id_t id, msg_t *m, msg_t *ack)
+{
+	chord_id_t owner = find_successor(n, id);
+	int attempt;
+	for (attempt = 0; owner && (attempt < 4); attempt++) {
+		/* writes to be copied to replicas go through the server */
+		if ((owner == n->id) && ((m->type == MSG_GET) || (n->replicas <= 0)))
+			kv_serve(n, m, ack);
+		else if (rpc_call(n, owner, m, ack, -1) < 0)
+			ack->type = 0;
+		if ((ack->type == m->type + 1) && (ack->data[1] == owner))
+			return 1;
+		location_invalidate(n, owner);
+		owner = (((ack->type == m->type + 1) && ack->data[1]) ? ack->data[1] : find_successor(n, id));
+	}
+	return 0;
+}
+
+/*
+ * Tries the get `m' on the nearest copy of its key: the one of `n' if it
+ * is the owner or one of its first n->replicas successors, else the one of
+ * the node among those with the lowest round-trip time (a node not measured
+ * yet counts as nearest, so each gets measured).  The replicas are found as
+ * the owners of the ids right after the owner, so the location cache keeps
+ * them.  Returns 1 with the value in `ack' if that copy was there.
+ */
+static int kv_nearest(node_t *n, msg_t *m, msg_t *ack)
+{
+	chord_id_t owner = find_successor(n, m->data[0]), node = owner, best = 0;
+	long long lowest = 0, rtt;
+	int i;
+	for (i = 0; node && (i <= n->replicas); i++) {
+		if (node == n->id) {
+			best = node;
+			break;
+		}
+		if (((rtt = rpc_rtt(n->transport, node)) >= 0) && (!best || (rtt < lowest))) {
+			best = node;
+			lowest = rtt;
+		}
+		if ((node = find_successor(n, node + 1)) == owner)
+			break;
+	}
+	if (!best)
+		return 0;
+	m->type = MSG_GET_REPLICA;
+	if (best == n->id)
+		kv_serve(n, m, ack);
+	else if (rpc_call(n, best, m, ack, -1) < 0) {
+		location_invalidate(n, best);
+		ack->type = 0;
+	}
+	m->type = MSG_GET;
+	return ((ack->type == MSG_GET_REPLICA_ACK) && ack->data[0]);
+}
+
+/* fills in a key/value request of type `type' for key `key' of `klen' bytes,
+ * followed by `vlen' bytes of `value'; returns 0 if they do not fit */
+static int kv_request(msg_t *m, msg_type_t type, const void *key, size_t klen, const void *value, size_t vlen)
+{
+	if ((klen + vlen) > MSG_PAYLOAD)
+		return 0;
+	m->type = type;
+	m->data[0] = triad_hash(key, klen);
+	m->data[1] = klen;
+	m->count = klen + vlen;
+	memcpy(m->payload, key, klen);
+	if (vlen)
+		memcpy(m->payload + klen, value, vlen);
+	return 1;
+}
+
+/*
+ * Stores the `vlen' bytes at `value' under application key `key' of `klen'
+ * bytes, on the node the key hashes onto.  Key and value together take at
+ * most MSG_PAYLOAD bytes.  Returns 1 once the owner has stored it, 0 if it
+ * could not be reached.
+ */
+int triad_put(node_t *n, const void *key, size_t klen, const void *value, size_t vlen)
+{
+	msg_t m, ack;
+	if (!kv_request(&m, MSG_PUT, key, klen, value, vlen))
+		return 0;
+	return (kv_call(n, m.data[0], &m, &ack) && ack.data[0]);
+}
+
+/*
+ * Fetches the value of application key `key' of `klen' bytes and copies up
+ * to `size' bytes of it to `value'.  With n->replicas set, the nearest copy
+ * of the key is read, and the owner only if that copy is missing.  Returns
+ * the length of the value, or -1 if the key is not stored or its owner
+ * could not be reached.
+ */
+int triad_get(node_t *n, const void *key, size_t klen, void *value, size_t size)
+{
+	msg_t m, ack;
+	if (!kv_request(&m, MSG_GET, key, klen, NULL, 0))
+		return -1;
+	if (((n->replicas <= 0) || !kv_nearest(n, &m, &ack)) && (!kv_call(n, m.data[0], &m, &ack) || !ack.data[0]))
+		return -1;
+	memcpy(value, ack.payload, ((ack.count < size) ? ack.count : size));
+	return ack.count;
 }
 
-char *triad_lookup(node_t *n, unsigned int id)
+/* removes application key `key' of `klen' bytes; returns 1 if it was stored */
+int triad_del(node_t *n, const void *key, size_t klen)
 {
-	unsigned int node = find_successor(n, id);
-	return idtostr(node);
+	msg_t m, ack;
+	if (!kv_request(&m, MSG_DEL, key, klen, NULL, 0))
+		return 0;
+	return (kv_call(n, m.data[0], &m, &ack) && ack.data[0]);
 }
@@ -1,21 +1,75 @@
 #ifndef __TRIAD_H__
 #define __TRIAD_H__
 
+#include <stddef.h>
+#include <pthread.h>
 #include "inet.h"
 
 #define RPC_PORT 12345
 #define COM_PORT 12346
-#define KEYSPACE 32
+#ifndef KEYSPACE
+#define KEYSPACE 32         // bits in an id: 32 or 64, the same on every node
+#endif
+
+#define PEER_TABLE 64       // initial size of the peer directory (power of two)
+#define RPC_EVENTS 64       // events handled per wakeup of the RPC server
+#define RPC_PENDING 1024    // most outstanding calls per transport (power of two)
+#define RPC_PENDING_INIT 8  // room for outstanding calls a transport starts with, doubled as needed
+#define RPC_TIMEOUT 5000    // ms before a nested call of the server gives up
+#define RPC_RTO_INIT 200    // ms before the first retransmission to a new peer
+#define RPC_RTO_MIN 10      // ms, lower bound of the retransmission timeout
+#define RPC_RTO_MAX 2000    // ms, upper bound of the retransmission timeout
+#define RPC_RETRIES 6       // retransmissions before a call gives up
+#define RPC_REPLAY 128      // recent requests remembered for duplicate suppression (by default)
+#define RPC_BATCH 32        // most datagrams the RPC thread receives per system call (up to IN_BATCH)
+#define SHM_SLOTS 256       // messages the shared-memory inbox of a transport holds (power of two)
+#define SHM_RECHECK 1000    // ms before the inbox of a peer on this host is looked for again
+#define BATCH_KEYS 128      // keys carried by one batched lookup message
+#define MSG_PAYLOAD 1024    // bytes of key and value carried by one message
+#define WIRE_VERSION 1      // of the wire format, in the header of every frame
+#define WIRE_DATAGRAM 4096  // largest datagram, which holds the largest message
+#define WIRE_COALESCE 1400  // bytes of frames gathered into one datagram, at most
+#define WIRE_OUTBOX 16      // destinations a thread gathers frames for at once
+#define KV_TABLE 64         // initial size of the key/value table (power of two)
+#define KV_SLAB 65536       // bytes the key/value store allocates at a time
+#define KV_CHUNK 32         // smallest chunk a key and value are stored in
+#define KV_CLASSES 6        // chunk sizes KV_CHUNK << c, up to MSG_PAYLOAD
+#define MIGRATE_BUFFER 262144  // bytes per write when keys move over TCP
+#define MIGRATE_LOCKED 1    // seconds the locked end of a migration may wait on the peer
+#define LOCATION_CACHE 256  // key ranges whose owner a node remembers
+#define SUCCESSORS 8        // length of the successor list, the most replicas a key has
+#define REPLICAS 0          // successors that keep a copy of every key (the same on every node)
+#define STABILIZE_INTERVAL 500  // ms between stabilization rounds of a node
+#define STABILIZE_JITTER 25     // % by which a round may come early or late
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 2       // most detailed trace records compiled in (see trace_level_t)
+#endif
+#define TRACE_RECORDS 4096  // trace records each thread keeps (power of two)
+#define STATS_TYPES 64      // message types counted, more than there are
+#define STATS_BUCKETS 192   // of a latency histogram: 8 per power of two of us, up to 64 s
+#define STATS_HOPS 32       // hops per lookup told apart, the last counting any more
 
 
 /**
  * Chord structures
  */
 
+/* ids of nodes and keys, which wrap around at 2^KEYSPACE; PRIid is their
+ * printf conversion, as in "%" PRIid */
+#if KEYSPACE == 32
+typedef unsigned int chord_id_t;
+#define PRIid "u"
+#elif KEYSPACE == 64
+typedef unsigned long long chord_id_t;
+#define PRIid "llu"
+#else
+#error "KEYSPACE must be 32 or 64"
+#endif
+
 typedef struct finger {
-	unsigned int start;
-	unsigned int end;
-	unsigned int successor;
+	chord_id_t start;
+	chord_id_t end;
+	chord_id_t successor;
 } finger_t;
 
 typedef enum status {
@@ -23,14 +77,37 @@ typedef enum status {
 	ST_CONNECTED,
 } status_t;
 
-typedef struct node {
-	status_t status;
-	unsigned int id;
-	unsigned int predecessor;
-	unsigned int successor;
-	finger_t finger_table[KEYSPACE];
-	pthread_t rpc_thread;
-} node_t;
+/* ids in (predecessor, owner] are located on owner */
+typedef struct location {
+	chord_id_t predecessor;
+	chord_id_t owner;
+	unsigned long used;
+} location_t;
+
+/* a consistent copy of the routing state of a node, taken at `version' */
+typedef struct route {
+	unsigned int version;
+	chord_id_t predecessor;
+	chord_id_t successor;
+	chord_id_t successors[SUCCESSORS];
+	int nsuccessors;
+	chord_id_t fingers[KEYSPACE];
+	chord_id_t finger_offsets[KEYSPACE];
+	chord_id_t finger_nodes[KEYSPACE + 1];
+} route_t;
+
+/* where node `id' is reached: the RPC server at `addr':`port', both in
+ * network byte order as in struct sockaddr_in */
+typedef struct endpoint {
+	chord_id_t id;
+	unsigned int addr;
+	unsigned short port;
+} endpoint_t;
+
+typedef enum routing {
+	ROUTE_ITERATIVE = 0,  // the originator queries every hop itself
+	ROUTE_RECURSIVE,      // hops forward the query; the last one answers
+} routing_t;
 
 
 /**
@@ -58,55 +135,540 @@ typedef enum msg_type {
 	MSG_FIND_SUCCESSOR_ACK,
 	MSG_FIND_PREDECESSOR,
 	MSG_FIND_PREDECESSOR_ACK,
-	MSG_UPDATE_FINGER_TABLE_JOIN,
-	MSG_UPDATE_FINGER_TABLE_JOIN_ACK,
-	MSG_UPDATE_FINGER_TABLE_LEAVE,
-	MSG_UPDATE_FINGER_TABLE_LEAVE_ACK,
+	MSG_NOTIFY,
+	MSG_NOTIFY_ACK,
+	MSG_FIND_SUCCESSOR_BATCH,
+	MSG_FIND_SUCCESSOR_BATCH_ACK,
+	MSG_FIND_NEXT_HOP,
+	MSG_FIND_NEXT_HOP_ACK,
+	MSG_FIND_SUCCESSOR_RECURSIVE,
+	MSG_FIND_SUCCESSOR_RECURSIVE_ACK,
+	MSG_PUT,
+	MSG_PUT_ACK,
+	MSG_GET,
+	MSG_GET_ACK,
+	MSG_DEL,
+	MSG_DEL_ACK,
+	MSG_PUT_REPLICA,
+	MSG_PUT_REPLICA_ACK,
+	MSG_GET_REPLICA,
+	MSG_GET_REPLICA_ACK,
+	MSG_DEL_REPLICA,
+	MSG_DEL_REPLICA_ACK,
+	MSG_GET_STATS,
+	MSG_GET_STATS_ACK,
 } msg_type_t;
 
 typedef struct msg {
 	msg_type_t type;
-	unsigned int data[2];
+	unsigned int rid;  // request id, echoed back in the acknowledgement
+	chord_id_t to;     // node addressed, among those sharing the server
+	chord_id_t data[2];
+	/* where to reach the nodes named in data[], for the message types
+	 * that name any (addr is 0 if the sender did not know) */
+	unsigned int addr[2];
+	unsigned short port[2];
+	/* only sent for batched messages (keys in a request, (owner, hops)
+	 * pairs in an acknowledgement), recursive lookups (the address and
+	 * port of the originator, in host byte order), key/value messages
+	 * (`count' bytes of payload: the key, then the value),
+	 * MSG_GET_PREDECESSOR_ACK (the successor list of the sender, as
+	 * `count' endpoint_t) and MSG_GET_STATS_ACK (`count' bytes of
+	 * (word, value) pairs, as varints) */
+	unsigned int count;
+	union {
+		chord_id_t batch[2 * BATCH_KEYS];
+		unsigned char payload[MSG_PAYLOAD];
+	};
 } msg_t;
 
+/* what is sent on the TCP connections that move keys between nodes */
+typedef enum migrate_op {
+	MIGRATE_PULL = 1,  // `to' hands its keys in (lo, hi] over to `from'
+	MIGRATE_PUSH,      // `from', leaving, hands its keys in (lo, hi] to `to'
+	MIGRATE_PUT,       // a key and its value
+	MIGRATE_DEL,       // a key deleted after it was sent
+	MIGRATE_END,       // answered with one byte once everything is applied
+} migrate_op_t;
+
+/* opens a connection; the stream server of the transport of `to' serves it */
+typedef struct migrate_request {
+	migrate_op_t op;
+	chord_id_t to;
+	chord_id_t from;
+	chord_id_t lo;
+	chord_id_t hi;
+	chord_id_t predecessor;  // of `from', which `to' adopts after a push
+	/* where to reach `from' and `predecessor' (addr 0 if unknown), which
+	 * `to' names to clients as soon as it hands over */
+	unsigned int addr[2];
+	unsigned short port[2];
+} migrate_request_t;
+
+/* a record of the stream that follows, followed by `klen' bytes of key and
+ * `vlen' bytes of value */
+typedef struct migrate_record {
+	migrate_op_t op;
+	unsigned short klen;
+	unsigned short vlen;
+	chord_id_t id;
+} migrate_record_t;
+
+typedef enum rpc_state {
+	RQ_NEW = 0,
+	RQ_NEXT_HOP,         // waiting for the successor and next hop of hop `i'
+	RQ_BATCH,            // waiting for the next hops of a batch of keys
+	RQ_REPLICATE,        // waiting for the replicas of a key to take a write
+} rpc_state_t;
+
+struct lookup_batch;
+
+/* a request that is suspended while the server makes a nested call */
+typedef struct rpc_request {
+	rpc_state_t state;
+	msg_t m;
+	inet_host_t from;
+	chord_id_t i;        // hop asked, or what a replicated write answers
+	int outstanding;     // replicas yet to confirm a write
+	struct lookup_batch *batch;  // kept across reuse once allocated
+	struct rpc_request *next;
+} rpc_request_t;
+
+struct node;
+
+/* called on the RPC thread with the acknowledgement, or NULL on timeout */
+typedef void (*rpc_callback_t)(struct node *, void *, msg_t *);
+
+/* an outstanding call, matched to its acknowledgement by request id;
+ * times are in us on the monotonic clock */
+typedef struct rpc_pending {
+	unsigned int rid;     // 0 if the slot is free
+	struct node *node;    // node calling
+	chord_id_t id;        // node called
+	int retries;          // retransmissions so far
+	int sample;           // whether the round trip measures the network alone
+	long long sent;
+	long long rto;
+	long long retransmit;
+	long long deadline;   // 0 for none
+	rpc_callback_t callback;
+	void *arg;
+	inet_host_t remote;
+	msg_t m;              // kept for retransmission
+} rpc_pending_t;
+
+/* a request recently received by the server, and its acknowledgement once
+ * sent, so retransmitted requests are not served twice */
+typedef struct rpc_replay {
+	unsigned int addr;
+	unsigned short port;
+	unsigned int rid;     // 0 if the slot is free
+	int answered;
+	msg_t ack;
+} rpc_replay_t;
+
+/* a group of keys sent on to the same next hop in one message */
+typedef struct batch_part {
+	struct lookup_batch *b;
+	chord_id_t node;
+	size_t first;
+	unsigned int count;
+} batch_part_t;
+
+/* a batch of keys being resolved, at the origin or at an intermediate hop */
+typedef struct lookup_batch {
+	const chord_id_t *ids;
+	chord_id_t *owners;
+	unsigned int *hops;
+	chord_id_t *next;    // next hop of each key, or the local node if resolved
+	size_t count;
+	batch_part_t *parts;
+	int outstanding;
+	int failed;
+	rpc_request_t *r;    // the request to answer, for intermediate hops
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} lookup_batch_t;
+
+/* what a transport knows about node `id': where its RPC server is, and
+ * round-trip estimates as in RFC 6298, in us */
+typedef struct peer {
+	chord_id_t id;        // 0 if the slot is free
+	inet_host_t host;
+	long long srtt;       // 0 until the first sample
+	long long rttvar;
+	long long rto;
+} peer_t;
+
+/* a datagram in a shared-memory inbox, free for the sender that claims
+ * position `seq' and ready for the receiver once `seq' is one past it */
+typedef struct shm_slot {
+	unsigned long seq;
+	unsigned int addr;    // of the sender, in network byte order
+	unsigned short port;
+	unsigned short server;  // to the server address of the transport, or its client address
+	int size;
+	unsigned char data[WIRE_DATAGRAM];
+} shm_slot_t;
+
+/*
+ * The inbox of a transport, mapped from /dev/shm by every sender on the host
+ * (under the names of both its addresses), which takes the datagrams other
+ * transports would otherwise send it over UDP.  Senders claim slots with a
+ * compare-and-swap on `tail'; the RPC thread of the transport is the only
+ * reader, and handles each datagram in its slot.  While it sleeps, it sets
+ * `sleeping', and whoever clears it wakes it: through its eventfd from this
+ * process, and through a FIFO next to the inbox from others.
+ */
+typedef struct shm_ring {
+	unsigned int magic;
+	int pid;              // of the process the transport is in
+	unsigned short server_port;  // in network byte order
+	unsigned short client_port;
+	volatile int closed;  // set as the transport closes
+	int sleeping;
+	unsigned long tail __attribute__((aligned(64)));  // slots claimed so far
+	unsigned long head __attribute__((aligned(64)));  // slots read so far
+	shm_slot_t slots[SHM_SLOTS] __attribute__((aligned(64)));
+} shm_ring_t;
+
+struct transport;
+
+/*
+ * What transports run on: the sockets, threads and clock of the process
+ * (transport_udp, which reaches transports on the same host through their
+ * inboxes in shared memory, or transport_uring, which does the same through
+ * io_uring where it can), or a driver that carries datagrams and keeps time
+ * itself, such as the simulator in sim.c.  Such a driver hands each
+ * datagram that reaches a transport to transport_receive, and calls
+ * transport_tick whenever transport_due says so; transports still close
+ * as their last node quits.
+ */
+typedef struct transport_ops {
+	/* sets up the server and client addresses (and whatever else the
+	 * driver needs) for serving at `ip':`port'; 0 if it cannot */
+	int (*open)(struct transport *, const char *ip, unsigned short port);
+	void (*start)(struct transport *);  // once its nodes are in place
+	void (*stop)(struct transport *);   // once the last node has quit
+	/* sends a datagram from the server or client address `local' */
+	int (*send)(inet_host_t *local, inet_host_t *remote, void *data, int size);
+	/* sends `count' datagrams from `local' at once, as `send' would each
+	 * of them; NULL if the driver has no cheaper way than that */
+	int (*send_many)(inet_host_t *local, inet_datagram_t *, int count);
+	void (*wake)(struct transport *);   // transport_due moved earlier
+	/* pthread_cond_wait and pthread_cond_signal, for threads of the
+	 * application waiting on calls */
+	void (*wait)(pthread_cond_t *, pthread_mutex_t *);
+	void (*signal)(pthread_cond_t *);
+	/* if set, keys only move in place, to and from the transport of this
+	 * process serving at `remote' (NULL if there is none, or it is down);
+	 * if NULL, they go over TCP */
+	struct transport *(*reach)(const inet_host_t *remote);
+	long long (*now)(void);  // ns on a monotonic clock
+} transport_ops_t;
+
+/* the sockets and RPC thread shared by the nodes of one process that are
+ * reached at the same address and port */
+typedef struct transport {
+	const transport_ops_t *ops;
+	void *driver;         // whatever the driver of ops keeps for it
+	struct node **nodes;
+	int nnodes;           // only changes on the RPC thread once it runs
+	pthread_t rpc_thread;
+	inet_host_t server;
+	inet_host_t client;
+	int epfd;
+	int wakefd;
+	unsigned char *rx;    // RPC_BATCH datagrams of WIRE_DATAGRAM bytes, received into by the RPC thread
+	shm_ring_t *inbox;    // NULL if co-located peers cannot reach it through shared memory
+	int bellfd;           // the FIFO senders in other processes wake it through
+	rpc_request_t *free_requests;
+	/* outstanding calls, in slot (rid % pending_size); grown up to
+	 * RPC_PENDING by doubling, which keeps every call in its slot */
+	rpc_pending_t *pending;
+	unsigned int *free_slots;
+	unsigned int pending_size;
+	int nfree_slots;
+	unsigned int rid_seq;
+	long long next_deadline;
+	unsigned long retransmits;
+	pthread_mutex_t pending_lock;
+	rpc_replay_t *replay;
+	unsigned int replay_size;  // RPC_REPLAY unless open picked another
+	peer_t *peers;        // open addressing on id, grown at half full
+	unsigned int npeers;
+	unsigned int peers_size;
+	pthread_mutex_t peers_lock;
+	/* the TCP server keys move through, on the port of the RPC server
+	 * (fd -1 if it could not be opened); stream_lock is held while it
+	 * serves a connection, and keeps the nodes in place meanwhile */
+	inet_host_t stream;
+	pthread_t stream_thread;
+	volatile int stream_closing;
+	pthread_mutex_t stream_lock;
+} transport_t;
+
+
+/**
+ * Tracing
+ */
+
+/* how much gets traced: TRACE_LEVEL is the most that is compiled in, and
+ * trace_level the most that is recorded at run time */
+typedef enum trace_level {
+	TRACE_OFF = 0,
+	TRACE_EVENTS,    // joins, leaves, and calls that time out
+	TRACE_MESSAGES,  // every call, acknowledgement and request served
+} trace_level_t;
+
+typedef enum trace_event {
+	TRACE_CALL = 1,    // a call sent
+	TRACE_RETRANSMIT,  // a call sent again
+	TRACE_TIMEOUT,     // a call given up on
+	TRACE_ACK,         // the acknowledgement of a call received
+	TRACE_SERVE,       // a request received by the server
+	TRACE_ANSWER,      // the acknowledgement of a request sent
+	TRACE_FORWARD,     // a recursive lookup passed on to the next hop
+	TRACE_JOIN,        // the node joined a ring, at its successor
+	TRACE_LEAVE,       // the node left its ring, to its successor
+} trace_event_t;
+
+/* one traced event */
+typedef struct trace_record {
+	long long time;       // ns on the monotonic clock
+	chord_id_t node;      // the node it happened to
+	chord_id_t peer;      // the node at the other end, 0 if not known
+	unsigned int addr;    // where the other end is, in network byte order
+	unsigned short port;  // (0 if there is none)
+	unsigned char event;  // trace_event_t
+	unsigned char type;   // msg_type_t, 0 if there is no message
+	unsigned int rid;
+} trace_record_t;
+
+/* the latest TRACE_RECORDS records of one thread.  Only that thread writes
+ * to it, and publishes each record by advancing `head' past it; readers
+ * drop whatever it may have overwritten while they copied */
+typedef struct trace_ring {
+	struct trace_ring *next;
+	int thread;               // in the order threads first traced
+	volatile unsigned long head;  // records written so far
+	trace_record_t records[TRACE_RECORDS];
+} trace_ring_t;
+
+extern volatile int trace_level;
+
+/* records `event' if `level' is both compiled in and switched on; costs a
+ * load and a branch otherwise */
+#define TRACE(level, event, node, peer, host, m) \
+	do { \
+		if (((level) <= TRACE_LEVEL) && ((level) <= trace_level)) \
+			trace_record((event), (node), (peer), (host), (m)); \
+	} while (0)
+
+
+/**
+ * Metrics
+ */
+
+typedef enum stats_counter {
+	STATS_SENT = 0,
+	STATS_RECEIVED,
+	STATS_TIMEOUTS,  // calls given up on
+	STATS_RETRIES,   // calls sent again
+	STATS_COUNTERS,
+} stats_counter_t;
+
+/* what the nodes of a process have done since it started.  Latencies are
+ * counted in log-linear buckets (see stats_percentile), as HDR histograms
+ * do: exact up to 8 us, then within 1/8 of the value */
+typedef struct stats {
+	unsigned long long messages[STATS_TYPES][STATS_COUNTERS];  // by msg_type_t
+	unsigned long long bytes[2];  // of messages sent, and received
+	/* round trips of acknowledged calls, from the first time they were
+	 * sent, by request type: calls[type / 2] */
+	unsigned long long calls[STATS_TYPES / 2][STATS_BUCKETS];
+	unsigned long long lookups[STATS_BUCKETS];  // of route_successor, end to end
+	unsigned long long hops[STATS_HOPS];        // of route_successor
+} stats_t;
+
+/* the counts of one thread, which only it writes to; stats_collect adds up
+ * those of all threads, including the ones that are gone */
+typedef struct stats_shard {
+	struct stats_shard *next;
+	stats_t stats;
+} stats_shard_t;
+
+
+/**
+ * Key/value store
+ */
+
+/* a key and its value, stored one after the other in `data' */
+typedef struct kv_entry {
+	chord_id_t id;        // hash of the key
+	unsigned short klen;
+	unsigned short vlen;
+	unsigned char *data;  // NULL if the slot is free
+} kv_entry_t;
+
+/* the keys a node owns.  Keys and values live in chunks of KV_CHUNK << c
+ * bytes for some size class c, carved from KV_SLAB byte slabs; freed chunks
+ * go on the free list of their class for reuse, so once the store has grown
+ * to its working set, requests no longer allocate */
+typedef struct kv_store {
+	kv_entry_t *entries;  // open addressing on id, grown at half full
+	unsigned int count;
+	unsigned int size;
+	void *free_chunks[KV_CLASSES];  // linked through their first word
+	unsigned char *slab;  // the newest slab, linked to the previous one
+	size_t slab_used;     // through its first word, and bytes carved of it
+	unsigned int slabs;
+	size_t bytes;         // of keys and values stored
+	/* while the keys in (migrate_lo, migrate_hi] stream to another node,
+	 * every key in that range that is written, deleted or moved in the
+	 * table is logged as (id, klen, key), so its final state can follow */
+	int migrating;
+	int migrate_failed;         // a change could not be logged
+	chord_id_t migrate_lo;
+	chord_id_t migrate_hi;
+	unsigned int migrate_scan;  // slots of the table copied out so far
+	unsigned char *migrate_log;
+	size_t migrate_logged;
+	size_t migrate_log_size;
+	unsigned long received_keys;       // from other nodes' migrations
+	unsigned long long received_bytes;
+	pthread_mutex_t lock;
+} kv_store_t;
+
+
+/**
+ * Nodes
+ */
+
+typedef struct node {
+	status_t status;
+	routing_t routing;
+	chord_id_t id;
+	endpoint_t endpoint;  // id, and where the node is reached
+	chord_id_t predecessor;  // 0 while unknown
+	chord_id_t successor;
+	/* the nodes that follow, nearest first and starting with the
+	 * successor (empty while it is this node); stabilization fills it in
+	 * from the list of the successor */
+	chord_id_t successors[SUCCESSORS];
+	int nsuccessors;
+	finger_t finger_table[KEYSPACE];
+	/* the distinct successors in finger_table other than this node, by
+	 * distance from it: finger_offsets holds (successor - id - 1) in
+	 * ascending order, padded with ~0, and finger_nodes[i + 1] the
+	 * successor at finger_offsets[i] (finger_nodes[0] is this node) */
+	chord_id_t finger_offsets[KEYSPACE];
+	chord_id_t finger_nodes[KEYSPACE + 1];
+	/* the fields above change under a seqlock: writers serialize on
+	 * route_lock and keep route_seq odd while they are at it, and readers
+	 * retry if route_seq was odd or moved while they read */
+	unsigned int route_seq;
+	pthread_mutex_t route_lock;
+	int stabilize_interval;  // ms
+	int stabilize_jitter;    // %
+	long long next_stabilize;  // us on the monotonic clock
+	int next_finger;
+	unsigned int seed;
+	unsigned long messages;  // received by the server
+	location_t locations[LOCATION_CACHE];  // sorted by owner
+	int nlocations;
+	int location_verify;  // confirm cached owners with one RPC before use
+	int replicas;         // successors a write is copied to, and reads may go to
+	int proximity;        // pick each finger among the nodes in its interval by RTT
+	unsigned long location_clock;
+	unsigned long location_hits;
+	unsigned long location_misses;
+	pthread_mutex_t location_lock;
+	kv_store_t store;
+	transport_t *transport;
+} node_t;
+
 
 unsigned int strtoid(const char *);
-char *idtostr(int);
+char *idtostr(unsigned int, char *);
 
-int in_range_ex_ex_circular(unsigned int, unsigned int, unsigned int);
-int in_range_in_in_circular(unsigned int, unsigned int, unsigned int);
-int in_range_in_ex_circular(unsigned int, unsigned int, unsigned int);
-int in_range_ex_in_circular(unsigned int, unsigned int, unsigned int);
+int in_range_ex_ex_circular(chord_id_t, chord_id_t, chord_id_t);
+int in_range_in_in_circular(chord_id_t, chord_id_t, chord_id_t);
+int in_range_in_ex_circular(chord_id_t, chord_id_t, chord_id_t);
+int in_range_ex_in_circular(chord_id_t, chord_id_t, chord_id_t);
 
-unsigned int closest_preceding_finger(node_t *, unsigned int);
-unsigned int find_predecessor(node_t *, unsigned int);
-unsigned int find_successor(node_t *, unsigned int);
-void init_finger_table(node_t *, unsigned int);
+void route_snapshot(node_t *, route_t *);
+void finger_index(node_t *);
+const char *finger_kernel(const char *);
+chord_id_t closest_preceding_finger(node_t *, chord_id_t);
+chord_id_t find_predecessor(node_t *, chord_id_t);
+chord_id_t find_successor(node_t *, chord_id_t);
+chord_id_t route_successor(node_t *, chord_id_t, unsigned int *);
 void deinit_finger_table(node_t *);
-void update_finger_table_join(node_t *, int, unsigned int);
-void update_finger_table_leave(node_t *, int, unsigned int);
-void update_others_join(node_t *);
-void update_others_leave(node_t *);
+int location_get(node_t *, chord_id_t, chord_id_t *);
+void location_put(node_t *, chord_id_t, chord_id_t);
+void location_invalidate(node_t *, chord_id_t);
+void location_clear(node_t *);
 void print_node(node_t *);
 
-unsigned int rpc_get_status(unsigned int);
-int rpc_set_status(unsigned int, status_t);
-unsigned int rpc_get_successor(unsigned int);
-int rpc_set_successor(unsigned int, unsigned int);
-unsigned int rpc_get_predecessor(unsigned int);
-int rpc_set_predecessor(unsigned int, unsigned int);
-unsigned int rpc_get_closest_preceding_finger(unsigned int, unsigned int);
-unsigned int rpc_find_predecessor(unsigned int, unsigned int);
-unsigned int rpc_find_successor(unsigned int, unsigned int);
-int rpc_update_finger_table_join(unsigned int, unsigned int, unsigned int);
-int rpc_update_finger_table_leave(unsigned int, unsigned int, unsigned int);
+const char *msg_name(msg_type_t);
+void trace_record(trace_event_t, chord_id_t, chord_id_t, const inet_host_t *, const msg_t *);
+void trace_clear(void);
+int trace_dump(FILE *);
+void stats_collect(stats_t *);
+long long stats_percentile(const unsigned long long *, double);
+void stats_print(const stats_t *, FILE *);
+
+extern const transport_ops_t transport_udp;
+extern const transport_ops_t transport_uring;
+extern volatile int transport_shared;
+extern volatile int transport_batch;
+extern int transport_rcvbuf;
+extern int transport_sndbuf;
+extern int transport_busy_poll;
+void triad_transport(const transport_ops_t *);
+int transport_receive(transport_t *, inet_host_t *, inet_host_t *, const void *, int);
+long long transport_tick(transport_t *);
+long long transport_due(transport_t *);
+
+int msg_encode(const msg_t *, unsigned char *, int);
+int msg_decode(const unsigned char *, int, msg_t *);
+int msg_send(inet_host_t *, inet_host_t *, msg_t *);
+int msg_receive(inet_host_t *, inet_host_t *, msg_t *, int);
+int rpc_call_async(node_t *, chord_id_t, msg_t *, int, rpc_callback_t, void *);
+int rpc_call(node_t *, chord_id_t, msg_t *, msg_t *, int);
+unsigned int rpc_get_status(node_t *, chord_id_t);
+int rpc_set_status(node_t *, chord_id_t, status_t);
+chord_id_t rpc_get_successor(node_t *, chord_id_t);
+int rpc_set_successor(node_t *, chord_id_t, chord_id_t);
+chord_id_t rpc_get_predecessor(node_t *, chord_id_t);
+int rpc_set_predecessor(node_t *, chord_id_t, chord_id_t);
+chord_id_t rpc_get_closest_preceding_finger(node_t *, chord_id_t, chord_id_t);
+chord_id_t rpc_find_predecessor(node_t *, chord_id_t, chord_id_t);
+chord_id_t rpc_find_successor(node_t *, chord_id_t, chord_id_t);
+int rpc_find_next_hop(node_t *, chord_id_t, chord_id_t, chord_id_t *, chord_id_t *);
+chord_id_t rpc_find_successor_recursive(node_t *, chord_id_t, chord_id_t, chord_id_t *, unsigned int *);
+int rpc_notify(node_t *, chord_id_t, chord_id_t);
+int rpc_get_stats(node_t *, chord_id_t, stats_t *);
 
 void *rpc_handler(void *);
 
 node_t *triad_init(const char *);
+int triad_init_virtual(const char *, unsigned short, int, node_t **);
+chord_id_t triad_hash(const void *, size_t);
+chord_id_t triad_node_id(const char *, unsigned short, int);
+void triad_endpoint_at(endpoint_t *, const char *, unsigned short, int);
+void triad_introduce(node_t *, const endpoint_t *);
 int triad_deinit(node_t *);
 int triad_join(node_t *, const char *);
+int triad_join_endpoint(node_t *, const endpoint_t *);
+int triad_endpoint(node_t *, chord_id_t, endpoint_t *);
 int triad_leave(node_t *);
-char *triad_lookup(node_t *, unsigned int);
+char *triad_lookup(node_t *, chord_id_t, char *);
+char *triad_lookup_key(node_t *, const void *, size_t, char *);
+int triad_lookup_batch(node_t *, const chord_id_t *, size_t, chord_id_t *, unsigned int *);
+int triad_put(node_t *, const void *, size_t, const void *, size_t);
+int triad_get(node_t *, const void *, size_t, void *, size_t);
+int triad_del(node_t *, const void *, size_t);
 
 #endif /* __TRIAD_H__ */